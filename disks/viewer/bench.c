@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "fat.h"
+
+#define SECTOR_SIZE 512
+
+void kprintf(const char* pattern, ...) {
+	va_list args;
+	va_start(args, pattern);
+	vprintf(pattern, args);
+	va_end(args);
+}
+
+// fat.c keeps the cluster chain maps in memory taken from the kernel allocator
+void* kmalloc(unsigned int size) {
+	return malloc(size);
+}
+
+void* krealloc(void* pointer, unsigned int size) {
+	void* moved = realloc(pointer, size);
+
+	// The kernel allocator frees the area if it can't be enlarged
+	if (moved == NULL) {
+		free(pointer);
+	}
+	return moved;
+}
+
+// in-memory disk image, all accesses go through the counting callbacks below
+typedef struct {
+	unsigned char* data;
+	unsigned int size;
+
+	unsigned long reads;
+	unsigned long read_bytes;
+	unsigned long writes;
+	unsigned long write_bytes;
+
+	// simulated head movement, sum of the distances between the end of
+	// one access and the start of the next one, in bytes
+	unsigned long long seek_distance;
+	unsigned int head;
+} bench_image;
+
+static void bench_seek(bench_image* image, unsigned int offset, unsigned int size) {
+	image->seek_distance += (offset > image->head) ? offset - image->head : image->head - offset;
+	image->head = offset + size;
+}
+
+void bench_read_func(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	bench_image* image = (bench_image*)user_args;
+	bench_seek(image, offset_in, size_in);
+	image->reads++;
+	image->read_bytes += size_in;
+	memcpy(data_out, image->data + offset_in, size_in);
+}
+
+void bench_write_func(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	bench_image* image = (bench_image*)user_args;
+	bench_seek(image, offset_in, size_in);
+	image->writes++;
+	image->write_bytes += size_in;
+	memcpy(image->data + offset_in, data_in, size_in);
+}
+
+static void bench_reset(bench_image* image) {
+	image->reads = 0;
+	image->read_bytes = 0;
+	image->writes = 0;
+	image->write_bytes = 0;
+	image->seek_distance = 0;
+	image->head = 0;
+}
+
+// create an empty FAT32 volume in the image, laid out the same way as mkfs.msdos -F 32 would
+static void bench_format(bench_image* image, unsigned int sectors_per_cluster) {
+	unsigned int total_sectors = image->size / SECTOR_SIZE;
+	unsigned int reserved_sectors = 32;
+
+	// the FAT has to cover the clusters that remain after the FATs themselves are placed
+	unsigned int fat_size = 1;
+	while (1) {
+		unsigned int clusters = (total_sectors - reserved_sectors - 2 * fat_size) / sectors_per_cluster;
+		unsigned int needed = ((clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		if (needed <= fat_size) {
+			break;
+		}
+		fat_size = needed;
+	}
+
+	unsigned int clusters = (total_sectors - reserved_sectors - 2 * fat_size) / sectors_per_cluster;
+
+	// only the metadata and the root directory are cleared, the library clears every cluster it allocates
+	// for a directory, so the rest of a large image is never touched and stays sparse
+	memset(image->data, 0, (reserved_sectors + 2 * fat_size + sectors_per_cluster) * SECTOR_SIZE);
+
+	fat_bpb bpb;
+	memset(&bpb, 0, sizeof(bpb));
+	memcpy(bpb.BS_jmpBoot, "\xEB\x58\x90", 3);
+	memcpy(bpb.BS_OEMName, "NEOSBNCH", 8);
+	bpb.BPB_BytsPerSec = SECTOR_SIZE;
+	bpb.BPB_SecPerClus = sectors_per_cluster;
+	bpb.BPB_RsvdSecCnt = reserved_sectors;
+	bpb.BPB_NumFATs = 2;
+	bpb.BPB_Media = 0xF8;
+	bpb.BPB_SecPerTrk = 32;
+	bpb.BPB_NumHeads = 64;
+	bpb.BPB_TotSec32 = total_sectors;
+	bpb.BPB_FATSz32 = fat_size;
+	bpb.BPB_RootClus = 2;
+	bpb.BPB_FSInfo = 1;
+	bpb.BPB_BkBootSec = 6;
+	bpb.BS_DrvNum = 0x80;
+	bpb.BS_BootSig = 0x29;
+	bpb.BS_VolID = 0x12345678;
+	memcpy(bpb.BS_VolLab, "NO NAME    ", 11);
+	memcpy(bpb.BS_FilSysType, "FAT32   ", 8);
+
+	memcpy(image->data, &bpb, sizeof(bpb));
+	image->data[510] = 0x55;
+	image->data[511] = 0xAA;
+
+	fat_fsinfo fsinfo;
+	memset(&fsinfo, 0, sizeof(fsinfo));
+	fsinfo.FSI_LeadSig = 0x41615252;
+	fsinfo.FSI_StrucSig = 0x61417272;
+	fsinfo.FSI_Free_Count = clusters - 1;
+	fsinfo.FSI_Nxt_Free = 3;
+	fsinfo.FSI_TrailSig = 0xAA550000;
+	memcpy(image->data + SECTOR_SIZE, &fsinfo, sizeof(fsinfo));
+
+	// media descriptor, end of chain marker and the root directory cluster
+	unsigned int entries[3] = { 0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF };
+	for (int i = 0; i < 2; i++) {
+		memcpy(image->data + (reserved_sectors + i * fat_size) * SECTOR_SIZE, entries, sizeof(entries));
+	}
+}
+
+/* workloads */
+
+#define SEQUENTIAL_SIZE (4 * 1024 * 1024)
+#define SEQUENTIAL_CHUNK 4096
+#define APPEND_COUNT 4000
+#define APPEND_SIZE 64
+#define DEEP_LEVELS 8
+#define DEEP_LOOKUPS 1000
+#define LISTING_FILES 500
+#define LISTING_PASSES 5
+#define CHURN_ROUNDS 300
+#define HIGH_FILE_SIZE (1024 * 1024)
+#define HIGH_TAIL_CLUSTERS 4096
+
+// returned by a workload that can't run on the volume, a failure is always a real one
+#define BENCH_SKIPPED -1
+
+static void sequential_read_setup(fat_DISK* disk) {
+	unsigned char* buffer = malloc(SEQUENTIAL_SIZE);
+	for (int i = 0; i < SEQUENTIAL_SIZE; i++) {
+		buffer[i] = (unsigned char)(i * 7);
+	}
+
+	fat_FILE file;
+	fat_create_file(&file, &disk->root_directory, "sequential.bin", 0);
+	fat_fwrite(buffer, 1, SEQUENTIAL_SIZE, &file);
+	free(buffer);
+}
+
+static int sequential_read_run(fat_DISK* disk) {
+	unsigned char buffer[SEQUENTIAL_CHUNK];
+	fat_FILE file;
+
+	if (!fat_fopen(&file, &disk->root_directory, "sequential.bin", "r")) {
+		return 0;
+	}
+
+	for (int offset = 0; offset < SEQUENTIAL_SIZE; offset += SEQUENTIAL_CHUNK) {
+		fat_fread(buffer, 1, SEQUENTIAL_CHUNK, &file);
+		if (buffer[0] != (unsigned char)(offset * 7)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void small_append_setup(fat_DISK* disk) {
+	fat_FILE file;
+	fat_create_file(&file, &disk->root_directory, "append.log", 0);
+}
+
+static int small_append_run(fat_DISK* disk) {
+	unsigned char record[APPEND_SIZE];
+	fat_FILE file;
+
+	if (!fat_fopen(&file, &disk->root_directory, "append.log", "a")) {
+		return 0;
+	}
+
+	for (int i = 0; i < APPEND_COUNT; i++) {
+		memset(record, 'a' + i % 26, sizeof(record));
+		if (!fat_fwrite(record, 1, sizeof(record), &file)) {
+			return 0;
+		}
+	}
+
+	return fat_ftell(&file) == APPEND_COUNT * APPEND_SIZE;
+}
+
+static void deep_lookup_path(char* path, int levels) {
+	path[0] = '\0';
+	for (int i = 0; i < levels; i++) {
+		sprintf(path + strlen(path), "%sdirectory_level_%d", (i == 0) ? "" : "/", i);
+	}
+}
+
+static void deep_lookup_setup(fat_DISK* disk) {
+	char path[512];
+	fat_DIR dir;
+	fat_FILE file;
+
+	for (int level = 1; level <= DEEP_LEVELS; level++) {
+		deep_lookup_path(path, level);
+		fat_create_dir(&dir, &disk->root_directory, path, 0);
+
+		// some siblings on every level so that lookups have something to skip over
+		for (int i = 0; i < 16; i++) {
+			char name[64];
+			sprintf(name, "sibling_file_%d.txt", i);
+			fat_create_file(&file, &dir, name, 0);
+		}
+	}
+
+	strcat(path, "/target.txt");
+	fat_create_file(&file, &disk->root_directory, path, 0);
+	fat_fwrite("target", 1, 6, &file);
+}
+
+static int deep_lookup_run(fat_DISK* disk) {
+	char path[512];
+	fat_FILE file;
+
+	deep_lookup_path(path, DEEP_LEVELS);
+	strcat(path, "/target.txt");
+
+	for (int i = 0; i < DEEP_LOOKUPS; i++) {
+		if (!fat_fopen(&file, &disk->root_directory, path, "r")) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void listing_setup(fat_DISK* disk) {
+	fat_DIR dir;
+	fat_FILE file;
+
+	fat_create_dir(&dir, &disk->root_directory, "listing", 0);
+
+	for (int i = 0; i < LISTING_FILES; i++) {
+		char name[64];
+		sprintf(name, "listed_file_number_%d.dat", i);
+		fat_create_file(&file, &dir, name, 0);
+	}
+}
+
+static int listing_run(fat_DISK* disk) {
+	fat_DIR dir;
+	fat_DIR entry_dir;
+	fat_FILE entry_file;
+
+	if (!fat_opendir(&dir, &disk->root_directory, "listing")) {
+		return 0;
+	}
+
+	for (int pass = 0; pass < LISTING_PASSES; pass++) {
+		int count = 0;
+
+		fat_rewinddir(&dir);
+		while (fat_readdir(&entry_dir, &entry_file, &dir) != fat_NOT_FOUND) {
+			count++;
+		}
+
+		// . and .. are listed too
+		if (count != LISTING_FILES + 2) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void churn_setup(fat_DISK* disk) {
+	fat_DIR dir;
+	fat_FILE file;
+
+	fat_create_dir(&dir, &disk->root_directory, "churn", 0);
+
+	for (int i = 0; i < 50; i++) {
+		char name[64];
+		sprintf(name, "resident_%d.txt", i);
+		fat_create_file(&file, &dir, name, 0);
+	}
+}
+
+static int churn_run(fat_DISK* disk) {
+	fat_DIR dir;
+	fat_FILE file;
+
+	if (!fat_opendir(&dir, &disk->root_directory, "churn")) {
+		return 0;
+	}
+
+	for (int i = 0; i < CHURN_ROUNDS; i++) {
+		char name[64];
+		sprintf(name, "temporary_file_%d.tmp", i);
+
+		if (!fat_create_file(&file, &dir, name, 0)) {
+			return 0;
+		}
+
+		fat_fwrite(name, 1, strlen(name), &file);
+
+		if (!fat_remove(&dir, name, 1)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void high_cluster_setup(fat_DISK* disk) {
+	unsigned char* buffer = malloc(HIGH_FILE_SIZE);
+	for (int i = 0; i < HIGH_FILE_SIZE; i++) {
+		buffer[i] = (unsigned char)(i * 11);
+	}
+
+	// start allocating near the end of the volume, on large volumes the
+	// cluster numbers then no longer fit into DIR_FstClusLO alone
+	if (disk->cluster_count > HIGH_TAIL_CLUSTERS + 2) {
+		disk->next_free = disk->cluster_count - HIGH_TAIL_CLUSTERS;
+	}
+
+	fat_DIR dir;
+	fat_FILE file;
+	fat_create_dir(&dir, &disk->root_directory, "high", 0);
+	fat_create_dir(&dir, &disk->root_directory, "high/nested", 0);
+	fat_create_file(&file, &disk->root_directory, "high/nested/data.bin", 0);
+	fat_fwrite(buffer, 1, HIGH_FILE_SIZE, &file);
+	free(buffer);
+}
+
+static int high_cluster_run(fat_DISK* disk) {
+	unsigned char buffer[SEQUENTIAL_CHUNK];
+	fat_FILE file;
+
+	// on smaller volumes DIR_FstClusHI stays zero and the workload would check nothing
+	if (disk->cluster_count <= 65536) {
+		return BENCH_SKIPPED;
+	}
+
+	if (!fat_fopen(&file, &disk->root_directory, "high/nested/data.bin", "r")) {
+		return 0;
+	}
+
+	if (fat_first_cluster(&file.fat_dir) < disk->cluster_count - HIGH_TAIL_CLUSTERS || fat_first_cluster(&file.fat_dir) <= 0xFFFF) {
+		return 0;
+	}
+
+	for (int offset = 0; offset < HIGH_FILE_SIZE; offset += SEQUENTIAL_CHUNK) {
+		fat_fread(buffer, 1, SEQUENTIAL_CHUNK, &file);
+		for (int i = 0; i < SEQUENTIAL_CHUNK; i++) {
+			if (buffer[i] != (unsigned char)((offset + i) * 11)) {
+				return 0;
+			}
+		}
+	}
+
+	// removing the file has to give all of its clusters back
+	unsigned int free_before = disk->free_count;
+	unsigned int cluster_size = disk->bpb.BPB_SecPerClus * disk->bpb.BPB_BytsPerSec;
+
+	if (!fat_remove(&disk->root_directory, "high/nested/data.bin", 1) || !fat_remove(&disk->root_directory, "high/nested", 0)) {
+		return 0;
+	}
+
+	if (free_before != 0xFFFFFFFF && disk->free_count - free_before < (HIGH_FILE_SIZE + cluster_size - 1) / cluster_size) {
+		return 0;
+	}
+
+	return !fat_fopen(&file, &disk->root_directory, "high/nested/data.bin", "r");
+}
+
+typedef struct {
+	const char* name;
+	void (*setup) (fat_DISK* disk);
+	int (*run) (fat_DISK* disk);
+} bench_workload;
+
+static bench_workload workloads[] = {
+	{ "sequential read", sequential_read_setup, sequential_read_run },
+	{ "small appends", small_append_setup, small_append_run },
+	{ "deep lookup", deep_lookup_setup, deep_lookup_run },
+	{ "large listing", listing_setup, listing_run },
+	{ "create/delete churn", churn_setup, churn_run },
+	{ "high clusters", high_cluster_setup, high_cluster_run },
+};
+
+static double bench_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char** argv) {
+	unsigned int size_mb = (argc > 1) ? atoi(argv[1]) : 64;
+	unsigned int sectors_per_cluster = (argc > 2) ? atoi(argv[2]) : 1;
+
+	// the library addresses the device with 32 bit byte offsets
+	if (size_mb == 0 || size_mb >= 4096) {
+		printf("Error: The image size has to be between 1 and 4095 MB\n");
+		return 1;
+	}
+
+	if (sectors_per_cluster == 0 || sectors_per_cluster > 128 || (sectors_per_cluster & (sectors_per_cluster - 1)) != 0) {
+		printf("Error: Sectors per cluster has to be a power of two up to 128\n");
+		return 1;
+	}
+
+	// large images rely on calloc handing out lazily zeroed pages, so only the touched parts take memory
+	bench_image image;
+	image.size = size_mb * 1024 * 1024;
+	image.data = calloc(image.size, 1);
+
+	if (image.data == NULL) {
+		printf("Error: Could not allocate %u MB image\n", size_mb);
+		return 1;
+	}
+
+	// the disk holds the caches, it is too large for the stack
+	fat_DISK* disk = malloc(sizeof(fat_DISK));
+
+	printf("%u MB image, %u byte clusters\n", size_mb, sectors_per_cluster * SECTOR_SIZE);
+	printf("%-20s %8s %10s %8s %10s %12s %10s %s\n", "workload", "reads", "read KB", "writes", "write KB", "seek KB", "time ms", "result");
+
+	for (unsigned int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		bench_workload* workload = &workloads[i];
+
+		// every workload starts from a fresh volume and is measured on a cold mount,
+		// so that the caches filled by the setup don't hide the cost of the workload
+		bench_format(&image, sectors_per_cluster);
+		if (!fat_init(disk, bench_read_func, bench_write_func, &image)) {
+			return 1;
+		}
+		workload->setup(disk);
+		fat_sync(disk);
+
+		if (!fat_init(disk, bench_read_func, bench_write_func, &image)) {
+			return 1;
+		}
+		bench_reset(&image);
+
+		double start = bench_now();
+		int result = workload->run(disk);
+		fat_sync(disk);
+		double time = bench_now() - start;
+
+		printf("%-20s %8lu %10lu %8lu %10lu %12llu %10.2f %s\n", workload->name,
+			image.reads, image.read_bytes / 1024, image.writes, image.write_bytes / 1024,
+			image.seek_distance / 1024, time, (result == BENCH_SKIPPED) ? "skipped" : result ? "ok" : "FAILED");
+	}
+
+	free(disk);
+	free(image.data);
+
+	return 0;
+}
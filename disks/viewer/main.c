@@ -17,6 +17,21 @@ void kprintf(const char* pattern, ...) {
 	va_end(args);
 }
 
+// fat.c keeps the cluster chain maps in memory taken from the kernel allocator
+void* kmalloc(unsigned int size) {
+	return malloc(size);
+}
+
+void* krealloc(void* pointer, unsigned int size) {
+	void* moved = realloc(pointer, size);
+
+	// The kernel allocator frees the area if it can't be enlarged
+	if (moved == NULL) {
+		free(pointer);
+	}
+	return moved;
+}
+
 void interactive_file_explorer(fat_DISK* disk) {
 	printf("---===### FAT Explorer 2000 ###===---\n");
 	printf("Commands:\n");
@@ -297,6 +312,13 @@ void disk_write_func(unsigned char* data_in, unsigned int offset_in, unsigned in
 int main(int argc, char** argv) {
 	const char* image_file = "floppy.img";
 
+	// the image can be picked with "-i <file>", the floppy image is used by default
+	for (int i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-i") == 0) {
+			image_file = argv[i + 1];
+		}
+	}
+
 	// open the image file
 	FILE* file = fopen(image_file, "rb+");
 	if (file == NULL) {
@@ -316,6 +338,7 @@ int main(int argc, char** argv) {
 			int loaded = load_files(&disk.root_directory, LOAD_SRC_DIR);
 			printf("Loaded %d files\n", loaded);
 
+			fat_sync(&disk);
 			fclose(file);
 			return 0;
 		}
@@ -323,6 +346,7 @@ int main(int argc, char** argv) {
 
 	interactive_file_explorer(&disk);
 
+	fat_sync(&disk);
 	fclose(file);
 
 	return 0;
@@ -13,6 +13,14 @@ global fault
 %define err_scan  2 ; "Get Current Drive Parameters" BIOS call failed
 %define err_load  3 ; "Read Sectors into Memory" BIOS call failed
 
+; The last sector copied into memory, start.asm and the kernel follow the boot sector,
+; the makefile passes the real value computed from the size of the kernel image
+%ifndef load_last
+%define load_last 200
+%endif
+
+%define load_ticks 0x4F0 ; BIOS tick count when loading started, read by the kernel (see BOOT_BENCHMARK)
+
 section .text
 
 main:
@@ -25,8 +33,7 @@ main:
 	mov [drive_handle], dl
 
 	; 80x25 Color Text Mode
-	mov ah, 0
-	mov al, 0x3
+	mov ax, 0x3
 	int 0x10
 
 	; Zero-out DS and ES (why zeroing CS breaks?)
@@ -36,15 +43,10 @@ main:
 	mov ss, ax
 
 	; Put stack before main
-	mov ax, main
-	mov sp, ax
+	mov sp, main
 
 	; Make sure the bootloadred wasn't truncated
-	mov ax, [guard]
-	mov bx, 0xAA55
-
-	; Check integrity
-	cmp ax, bx
+	cmp word [guard], 0xAA55
 	mov ax, err_guard
 	jne fault
 
@@ -141,32 +143,52 @@ scan:
 
 	mov si, str_stride
 	mov ax, bx
-	call printl
-
-	ret
+	jmp printl
 
 ; Loads and copies the data from the drive, call after 'scan'
+; Reads as many sectors per BIOS call as the track and the 64 KiB DMA boundary allow
 load:
 	call printn
 
-	mov di, 0x7c0 ; Destination Segment
-	mov si, 0     ; Source Sector Index
+	; Remember when we started, the BIOS timer stops once start.asm disables interrupts
+	mov ax, [0x46C]
+	mov [load_ticks], ax
 
-	load_next:
+	mov di, 0x7e0 ; Destination Segment
+	mov si, 1     ; Source Sector Index
 
-		; Convert stride to segment value offset
-		mov ax, [drive_stride]
-		shr ax, 4
-		add di, ax
+	load_next:
 
-		; move to the next sector
-		inc si
-		mov ax, si
+		; Sectors left to load, but no more than a single call is allowed to read
+		mov bp, load_last + 1
+		sub bp, si
+		mov ax, [load_limit]
+		call clamp
+
+		; The BIOS transfers through the ISA DMA controller, so the buffer can't cross a 64 KiB
+		; boundary, count the sectors that fit before the next one. The buffer always starts on
+		; a sector boundary, so (0x10000 - offset - 1) / stride + 1 is exact and fits in 16 bits
+		mov ax, di
+		shl ax, 4
+		not ax
+		xor dx, dx
+		div word [drive_stride]
+		inc ax
+		call clamp
 
 		; Divide AX by sector count, result in AL, reminder in AH
 		; so we get head count in AL and sector in AH
+		mov ax, si
 		div byte [drive_sectors]
 
+		; A single call can't continue onto the next track
+		push ax
+		mov al, [drive_sectors]
+		sub al, ah
+		cbw
+		call clamp
+		pop ax
+
 		; Put Sector into the target register
 		mov cl, ah
 		xor ah, ah
@@ -176,7 +198,6 @@ load:
 		div byte [drive_heads]
 
 		; Copy values to the expected registers
-		mov bx, 0  ; Offset
 		mov dh, ah ; Head
 		mov ch, al ; Cylinder
 
@@ -192,19 +213,45 @@ load:
 			call printd
 		popa
 
+		xor bx, bx  ; Offset
 		mov es, di  ; Copy segment
+		mov ax, bp  ; Number of sectors in AL, never more than 128
 		mov ah, 0x2 ; Read Sectors into Memory
-		mov al, 1   ; Read one sector (512 bytes, 0x200)
 		mov dl, [drive_handle]
 
 		int 0x13
-		mov ax, err_load
-		jc fault
+		jc load_fail
 
-	cmp si, 200
-	jnz load_next
+		; Move past the sectors that were read, stride is converted to segment value offset
+		add si, bp
+		mov ax, [drive_stride]
+		shr ax, 4
+		mul bp
+		add di, ax
 
-	call printn
+	cmp si, load_last + 1
+	jb load_next
+
+	jmp printn
+
+	; Some BIOSes can't read many sectors at once, reset the drive and
+	; continue one sector at a time, starting with the one that failed
+	load_fail:
+	cmp bp, 1
+	mov ax, err_load
+	je fault
+
+	xor ah, ah
+	int 0x13
+	mov byte [load_limit], 1
+	jmp load_next
+
+; Limits BP to at most AX
+clamp:
+	cmp bp, ax
+	jbe clamp_exit
+	mov bp, ax
+	clamp_exit:
 	ret
 
 ; Prints boot error message with code AX and halts
@@ -223,8 +270,7 @@ halt:
 printl:
 	call prints
 	call printd
-	call printn
-	ret
+	jmp printn
 
 ; Prints "\n\r" to move to the begining of the next line
 printn:
@@ -262,43 +308,31 @@ prints:
 ; Prints AX to screen as a decimal number
 printd:
 	pusha
-	sub sp, 16
-	mov bp, sp
-	mov cx, 10
-
-	mov [bp], byte 0
-	inc bp
+	mov bx, 10
+	xor cx, cx
 
+	; Push the digits, least significant first
 	printd_next:
 		xor dx, dx
-		div cx
-
-		; Convert to ASCII digit and store in buffer
-		add dl, 0x30
-		mov [bp], dl
-		inc bp
+		div bx
+		push dx
+		inc cx
 
 		test ax, ax
 	jnz printd_next
 
-	; Print resulting digit string
 	mov ah, 0x0e
 
-	; Write
+	; Pop and print them in reverse order
 	printd_load:
-		dec bp
-		mov al, BYTE ss:[bp]
+		pop dx
 
-		; Exit if NULL byte is loaded
-		test al, al
-		jz printd_exit
-
-		; Print and goto next character
+		; Convert to ASCII digit and print
+		mov al, dl
+		add al, 0x30
 		int 0x10
-	jmp printd_load
+	loop printd_load
 
-	printd_exit:
-	add sp, 16
 	popa
 	ret
 
@@ -311,14 +345,17 @@ section .data
 	drive_cylinders: db 0
 	drive_stride:    dw 0
 
+	; Most sectors a single read is allowed to transfer, set to 1 once a multi-sector read fails
+	load_limit:      dw 128
+
 	; Strings used by the bootloader
 	str_fault:       db "Boot Fault: ", 0
 	str_boot_drive:  db "Boot Drive: ", 0
 	str_copying:     db 13, "Copying ", 0
-	str_sectors:     db " * Sections  : ", 0
-	str_heads:       db " * Heads     : ", 0
-	str_cylinders:   db " * Cylinders : ", 0
-	str_stride:      db " * Stride    : ", 0
+	str_sectors:     db " * Sectors: ", 0
+	str_heads:       db " * Heads: ", 0
+	str_cylinders:   db " * Cylinders: ", 0
+	str_stride:      db " * Stride: ", 0
 
 	; Bootloader signature
 	;times 510-($-$$) db 0
@@ -0,0 +1,147 @@
+cpu 386
+bits 32
+
+; Address the kernel is linked at, start.asm jumps here
+%define KERNEL_BASE 0x8000
+
+; The stub and the compressed kernel are moved here before unpacking, above the first
+; megabyte (A20 is enabled by load.asm) so that the output can't overwrite them
+%define UNPACK_BASE 0x200000
+
+; Address of a label in the moved copy of the stub
+%define moved(label) (UNPACK_BASE + (label - unpack))
+
+; The PIT clocks spent unpacking are left here for the kernel (see BOOT_BENCHMARK in config.h),
+; followed by a marker that tells the kernel the image was compressed
+%define UNPACK_CLOCKS 0x4F4
+%define UNPACK_MAGIC  0x4F8
+
+%define PIT_CHANNEL0 0x40
+%define PIT_COMMAND  0x43
+
+section .text
+
+; Unpacks the LZSS compressed kernel (see util/lzss.py) to KERNEL_BASE and jumps to it,
+; this stub takes the place of the kernel in the image when it is built with COMPRESS=1
+unpack:
+
+	cld
+
+	; Channel 0, lobyte/hibyte access, mode 2 (rate generator), the counter then counts
+	; down by one per clock from 65536, the kernel programs the timer again in timer_init()
+	mov al, 0x34
+	out PIT_COMMAND, al
+	xor al, al
+	out PIT_CHANNEL0, al
+	out PIT_CHANNEL0, al
+
+	; Move the stub and the payload out of the way, the stack (below 0x7c00) is left where it is
+	mov esi, KERNEL_BASE
+	mov edi, UNPACK_BASE
+	mov ecx, payload_end - unpack
+	rep movsb
+
+	; Continue in the copy, all the jumps below are relative
+	mov eax, moved(unpack_moved)
+	jmp eax
+
+unpack_moved:
+
+	mov esi, moved(payload)
+	mov ebx, moved(payload_end)
+	mov edi, KERNEL_BASE
+
+	; Clocks counted so far
+	xor ebp, ebp
+
+	unpack_group:
+
+		; Sample the timer every 256 groups, that is far more often than the counter wraps
+		dec byte [moved(unpack_groups)]
+		jnz unpack_skip
+		call unpack_sample
+		unpack_skip:
+
+		cmp esi, ebx
+		jae unpack_done
+
+		; Each group starts with 8 flags, one per item, set for literals
+		lodsb
+		mov dl, al
+		mov dh, 8
+
+		unpack_item:
+
+			cmp esi, ebx
+			jae unpack_done
+
+			shr dl, 1
+			jnc unpack_match
+
+			movsb
+			jmp unpack_next
+
+			unpack_match:
+
+			; High 12 bits hold the distance minus 1, low 4 bits the length minus 3
+			xor eax, eax
+			lodsw
+			movzx ecx, ax
+			and ecx, 0x0F
+			add ecx, 3
+			shr eax, 4
+			inc eax
+
+			; Copy byte by byte, the source and the destination can overlap
+			push esi
+			mov esi, edi
+			sub esi, eax
+			rep movsb
+			pop esi
+
+			unpack_next:
+
+		dec dh
+		jnz unpack_item
+
+	jmp unpack_group
+
+	unpack_done:
+
+	call unpack_sample
+	mov [UNPACK_CLOCKS], ebp
+	mov dword [UNPACK_MAGIC], 'LZSS'
+
+	mov eax, KERNEL_BASE
+	jmp eax
+
+; Adds the clocks since the last sample to EBP, clobbers EAX and ECX
+unpack_sample:
+
+	; Latch the count of channel 0 and read it, low byte first
+	mov al, 0x00
+	out PIT_COMMAND, al
+	in al, PIT_CHANNEL0
+	mov ah, al
+	in al, PIT_CHANNEL0
+	xchg al, ah
+
+	; The counter goes down, the 16 bit difference is right across a wrap
+	mov cx, [moved(unpack_last)]
+	mov [moved(unpack_last)], ax
+	sub cx, ax
+	movzx ecx, cx
+	add ebp, ecx
+
+	ret
+
+; Counter value at the last sample, the counter was loaded with 65536 which reads as 0
+unpack_last:
+	dw 0
+
+unpack_groups:
+	db 0
+
+payload:
+	incbin "build/kernel/kernel.lz"
+payload_end:
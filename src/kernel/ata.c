@@ -0,0 +1,519 @@
+#include "ata.h"
+#include "dma.h"
+#include "floppy.h"
+#include "interrupt.h"
+#include "io.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "pci.h"
+#include "print.h"
+#include "routine.h"
+#include "timer.h"
+
+//#define ATA_DEBUG_ON
+
+#ifdef ATA_DEBUG_ON
+	#define ata_debug_msg(...) kprintf(__VA_ARGS__)
+#else
+	#define ata_debug_msg(...)
+#endif
+
+#define ATA_SECTOR_SIZE 512
+
+// the most sectors moved by one command, this is also the size of the DMA buffer (one PRD entry covers at most 64 KiB)
+#define ATA_MAX_SECTORS 128
+
+// sectors past this one can only be addressed with the 48-bit commands
+#define ATA_LBA28_LIMIT 0x10000000
+
+// the primary channel raises IRQ14
+#define ATA_INTERRUPT 0x2E
+
+// the IDE controller is a PCI mass storage controller of the IDE subclass, bit 7 of its programming interface marks bus-master support
+#define ATA_PCI_CLASS 0x01
+#define ATA_PCI_SUBCLASS 0x01
+#define ATA_PCI_BUS_MASTER 0x80
+#define ATA_PCI_BAR 4
+
+// the spin count used while waiting on the status register
+#define ATA_SPIN 0xffffff
+
+enum AtaRegisters
+{
+	DATA             = 0x1F0,
+	ERROR            = 0x1F1, // read-only
+	FEATURES         = 0x1F1, // write-only
+	SECTOR_COUNT     = 0x1F2,
+	LBA_LOW          = 0x1F3,
+	LBA_MID          = 0x1F4,
+	LBA_HIGH         = 0x1F5,
+	DRIVE_SELECT     = 0x1F6,
+	STATUS           = 0x1F7, // read-only, reading it acknowledges the interrupt
+	COMMAND          = 0x1F7, // write-only
+	ALTERNATE_STATUS = 0x3F6, // read-only, same as STATUS but without the side effect
+	DEVICE_CONTROL   = 0x3F6  // write-only
+};
+
+enum AtaStatus
+{
+	ERR  = 0x01, // the command failed, see the error register
+	DRQ  = 0x08, // the drive is ready to transfer a sector of PIO data
+	DF   = 0x20, // drive fault
+	DRDY = 0x40, // the drive is spun up and accepts commands
+	BSY  = 0x80  // the drive is executing a command, the other bits are not valid
+};
+
+enum AtaControl
+{
+	NIEN = 0x02, // don't raise interrupts
+	SRST = 0x04  // software reset of both drives on the channel
+};
+
+enum AtaCommands
+{
+	READ_SECTORS      = 0x20,
+	READ_SECTORS_EXT  = 0x24,
+	READ_DMA_EXT      = 0x25,
+	WRITE_SECTORS     = 0x30,
+	WRITE_SECTORS_EXT = 0x34,
+	WRITE_DMA_EXT     = 0x35,
+	READ_DMA          = 0xC8,
+	WRITE_DMA         = 0xCA,
+	IDENTIFY          = 0xEC
+};
+
+enum AtaDrive
+{
+	MASTER = 0xA0, // drive select value of the master drive, with the two obsolete bits set
+	LBA    = 0x40  // the address registers hold an LBA and not CHS
+};
+
+// registers of the bus-master function, relative to the base from BAR4 (the primary channel uses the first 8 ports)
+enum AtaBusMaster
+{
+	BM_COMMAND = 0,
+	BM_STATUS  = 2,
+	BM_PRDT    = 4,
+
+	BM_START   = 0x01, // command: start the transfer
+	BM_READ    = 0x08, // command: the transfer writes to memory
+
+	BM_ACTIVE  = 0x01, // status: the transfer is in progress
+	BM_ERROR   = 0x02, // status: the transfer failed, cleared by writing one
+	BM_IRQ     = 0x04  // status: the drive raised the interrupt, cleared by writing one
+};
+
+// A single entry of the Physical Region Descriptor table, a region can't cross a 64 KiB boundary
+typedef struct {
+	uint32_t address;
+	uint16_t size;     // 0 stands for 64 KiB
+	uint16_t flags;
+} ABI_PACKED AtaRegion;
+
+#define ATA_REGION_END 0x8000
+
+/* private */
+
+static bool lba48 = false;
+static uint32_t sectors = 0;
+
+// base port of the bus-master registers, 0 if the transfers have to use PIO
+static uint16_t bus_master = 0;
+static AtaRegion* regions = NULL;
+
+// all transfers go through this buffer, it can hold ATA_MAX_SECTORS sectors and doesn't cross a 64 KiB boundary
+static uint8_t* dma_buffer = NULL;
+
+// state of the DMA command that is waiting for IRQ14, the handler stores both status registers
+static volatile bool irq_expected = false;
+static volatile bool irq_done = false;
+static uint8_t irq_status = 0;
+static uint8_t irq_bm_status = 0;
+
+static bool ata_wait(uint8_t mask, uint8_t value){
+	for (uint32_t i = 0; i < ATA_SPIN; i++){
+		if ((inb(ALTERNATE_STATUS) & mask) == value){
+			return true;
+		}
+	}
+
+	ata_debug_msg("Error: ATA timeout, status: 0x%x\n", inb(ALTERNATE_STATUS));
+	return false;
+}
+
+// The drive needs about 400ns after a drive select before its status is valid, each read takes around 100ns
+static void ata_delay(){
+	for (int i = 0; i < 4; i++){
+		inb(ALTERNATE_STATUS);
+	}
+}
+
+// Stores both status registers, this also acknowledges the interrupt on the drive and on the controller
+static void ata_collect(){
+	irq_status = inb(STATUS);
+
+	if (bus_master){
+		irq_bm_status = inb(bus_master + BM_STATUS);
+		outb(bus_master + BM_STATUS, BM_IRQ | BM_ERROR);
+	}
+}
+
+static void ata_irq(int number, int error, int* eax, int ecx, int edx, int ebx, int esi, int edi){
+	ata_collect();
+
+	if (irq_expected){
+		irq_expected = false;
+		irq_done = true;
+	}
+}
+
+// Must be called before the command is issued, see floppy_expect()
+static void ata_expect(){
+	irq_done = false;
+	irq_expected = true;
+}
+
+// Waits for the end of the DMA command issued after ata_expect()
+static bool ata_finish(){
+	if (!int_wait_flag(&irq_done, ATA_TIMEOUT_TICKS)){
+		irq_expected = false;
+		ata_debug_msg("Error: ATA IRQ timeout\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Loads the address and count registers, 48-bit values are written in two rounds, high bytes first
+static void ata_select(uint32_t lba, uint32_t count, bool ext){
+	if (ext){
+		outb(DRIVE_SELECT, MASTER | LBA);
+		outb(SECTOR_COUNT, count >> 8);
+		outb(LBA_LOW, lba >> 24);
+		outb(LBA_MID, 0);
+		outb(LBA_HIGH, 0);
+	} else {
+		outb(DRIVE_SELECT, MASTER | LBA | ((lba >> 24) & 0x0F));
+	}
+
+	outb(SECTOR_COUNT, count & 0xFF);
+	outb(LBA_LOW, lba & 0xFF);
+	outb(LBA_MID, (lba >> 8) & 0xFF);
+	outb(LBA_HIGH, (lba >> 16) & 0xFF);
+}
+
+static bool ata_transfer_pio(bool write, uint32_t lba, uint32_t count, uint8_t* buffer, bool ext){
+	outb(DEVICE_CONTROL, NIEN);
+	ata_select(lba, count, ext);
+
+	if (ext){
+		outb(COMMAND, write ? WRITE_SECTORS_EXT : READ_SECTORS_EXT);
+	} else {
+		outb(COMMAND, write ? WRITE_SECTORS : READ_SECTORS);
+	}
+
+	uint16_t* words = (uint16_t*) buffer;
+
+	// the drive asks for (or offers) the data one sector at a time
+	for (uint32_t i = 0; i < count; i++){
+		ata_delay();
+
+		if (!ata_wait(BSY, 0)){
+			return false;
+		}
+
+		uint8_t status = inb(STATUS);
+
+		if ((status & (ERR | DF)) || !(status & DRQ)){
+			ata_debug_msg("Error: ATA PIO transfer failed, status: 0x%x, error: 0x%x\n", status, inb(ERROR));
+			return false;
+		}
+
+		for (int j = 0; j < ATA_SECTOR_SIZE / 2; j++){
+			if (write){
+				outw(DATA, *words++);
+			} else {
+				*words++ = inw(DATA);
+			}
+		}
+	}
+
+	// a write only ends once the last sector reached the disk
+	ata_delay();
+
+	if (!ata_wait(BSY, 0)){
+		return false;
+	}
+
+	return !(inb(STATUS) & (ERR | DF));
+}
+
+static bool ata_transfer_dma(bool write, uint32_t lba, uint32_t count, uint8_t* buffer, bool ext){
+	uint8_t direction = write ? 0 : BM_READ;
+
+	regions[0].address = (uint32_t) buffer;
+	regions[0].size = count * ATA_SECTOR_SIZE;
+	regions[0].flags = ATA_REGION_END;
+
+	outl(bus_master + BM_PRDT, (uint32_t) regions);
+	outb(bus_master + BM_COMMAND, direction);
+	outb(bus_master + BM_STATUS, BM_IRQ | BM_ERROR);
+
+	ata_expect();
+	outb(DEVICE_CONTROL, 0);
+	ata_select(lba, count, ext);
+
+	if (ext){
+		outb(COMMAND, write ? WRITE_DMA_EXT : READ_DMA_EXT);
+	} else {
+		outb(COMMAND, write ? WRITE_DMA : READ_DMA);
+	}
+
+	// the controller moves the data once the drive requests it, the drive raises IRQ14 at the end
+	outb(bus_master + BM_COMMAND, direction | BM_START);
+	bool finished = ata_finish();
+	outb(bus_master + BM_COMMAND, direction);
+
+	if (!finished || (irq_bm_status & BM_ERROR) || (irq_status & (ERR | DF))){
+		ata_debug_msg("Error: ATA DMA transfer failed, status: 0x%x, bus-master status: 0x%x\n", irq_status, irq_bm_status);
+		return false;
+	}
+
+	return true;
+}
+
+// Moves `count` sectors starting at `lba` between the disk and the given part of the DMA buffer with a single command
+static bool ata_transfer(bool write, uint32_t lba, uint32_t count, uint8_t* buffer){
+	bool ext = lba + count > ATA_LBA28_LIMIT;
+
+	if ((ext && !lba48) || lba + count > sectors){
+		ata_debug_msg("Error: ATA sector %d out of range\n", lba + count - 1);
+		return false;
+	}
+
+	if (!ata_wait(BSY, 0)){
+		return false;
+	}
+
+	if (bus_master){
+		return ata_transfer_dma(write, lba, count, buffer, ext);
+	}
+
+	return ata_transfer_pio(write, lba, count, buffer, ext);
+}
+
+static bool ata_identify(bool* dma){
+	outb(DEVICE_CONTROL, NIEN);
+	outb(DRIVE_SELECT, MASTER);
+	ata_delay();
+
+	outb(SECTOR_COUNT, 0);
+	outb(LBA_LOW, 0);
+	outb(LBA_MID, 0);
+	outb(LBA_HIGH, 0);
+	outb(COMMAND, IDENTIFY);
+
+	// a status of zero means there is no drive
+	if (inb(STATUS) == 0){
+		return false;
+	}
+
+	if (!ata_wait(BSY, 0)){
+		return false;
+	}
+
+	// ATAPI and SATA devices abort the command and leave their signature here
+	if (inb(LBA_MID) != 0 || inb(LBA_HIGH) != 0){
+		ata_debug_msg("Error: Not an ATA drive\n");
+		return false;
+	}
+
+	if (!ata_wait(DRQ | ERR, DRQ)){
+		return false;
+	}
+
+	uint16_t identity[256];
+
+	for (int i = 0; i < 256; i++){
+		identity[i] = inw(DATA);
+	}
+
+	lba48 = (identity[83] & (1 << 10)) != 0;
+	sectors = identity[60] | ((uint32_t) identity[61] << 16);
+	*dma = (identity[49] & (1 << 8)) != 0;
+
+	// larger disks can't be addressed with the 32-bit byte addresses anyway
+	if (lba48){
+		sectors = (identity[103] || identity[102]) ? 0xFFFFFFFF : (identity[100] | ((uint32_t) identity[101] << 16));
+	}
+
+	ata_debug_msg("ATA disk: %d sectors, LBA48: %d, DMA: %d\n", sectors, lba48, *dma);
+	return sectors != 0;
+}
+
+/* public */
+
+bool ata_init(){
+	// with no controller the bus floats high
+	if (inb(STATUS) == 0xFF){
+		ata_debug_msg("Error: No ATA controller\n");
+		return false;
+	}
+
+	// the drive raises IRQ14 on its own, for example after IDENTIFY
+	isr_register(ATA_INTERRUPT, ata_irq);
+
+	bool dma;
+
+	if (!ata_identify(&dma)){
+		ata_debug_msg("Error: No ATA disk\n");
+		return false;
+	}
+
+	/*======== DMA buffer ========*/
+	dma_buffer = dma_alloc(ATA_MAX_SECTORS * ATA_SECTOR_SIZE);
+
+	if (dma_buffer == NULL){
+		ata_debug_msg("Error: ATA DMA buffer allocation failed\n");
+		return false;
+	}
+
+	/*======== bus mastering ========*/
+	PciDevice controller;
+
+	if (dma && pci_find_class(&controller, ATA_PCI_CLASS, ATA_PCI_SUBCLASS) && (controller.interface & ATA_PCI_BUS_MASTER)){
+		uint32_t base = pci_bar(&controller, ATA_PCI_BAR);
+
+		// an 8 byte aligned table can't cross a 64 KiB boundary
+		uint32_t table = (uint32_t) kmalloc(sizeof(AtaRegion) * 2);
+
+		if (base != 0 && table != 0){
+			pci_enable(&controller, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+			regions = (AtaRegion*) ((table + 7) & ~7);
+			bus_master = base;
+		}
+	}
+
+	ata_debug_msg("ATA initialized successfully, bus-master base: 0x%x\n", bus_master);
+	return true;
+}
+
+bool ata_read(void* buffer, uint32_t address, uint32_t size){
+	ata_debug_msg("Reading %d bytes from address 0x%x\n", size, address);
+
+	uint8_t* output = buffer;
+	uint32_t end = address + size;
+
+	while (address < end){
+		uint32_t lba = address / ATA_SECTOR_SIZE;
+		uint32_t offset = address % ATA_SECTOR_SIZE;
+		uint32_t length = ATA_MAX_SECTORS * ATA_SECTOR_SIZE - offset;
+
+		if (length > end - address){
+			length = end - address;
+		}
+
+		if (!ata_transfer(false, lba, (offset + length + ATA_SECTOR_SIZE - 1) / ATA_SECTOR_SIZE, dma_buffer)){
+			return false;
+		}
+
+		memcpy(output, dma_buffer + offset, length);
+		output += length;
+		address += length;
+	}
+
+	return true;
+}
+
+bool ata_write(void* buffer, uint32_t address, uint32_t size){
+	ata_debug_msg("Writing %d bytes to address 0x%x\n", size, address);
+
+	const uint8_t* input = buffer;
+	uint32_t end = address + size;
+
+	while (address < end){
+		uint32_t lba = address / ATA_SECTOR_SIZE;
+		uint32_t offset = address % ATA_SECTOR_SIZE;
+		uint32_t length = ATA_MAX_SECTORS * ATA_SECTOR_SIZE - offset;
+
+		if (length > end - address){
+			length = end - address;
+		}
+
+		uint32_t count = (offset + length + ATA_SECTOR_SIZE - 1) / ATA_SECTOR_SIZE;
+		uint32_t tail = (offset + length) % ATA_SECTOR_SIZE;
+
+		// only the partially covered sectors at the ends need their old contents
+		if (offset != 0 && !ata_transfer(false, lba, 1, dma_buffer)){
+			return false;
+		}
+
+		if (tail != 0 && (count > 1 || offset == 0)){
+			if (!ata_transfer(false, lba + count - 1, 1, dma_buffer + (count - 1) * ATA_SECTOR_SIZE)){
+				return false;
+			}
+		}
+
+		memcpy(dma_buffer + offset, input, length);
+
+		if (!ata_transfer(true, lba, count, dma_buffer)){
+			return false;
+		}
+
+		input += length;
+		address += length;
+	}
+
+	return true;
+}
+
+#if ATA_BENCHMARK
+
+// Converts a transfer time to KiB per second, 1000000 = 15625 * 64 keeps the
+// product within 32 bits without giving up the resolution of short transfers
+static uint32_t ata_rate(uint32_t bytes, uint32_t micros){
+	uint32_t units = micros / 64;
+	return (bytes / 1024) * 15625 / (units ? units : 1);
+}
+
+void ata_benchmark(){
+
+#if ROOT_DEVICE == ROOT_ATA
+	bool ready = floppy_init();
+#elif ROOT_DEVICE == ROOT_FLOPPY || ROOT_DEVICE == ROOT_RAMDISK
+	bool ready = ata_init();
+#else
+	bool ready = ata_init() && floppy_init();
+#endif
+
+	uint8_t* buffer = kmalloc(ATA_BENCHMARK_SIZE);
+
+	if (!ready || buffer == NULL){
+		kprintf("ata: benchmark needs both the hard disk and the floppy\n");
+		return;
+	}
+
+	// the data is written back unchanged, so this is safe to run on mounted volumes
+	uint32_t start = timer_clock();
+	ata_read(buffer, 0, ATA_BENCHMARK_SIZE);
+	uint32_t ata_read_micros = timer_elapsed(start);
+
+	start = timer_clock();
+	ata_write(buffer, 0, ATA_BENCHMARK_SIZE);
+	uint32_t ata_write_micros = timer_elapsed(start);
+
+	start = timer_clock();
+	floppy_read(buffer, 0, ATA_BENCHMARK_SIZE);
+	uint32_t floppy_read_micros = timer_elapsed(start);
+
+	start = timer_clock();
+	floppy_write(buffer, 0, ATA_BENCHMARK_SIZE, true);
+	uint32_t floppy_write_micros = timer_elapsed(start);
+
+	kprintf("ata: %d KiB read at %d KiB/s, written at %d KiB/s (%s)\n", ATA_BENCHMARK_SIZE / 1024, ata_rate(ATA_BENCHMARK_SIZE, ata_read_micros), ata_rate(ATA_BENCHMARK_SIZE, ata_write_micros), bus_master ? "DMA" : "PIO");
+	kprintf("floppy: %d KiB read at %d KiB/s, written at %d KiB/s\n", ATA_BENCHMARK_SIZE / 1024, ata_rate(ATA_BENCHMARK_SIZE, floppy_read_micros), ata_rate(ATA_BENCHMARK_SIZE, floppy_write_micros));
+
+	kfree(buffer);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.h"
+#include "config.h"
+
+/**
+ * @brief Initializes the ATA driver for the master drive on the primary IDE channel. Transfers
+ *        use PCI bus-master DMA if the IDE controller supports it, and PIO otherwise.
+ *
+ * @return true if a hard disk was found and the driver is ready, false otherwise.
+ */
+bool ata_init();
+
+/**
+ * @brief Reads data from the hard disk.
+ *
+ * @param buffer The buffer to read the data into.
+ * @param address The byte address to read from.
+ * @param size The size of the data to read.
+ *
+ * @return true if the data was read successfully, false otherwise.
+ */
+bool ata_read(void* buffer, uint32_t address, uint32_t size);
+
+/**
+ * @brief Writes data to the hard disk, the existing contents of partially
+ *        covered sectors at both ends of the range are preserved.
+ *
+ * @param buffer The buffer to write the data from.
+ * @param address The byte address to write to.
+ * @param size The size of the data to write.
+ *
+ * @return true if the data was written successfully, false otherwise.
+ */
+bool ata_write(void* buffer, uint32_t address, uint32_t size);
+
+#if ATA_BENCHMARK
+
+/**
+ * @brief Reads and rewrites the first ATA_BENCHMARK_SIZE bytes of both the hard disk and the floppy
+ *        and prints how long it took, initializes the ones that don't hold the root filesystem.
+ *
+ * @return None.
+ */
+void ata_benchmark();
+
+#endif
@@ -76,3 +76,119 @@
  *
  */
 #define GDT_SIZE 2*(1+MAX_PROCESS_COUNT)
+
+/**
+ * @brief Frequency (in Hz) of the timer interrupt, the PIT is programmed
+ *        with the maximum reload value so this is roughly 18.2 Hz.
+ */
+#define TIMER_FREQUENCY 18
+
+/**
+ * @brief Frequency (in Hz) of the PIT input clock, this is the
+ *        resolution of timestamps returned by timer_clock().
+ */
+#define TIMER_CLOCK_RATE 1193182
+
+/**
+ * @brief The maximum number of periodic callbacks
+ *        that can be registered with timer_register().
+ */
+#define TIMER_MAX_CALLBACKS 8
+
+/**
+ * @brief Number of timer ticks between periodic flushes of the FAT write-back
+ *        cache (about 5 seconds), the flush is made by the kernel on its next turn in the
+ *        scheduler rotation, so it also happens on an idle system and while processes run without syscalls.
+ */
+#define FATFS_WRITEBACK_TICKS (TIMER_FREQUENCY * 5)
+
+/**
+ * @brief Number of floppy tracks (one side of a cylinder, 9 KiB each) kept in memory
+ *        by the floppy driver, must be at least 2 so that a whole cylinder fits.
+ */
+#define FLOPPY_TRACK_CACHE 4
+
+/**
+ * @brief Number of timer ticks the floppy driver waits for the IRQ that
+ *        ends a command before giving up (about 3 seconds).
+ */
+#define FLOPPY_TIMEOUT_TICKS (TIMER_FREQUENCY * 3)
+
+/**
+ * @brief Number of timer ticks without a request after which the floppy
+ *        motor is turned off (about 2 seconds), requests that arrive earlier
+ *        don't have to wait for the motor to spin up again.
+ */
+#define FLOPPY_MOTOR_IDLE_TICKS (TIMER_FREQUENCY * 2)
+
+/**
+ * @brief Number of timer ticks the ATA driver waits for the IRQ that
+ *        ends a DMA transfer before giving up (about 5 seconds).
+ */
+#define ATA_TIMEOUT_TICKS (TIMER_FREQUENCY * 5)
+
+/**
+ * @brief Devices that can hold the root filesystem, see ROOT_DEVICE.
+ */
+#define ROOT_FLOPPY 0
+#define ROOT_ATA 1
+#define ROOT_VIRTIO 2
+#define ROOT_RAMDISK 3
+
+/**
+ * @brief The device whose FAT32 volume is mounted at /, ROOT_ATA uses the master
+ *        drive on the primary IDE channel (`-drive file=...,if=ide,index=0` in QEMU)
+ *        and ROOT_VIRTIO the first virtio-blk disk (`-drive file=...,if=virtio`).
+ *        ROOT_RAMDISK copies the floppy into memory at boot and works on the copy,
+ *        the changes reach the floppy only when the filesystem is synced.
+ */
+#define ROOT_DEVICE ROOT_FLOPPY
+
+/**
+ * @brief Size of the RAM disk in bytes, the floppy image is copied up to this size.
+ */
+#define RAMDISK_SIZE (1440 * 1024)
+
+/**
+ * @brief Number of requests the virtio-blk driver keeps in flight, each one
+ *        has a 16 KiB buffer. Limited to a third of the device's queue size.
+ */
+#define VIRTIO_BLK_SLOTS 16
+
+/**
+ * @brief Number of timer ticks the virtio-blk driver waits for the
+ *        IRQ that completes a request before giving up (about 5 seconds).
+ */
+#define VIRTIO_TIMEOUT_TICKS (TIMER_FREQUENCY * 5)
+
+/**
+ * @brief The number of directory entries requested from the filesystem
+ *        driver in a single vfs_list() call by the getdents family of syscalls.
+ */
+#define VFS_LIST_BATCH 16
+
+/**
+ * @brief The initial number of slots in the child hash table of a VFS mount
+ *        node, must be a power of two. The table doubles when it gets 3/4 full.
+ */
+#define VFS_CHILD_TABLE_SIZE 8
+
+/**
+ * @brief Set to 1 to run the VFS path resolution benchmark (see vfs_benchmark())
+ *        during kernel initialization, this mounts a tree of dummy filesystems under /bench.
+ */
+#define VFS_BENCHMARK 0
+
+/**
+ * @brief Set to 1 to compare the throughput of the ATA and floppy drivers (see ata_benchmark())
+ *        during kernel initialization, ATA_BENCHMARK_SIZE bytes are read and rewritten on both devices.
+ */
+#define ATA_BENCHMARK 0
+#define ATA_BENCHMARK_SIZE (512 * 1024)
+
+/**
+ * @brief Set to 1 to print how long the boot sector took to load the kernel image, measured
+ *        in BIOS timer ticks (about 55ms each), and how long a compressed image took to unpack
+ *        (0 if the image is not compressed). Build with and without COMPRESS=1 to compare.
+ */
+#define BOOT_BENCHMARK 0
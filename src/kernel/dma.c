@@ -0,0 +1,70 @@
+#include "dma.h"
+#include "io.h"
+#include "kmalloc.h"
+
+// registers of the first 8237 controller, which handles the 8-bit channels 0-3
+#define DMA_SINGLE_MASK    0x0A
+#define DMA_MODE           0x0B
+#define DMA_FLIP_FLOP      0x0C
+
+#define DMA_MASK_SET       0x04
+#define DMA_MODE_SINGLE    0x40
+
+// the controller can only address the first 16 MiB and its address counter does not carry into the page register
+#define DMA_MEMORY_LIMIT   0x1000000
+#define DMA_BOUNDARY       0x10000
+
+/* private */
+
+static const uint8_t address_ports[4] = {0x00, 0x02, 0x04, 0x06};
+static const uint8_t count_ports[4] = {0x01, 0x03, 0x05, 0x07};
+static const uint8_t page_ports[4] = {0x87, 0x83, 0x81, 0x82};
+
+/* public */
+
+void* dma_alloc(uint32_t size) {
+	if (size == 0 || size > DMA_BOUNDARY) {
+		return NULL;
+	}
+
+	// allocate twice the size, if the area crosses a boundary then either the part
+	// before the first boundary or the part right after it is large enough
+	uint32_t start = (uint32_t) kmalloc(size * 2);
+
+	if (start == 0) {
+		return NULL;
+	}
+
+	uint32_t boundary = (start + DMA_BOUNDARY) & ~(DMA_BOUNDARY - 1);
+	uint32_t address = (boundary - start >= size) ? start : boundary;
+
+	if (address + size > DMA_MEMORY_LIMIT) {
+		kfree((void*) start);
+		return NULL;
+	}
+
+	return (void*) address;
+}
+
+void dma_start(uint8_t channel, void* buffer, uint32_t size, DmaDirection direction) {
+	uint32_t address = (uint32_t) buffer;
+	uint32_t count = size - 1;
+
+	// keep the channel masked while it is being programmed
+	outb(DMA_SINGLE_MASK, DMA_MASK_SET | channel);
+
+	// the 16-bit registers are written low byte first, the flip-flop selects the byte
+	outb(DMA_FLIP_FLOP, 0xFF);
+	outb(address_ports[channel], address & 0xFF);
+	outb(address_ports[channel], (address >> 8) & 0xFF);
+	outb(page_ports[channel], (address >> 16) & 0xFF);
+
+	outb(DMA_FLIP_FLOP, 0xFF);
+	outb(count_ports[channel], count & 0xFF);
+	outb(count_ports[channel], (count >> 8) & 0xFF);
+
+	outb(DMA_MODE, DMA_MODE_SINGLE | direction | channel);
+
+	// unmask the channel, the device can now request the transfer
+	outb(DMA_SINGLE_MASK, channel);
+}
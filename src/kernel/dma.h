@@ -0,0 +1,34 @@
+#pragma once
+
+#include "types.h"
+
+/**
+ * @brief Direction of an ISA DMA transfer, as seen from the memory side.
+ */
+typedef enum {
+	DMA_TO_DEVICE = 0x08,   // memory is read and the data is sent to the device
+	DMA_FROM_DEVICE = 0x04  // data is received from the device and written to memory
+} DmaDirection;
+
+/**
+ * @brief Allocates a buffer that the ISA DMA controller can transfer to and from, that
+ *        is, one that lies below 16 MiB and does not cross a 64 KiB boundary. The buffer is never freed.
+ *
+ * @param[in] size Size of the buffer in bytes, at most 64 KiB.
+ *
+ * @return Pointer to the buffer, or NULL if no such memory could be allocated.
+ */
+void* dma_alloc(uint32_t size);
+
+/**
+ * @brief Programs one of the 8-bit DMA channels (0-3) for a single transfer in single mode,
+ *        the transfer starts when the device requests it and the channel stops at the end of the buffer.
+ *
+ * @param[in] channel The DMA channel used by the device.
+ * @param[in] buffer Buffer obtained from dma_alloc().
+ * @param[in] size Number of bytes to transfer, at most the size of the buffer.
+ * @param[in] direction Whether the device reads or writes the buffer.
+ *
+ * @return None.
+ */
+void dma_start(uint8_t channel, void* buffer, uint32_t size, DmaDirection direction);
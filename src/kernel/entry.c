@@ -2,6 +2,9 @@
 #include "types.h"
 #include "console.h"
 #include "floppy.h"
+#include "ata.h"
+#include "virtio.h"
+#include "ramdisk.h"
 #include "print.h"
 #include "interrupt.h"
 #include "util.h"
@@ -17,6 +20,7 @@
 #include "kmalloc.h"
 #include "fat.h"
 #include "rivendell.h"
+#include "timer.h"
 
 #include "gdt.h"
 
@@ -42,8 +46,23 @@ void start() {
     ginit();
 
 	pic_disable();
+	timer_init();
 	int_init();
 
+#if BOOT_BENCHMARK
+	// the BIOS tick counter stopped when start.asm disabled interrupts, the unpacking stub of a compressed
+	// image counts PIT clocks instead and leaves them at 0x4F4, marked with 'LZSS' at 0x4F8 (cleared here,
+	// so that a later boot of an uncompressed image doesn't pick up a stale value)
+	volatile uint32_t* unpack = (volatile uint32_t*) 0x4F4;
+	uint16_t ticks = *((volatile uint16_t*) 0x46C) - *((volatile uint16_t*) 0x4F0);
+	uint32_t clocks = (unpack[1] == 0x53535A4C) ? unpack[0] : 0;
+	unpack[1] = 0;
+
+	uint32_t micros = (clocks / TIMER_CLOCK_RATE) * 1000000 + ((clocks % TIMER_CLOCK_RATE) * 1000) / (TIMER_CLOCK_RATE / 1000);
+
+	kprintf("Kernel image loaded in %d BIOS ticks (%d ms), unpacked in %d us\n", ticks, ticks * 55, micros);
+#endif
+
 //  kprintf("\e[2J%% Hello \e[1;33m%s\e[m wo%cld, party like it's \e[1m%#0.8x\e[m again!\n", "sweet", 'r', -1920);
 //	kprintf("\e[4B");
 //	kprintf("\e[29C" X S S S X S X X X X S S X X X S S X X X X"\n");
@@ -60,11 +79,29 @@ void start() {
     vfs_mount("/proc/", &procfs);
 
     FilesystemDriver fatfs;
-    fatfs_load(&fatfs);
+#if ROOT_DEVICE == ROOT_ATA
+    if (!ata_init() || fatfs_load(&fatfs, fatfs_ata_read, fatfs_ata_write, NULL, NULL)) {
+#elif ROOT_DEVICE == ROOT_VIRTIO
+    if (!virtio_blk_init() || fatfs_load(&fatfs, fatfs_virtio_read, fatfs_virtio_write, fatfs_virtio_flush, NULL)) {
+#elif ROOT_DEVICE == ROOT_RAMDISK
+    if (!floppy_init() || !ramdisk_init() || fatfs_load(&fatfs, fatfs_ramdisk_read, fatfs_ramdisk_write, fatfs_ramdisk_flush, NULL)) {
+#else
+    if (!floppy_init() || fatfs_load(&fatfs, fatfs_floppy_read, fatfs_floppy_write, NULL, NULL)) {
+#endif
+        panic("Can't mount the root filesystem!");
+    }
     vfs_mount("/", &fatfs);
 
 	vfs_print(NULL, 0);
 
+#if VFS_BENCHMARK
+	vfs_benchmark();
+#endif
+
+#if ATA_BENCHMARK
+	ata_benchmark();
+#endif
+
 	kprintf("System ready!\n");
 
     vRef root = vfs_root();
@@ -77,6 +114,11 @@ void start() {
 
 
 
-	// never return to the bootloader
-	halt();
+	// never return to the bootloader, the kernel gets its turn after the last process in the rotation. It makes the due
+	// write-back with interrupts disabled like a syscall would, so no process runs in the middle of it, and sleeps out the rest
+	while (true) {
+		__asm volatile ("cli");
+		fatfs_writeback();
+		__asm volatile ("sti; hlt");
+	}
 }
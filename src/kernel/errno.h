@@ -9,6 +9,9 @@
 #define LINUX_EISDIR       21 /* Is a directory */
 #define LINUX_EINVAL       22 /* Invalid argument */
 #define LINUX_EMFILE       24 /* Too many open files */
+#define LINUX_EFBIG        27 /* File too large */
+#define LINUX_ENOSPC       28 /* No space left on device */
 #define LINUX_ENAMETOOLONG 36 /* File name too long */
 #define LINUX_ELOOP        40 /* Too many levels of symbolic links */
 #define LINUX_EROFS        30 /* Write requested to a read only filesystem */
+#define LINUX_EOPNOTSUPP   95 /* Operation not supported */
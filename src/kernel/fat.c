@@ -1,5 +1,6 @@
 #include "fat.h"
 #include "print.h"
+#include "kmalloc.h"
 
 #ifndef NULL
     #define NULL 0
@@ -121,6 +122,156 @@ static void memory_copy(void* dest, void* src, unsigned int size) {
 	}
 }
 
+/* write-back cache */
+
+static fat_cache_block* fat_cache_find(fat_DISK* disk, unsigned int block) {
+	for (int i = 0; i < fat_CACHE_BLOCKS; i++) {
+		if (disk->cache[i].block == block) {
+			disk->cache[i].last_use = ++disk->cache_clock;
+			return &disk->cache[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void fat_cache_writeback(fat_DISK* disk, fat_cache_block* slot) {
+	if (slot->dirty) {
+		disk->write_func(slot->data, slot->block * fat_CACHE_BLOCK_SIZE, fat_CACHE_BLOCK_SIZE, disk->user_args);
+		slot->dirty = 0;
+	}
+}
+
+static fat_cache_block* fat_cache_load(fat_DISK* disk, unsigned int block) {
+	// Prefer empty slots, otherwise evict the least recently used block
+	fat_cache_block* victim = &disk->cache[0];
+	for (int i = 0; i < fat_CACHE_BLOCKS; i++) {
+		if (disk->cache[i].block == 0xFFFFFFFF) {
+			victim = &disk->cache[i];
+			break;
+		}
+		if (disk->cache[i].last_use < victim->last_use) {
+			victim = &disk->cache[i];
+		}
+	}
+
+	// The cache is full, this is the only place where dirty blocks are written outside of fat_sync()
+	fat_cache_writeback(disk, victim);
+
+	disk->read_func(victim->data, block * fat_CACHE_BLOCK_SIZE, fat_CACHE_BLOCK_SIZE, disk->user_args);
+	victim->block = block;
+	victim->last_use = ++disk->cache_clock;
+
+	return victim;
+}
+
+// Counts the whole, uncached blocks starting at the given block, such runs bypass the cache
+// so that large transfers do not evict the small, frequently modified blocks
+static unsigned int fat_cache_bypass(fat_DISK* disk, unsigned int block, unsigned int size) {
+	unsigned int count = 0;
+	while ((count + 1) * fat_CACHE_BLOCK_SIZE <= size) {
+		for (int i = 0; i < fat_CACHE_BLOCKS; i++) {
+			if (disk->cache[i].block == block + count) {
+				return count;
+			}
+		}
+		count++;
+	}
+
+	return count;
+}
+
+static void fat_cache_init(fat_DISK* disk) {
+	for (int i = 0; i < fat_CACHE_BLOCKS; i++) {
+		disk->cache[i].block = 0xFFFFFFFF;
+		disk->cache[i].last_use = 0;
+		disk->cache[i].dirty = 0;
+	}
+	disk->cache_clock = 0;
+	disk->busy = 0;
+}
+
+// Reads through the cache, if bypass is set whole uncached blocks are read directly from the device
+static void fat_disk_read(fat_DISK* disk, void* data_out, unsigned int offset, unsigned int size, unsigned char bypass) {
+	unsigned char* data = (unsigned char*)data_out;
+	disk->busy ++;
+
+	while (size > 0) {
+		unsigned int block = offset / fat_CACHE_BLOCK_SIZE;
+		unsigned int skip = offset % fat_CACHE_BLOCK_SIZE;
+		unsigned int part = fat_CACHE_BLOCK_SIZE - skip;
+		fat_cache_block* slot = fat_cache_find(disk, block);
+
+		if (slot == NULL && skip == 0 && bypass) {
+			unsigned int blocks = fat_cache_bypass(disk, block, size);
+			if (blocks > 0) {
+				disk->read_func(data, offset, blocks * fat_CACHE_BLOCK_SIZE, disk->user_args);
+				data += blocks * fat_CACHE_BLOCK_SIZE;
+				offset += blocks * fat_CACHE_BLOCK_SIZE;
+				size -= blocks * fat_CACHE_BLOCK_SIZE;
+				continue;
+			}
+		}
+
+		if (slot == NULL) {
+			slot = fat_cache_load(disk, block);
+		}
+
+		if (part > size) {
+			part = size;
+		}
+
+		memory_copy(data, slot->data + skip, part);
+		data += part;
+		offset += part;
+		size -= part;
+	}
+
+	disk->busy --;
+}
+
+static void fat_disk_write(fat_DISK* disk, void* data_in, unsigned int offset, unsigned int size) {
+	unsigned char* data = (unsigned char*)data_in;
+	disk->busy ++;
+
+	// The write might change a directory held by the scan buffer
+	disk->dir_buffer_length = 0;
+
+	while (size > 0) {
+		unsigned int block = offset / fat_CACHE_BLOCK_SIZE;
+		unsigned int skip = offset % fat_CACHE_BLOCK_SIZE;
+		unsigned int part = fat_CACHE_BLOCK_SIZE - skip;
+		fat_cache_block* slot = fat_cache_find(disk, block);
+
+		if (slot == NULL && skip == 0) {
+			unsigned int blocks = fat_cache_bypass(disk, block, size);
+			if (blocks > 0) {
+				disk->write_func(data, offset, blocks * fat_CACHE_BLOCK_SIZE, disk->user_args);
+				data += blocks * fat_CACHE_BLOCK_SIZE;
+				offset += blocks * fat_CACHE_BLOCK_SIZE;
+				size -= blocks * fat_CACHE_BLOCK_SIZE;
+				continue;
+			}
+		}
+
+		if (slot == NULL) {
+			slot = fat_cache_load(disk, block);
+		}
+
+		if (part > size) {
+			part = size;
+		}
+
+		memory_copy(slot->data + skip, data, part);
+		slot->dirty = 1;
+		data += part;
+		offset += part;
+		size -= part;
+	}
+
+	disk->busy --;
+}
+
 /* FAT32 functions */
 
 static void fat_file_default(fat_FILE* file, fat_DISK* disk) {
@@ -138,394 +289,1185 @@ static void fat_file_default(fat_FILE* file, fat_DISK* disk) {
 	}
 }
 
-static unsigned char fat_cache[512];
-static unsigned int fat_cache_sector = 0xFFFFFFFF;
+/* FAT cache */
 
-static void fat_invalidate_cache() {
-	fat_cache_sector = 0xFFFFFFFF;
-}
+// Writes the cached FAT block to every copy of the FAT, the copies are only synchronized here
+static void fat_table_writeback(fat_DISK* disk, fat_cache_block* slot) {
+	if (!slot->dirty) {
+		return;
+	}
 
-static unsigned int fat_read_fat_entry(fat_DISK* disk, unsigned int cluster, unsigned char cache) {
 	unsigned int fat_offset = disk->bpb.BPB_RsvdSecCnt * disk->bpb.BPB_BytsPerSec;
+	unsigned int fat_size = disk->bpb.BPB_FATSz32 * disk->bpb.BPB_BytsPerSec;
 
-	// Each entry is 4 bytes long
-	unsigned int fat_entry = fat_offset + cluster * 4;
+	for (unsigned int i = 0; i < disk->bpb.BPB_NumFATs; i++) {
+		disk->write_func(slot->data, fat_offset + i * fat_size + slot->block * fat_CACHE_BLOCK_SIZE, fat_CACHE_BLOCK_SIZE, disk->user_args);
+	}
+
+	slot->dirty = 0;
+}
+
+// Returns the cache slot holding the given block of the FAT, loading it if needed
+static fat_cache_block* fat_table_block(fat_DISK* disk, unsigned int block) {
+	fat_cache_block* victim = &disk->table_cache[0];
 
-	if (cache) {
-		unsigned int sector = fat_entry / disk->bpb.BPB_BytsPerSec;
-		if (sector != fat_cache_sector) {
-			disk->read_func(fat_cache, sector * disk->bpb.BPB_BytsPerSec, disk->bpb.BPB_BytsPerSec, disk->user_args);
-			fat_cache_sector = sector;
+	for (int i = 0; i < fat_TABLE_CACHE_BLOCKS; i++) {
+		fat_cache_block* slot = &disk->table_cache[i];
+
+		if (slot->block == block) {
+			slot->last_use = ++disk->cache_clock;
+			return slot;
+		}
+
+		// Prefer empty slots, otherwise evict the least recently used block
+		if (victim->block != 0xFFFFFFFF && (slot->block == 0xFFFFFFFF || slot->last_use < victim->last_use)) {
+			victim = slot;
 		}
-		return *((unsigned int*)(fat_cache + (fat_entry % disk->bpb.BPB_BytsPerSec)));
-	}
-	else {
-		unsigned int value;
-		disk->read_func((unsigned char*)&value, fat_entry, sizeof(value), disk->user_args);
-		return value;
 	}
 
-	return fat_entry;
-}
+	fat_table_writeback(disk, victim);
 
-static void fat_write_fat_entry(fat_DISK* disk, unsigned int cluster, unsigned int value) {
 	unsigned int fat_offset = disk->bpb.BPB_RsvdSecCnt * disk->bpb.BPB_BytsPerSec;
+	disk->read_func(victim->data, fat_offset + block * fat_CACHE_BLOCK_SIZE, fat_CACHE_BLOCK_SIZE, disk->user_args);
+	victim->block = block;
+	victim->last_use = ++disk->cache_clock;
 
-	// Each entry is 4 bytes long
-	unsigned int fat_entry = fat_offset + cluster * 4;
-	// Update the FAT table
-	disk->write_func((unsigned char*)&value, fat_entry, sizeof(value), disk->user_args);
-	// Update the backup FAT table
+	return victim;
+}
+
+// Writes all dirty blocks of the FAT cache, one copy of the FAT after another in ascending order
+static void fat_table_flush(fat_DISK* disk) {
+	unsigned int fat_offset = disk->bpb.BPB_RsvdSecCnt * disk->bpb.BPB_BytsPerSec;
 	unsigned int fat_size = disk->bpb.BPB_FATSz32 * disk->bpb.BPB_BytsPerSec;
-	disk->write_func((unsigned char*)&value, fat_entry + fat_size, sizeof(value), disk->user_args);
+
+	for (unsigned int copy = 0; copy < disk->bpb.BPB_NumFATs; copy++) {
+		unsigned int last = 0;
+		unsigned char first = 1;
+
+		while (1) {
+			fat_cache_block* next = NULL;
+			for (int i = 0; i < fat_TABLE_CACHE_BLOCKS; i++) {
+				fat_cache_block* slot = &disk->table_cache[i];
+				if (slot->dirty && (first || slot->block > last) && (next == NULL || slot->block < next->block)) {
+					next = slot;
+				}
+			}
+
+			if (next == NULL) {
+				break;
+			}
+
+			disk->write_func(next->data, fat_offset + copy * fat_size + next->block * fat_CACHE_BLOCK_SIZE, fat_CACHE_BLOCK_SIZE, disk->user_args);
+			last = next->block;
+			first = 0;
+		}
+	}
+
+	for (int i = 0; i < fat_TABLE_CACHE_BLOCKS; i++) {
+		disk->table_cache[i].dirty = 0;
+	}
 }
 
-unsigned char fat_fread(void* data_out, unsigned int element_size, unsigned int element_count, fat_FILE* file) {
-	/*
-	* In order to read the contents of a file, first we need to read the DIR_FstClusLO value from the directory entry.
-	* This value is the first cluster of the file where the data is stored.
-	* In order to access the rest of the file, we need to read the FAT table.
-	* The FAT table contains the cluster number of the next cluster in the file.
-	*/
+static void fat_table_init(fat_DISK* disk) {
+	for (int i = 0; i < fat_TABLE_CACHE_BLOCKS; i++) {
+		disk->table_cache[i].block = 0xFFFFFFFF;
+		disk->table_cache[i].last_use = 0;
+		disk->table_cache[i].dirty = 0;
+	}
+}
 
-	fat_dir_entry* file_dir = &file->fat_dir;
+static unsigned int fat_read_fat_entry(fat_DISK* disk, unsigned int cluster) {
+	// Each entry is 4 bytes long
+	unsigned int fat_entry = cluster * 4;
+	disk->busy ++;
 
-	unsigned int first_fat_sector = file->disk->bpb.BPB_RsvdSecCnt;
-	unsigned int first_data_sector = first_fat_sector + (file->disk->bpb.BPB_NumFATs * file->disk->bpb.BPB_FATSz32);
+	fat_cache_block* slot = fat_table_block(disk, fat_entry / fat_CACHE_BLOCK_SIZE);
+	unsigned int value = *((unsigned int*)(slot->data + fat_entry % fat_CACHE_BLOCK_SIZE));
 
-	unsigned int current_file_cluster = file_dir->DIR_FstClusLO;
-	unsigned int cluster_read_data_offset = 0;
-	unsigned int read_total_bytes = 0;
+	disk->busy --;
+	return value;
+}
 
-	unsigned int cluster_size = file->disk->bpb.BPB_SecPerClus * file->disk->bpb.BPB_BytsPerSec;
+/* free cluster tracking */
 
-	unsigned int data_size = element_size * element_count;
+static unsigned char fat_cluster_is_free(fat_DISK* disk, unsigned int cluster) {
+	if (cluster < fat_FREE_MAP_CLUSTERS) {
+		return (disk->free_map[cluster / 8] & (1 << (cluster % 8))) == 0;
+	}
+
+	// Past the bitmap, ask the FAT directly
+	return (fat_read_fat_entry(disk, cluster) & 0x0FFFFFFF) == 0;
+}
 
-	fat_invalidate_cache();
+// Keeps the bitmap and the free cluster count in sync with a FAT entry that is about to be written
+static void fat_free_map_update(fat_DISK* disk, unsigned int cluster, unsigned int value) {
+	unsigned char was_free = fat_cluster_is_free(disk, cluster);
+	unsigned char is_free = (value & 0x0FFFFFFF) == 0;
 
-	while (1) {
-		if (current_file_cluster < 2) {
-			break;
+	if (cluster < fat_FREE_MAP_CLUSTERS) {
+		if (is_free) {
+			disk->free_map[cluster / 8] &= ~(1 << (cluster % 8));
 		}
+		else {
+			disk->free_map[cluster / 8] |= (1 << (cluster % 8));
+		}
+	}
 
-		unsigned int next_cluster = fat_read_fat_entry(file->disk, current_file_cluster, 1);
+	if (was_free == is_free || disk->free_count == 0xFFFFFFFF) {
+		return;
+	}
 
-		if (next_cluster == 0x0) {
-			// Cluster is free
-			break;
-		}
+	disk->free_count += is_free ? 1 : -1;
+	disk->fsinfo_dirty = 1;
+}
 
-		if (next_cluster == 0x0FFFFFF7) {
-			// Cluster is bad
+// Finds up to `wanted` free, physically contiguous clusters, starting at the hint and wrapping around at the end of the volume.
+// The first run that is long enough is taken, otherwise the longest run seen within fat_ALLOC_SEARCH clusters after the first free one.
+// Returns the first cluster of the run and stores its length in length_out, or returns 0 if the volume is full.
+// The clusters are not marked as used, that happens once they are written to the FAT.
+static unsigned int fat_alloc_run(fat_DISK* disk, unsigned int hint, unsigned int wanted, unsigned int* length_out) {
+	if (disk->free_count == 0 || disk->cluster_count <= 2 || wanted == 0) {
+		return 0;
+	}
+
+	if (hint < 2 || hint >= disk->cluster_count) {
+		hint = 2;
+	}
+
+	unsigned int total = disk->cluster_count - 2;
+	unsigned int visited = 0;
+	unsigned int cluster = hint;
+
+	unsigned int best_cluster = 0;
+	unsigned int best_length = 0;
+	unsigned int best_visited = 0;
+
+	while (visited < total) {
+		if (best_length > 0 && visited - best_visited >= fat_ALLOC_SEARCH) {
 			break;
 		}
 
-		unsigned int cluster_offset = first_data_sector + (current_file_cluster - 2) * file->disk->bpb.BPB_SecPerClus;
-
-		// Don't read more than the file size
-		cluster_read_data_offset += cluster_size;
-		unsigned int part_size = (cluster_read_data_offset > file_dir->DIR_FileSize) ? cluster_size - (cluster_read_data_offset - file_dir->DIR_FileSize) : cluster_size;
+		unsigned int length = 0;
+		while (length < wanted && cluster + length < disk->cluster_count && visited + length < total && fat_cluster_is_free(disk, cluster + length)) {
+			length++;
+		}
 
-		if (cluster_read_data_offset > file->cursor) {
-			unsigned int bytes_to_read = (data_size > (part_size + read_total_bytes)) ? part_size : (data_size - read_total_bytes);
-			unsigned int src_read_offset = cluster_offset * file->disk->bpb.BPB_BytsPerSec;
-			
-			if (cluster_read_data_offset - file->cursor <= cluster_size) {
-				// if reading from the first cluster, we might want to skip the first bytes
-				// next clusters will always be read from the beginning
-				unsigned int skip_bytes = cluster_size - (cluster_read_data_offset - file->cursor);
-				src_read_offset += skip_bytes;
-
-				if (bytes_to_read + skip_bytes > part_size) {
-					// If the read goes over the cluster boundary, trim the read size
-					bytes_to_read -= (bytes_to_read + skip_bytes) - part_size;
-				}
+		if (length > best_length) {
+			if (best_length == 0) {
+				best_visited = visited;
 			}
+			best_cluster = cluster;
+			best_length = length;
 
-			// Read the part of the cluster that is needed
-			// subtract the size of the cluster because it has already been added to the total size
-			if (bytes_to_read > 0) {
-				file->disk->read_func((unsigned char*)data_out + read_total_bytes, src_read_offset, bytes_to_read, file->disk->user_args);
+			if (length == wanted) {
+				break;
 			}
-			read_total_bytes += bytes_to_read;
 		}
 
-		if (next_cluster >= 0x0FFFFFF8 && next_cluster <= 0x0FFFFFFF) {
-			// Last cluster in the file.
-			// May be interpreted as an allocated cluster and the final	cluster in the file(indicating end-of-file condition).
-			break;
-		}
+		// Continue after the run, or after the used cluster
+		cluster += (length > 0) ? length : 1;
+		visited += (length > 0) ? length : 1;
 
-		if (next_cluster == 0xFFFFFFFF) {
-			// Cluster is allocated and is the final cluster for the file (indicates end-of-file).
-			break;
+		if (cluster >= disk->cluster_count) {
+			cluster = 2;
 		}
+	}
 
-		current_file_cluster = next_cluster & 0x0FFFFFFF;
+	if (best_length == 0) {
+		return 0;
 	}
 
-	file->cursor += read_total_bytes;
+	// The next search starts right after this run
+	disk->next_free = best_cluster + best_length;
+	disk->fsinfo_dirty = 1;
 
-	return 1;
+	*length_out = best_length;
+	return best_cluster;
 }
 
-unsigned int fat_file_cluster_count(fat_FILE* file) {
-	unsigned int current_file_cluster = file->fat_dir.DIR_FstClusLO;
-	unsigned int next_cluster = 0;
-	unsigned int cluster_count = 0;
+static void fat_free_map_load(fat_DISK* disk) {
+	unsigned int first_data_sector = disk->bpb.BPB_RsvdSecCnt + (disk->bpb.BPB_NumFATs * disk->bpb.BPB_FATSz32);
+	unsigned int total_sectors = (disk->bpb.BPB_TotSec32 == 0) ? disk->bpb.BPB_TotSec16 : disk->bpb.BPB_TotSec32;
 
-	fat_invalidate_cache();
+	// The FAT can have more entries than there are clusters on the volume, those can't be used
+	disk->cluster_count = (total_sectors - first_data_sector) / disk->bpb.BPB_SecPerClus + 2;
+	if (disk->cluster_count > disk->bpb.BPB_FATSz32 * disk->bpb.BPB_BytsPerSec / 4) {
+		disk->cluster_count = disk->bpb.BPB_FATSz32 * disk->bpb.BPB_BytsPerSec / 4;
+	}
 
-	while (1) {
-		if (current_file_cluster < 2) {
-			break;
-		}
+	// Cluster numbers are 28 bits long, the ones from 0x0FFFFFF7 up are reserved
+	if (disk->cluster_count > 0x0FFFFFF7) {
+		disk->cluster_count = 0x0FFFFFF7;
+	}
 
-		next_cluster = fat_read_fat_entry(file->disk, current_file_cluster, 1);
+	disk->free_count = 0xFFFFFFFF;
+	disk->next_free = 2;
+	disk->fsinfo_present = 0;
+	disk->fsinfo_dirty = 0;
 
-		if (next_cluster == 0x0FFFFFF7) {
-			// Cluster is bad
-			break;
-		}
+	// Read the last known values from the FSInfo sector
+	if (disk->bpb.BPB_FSInfo != 0 && disk->bpb.BPB_FSInfo != 0xFFFF) {
+		fat_fsinfo fsinfo;
+		disk->read_func((unsigned char*)&fsinfo, disk->bpb.BPB_FSInfo * disk->bpb.BPB_BytsPerSec, sizeof(fat_fsinfo), disk->user_args);
 
-		if (next_cluster == 0x0) {
-			// Cluster is free
-			break;
-		}
+		if (fsinfo.FSI_LeadSig == 0x41615252 && fsinfo.FSI_StrucSig == 0x61417272 && fsinfo.FSI_TrailSig == 0xAA550000) {
+			disk->fsinfo_present = 1;
 
-		cluster_count++;
+			if (fsinfo.FSI_Free_Count <= disk->cluster_count - 2) {
+				disk->free_count = fsinfo.FSI_Free_Count;
+			}
 
-		if (next_cluster >= 0x0FFFFFF8 && next_cluster <= 0x0FFFFFFF) {
-			// Last cluster in the file.
-			// May be interpreted as an allocated cluster and the final	cluster in the file(indicating end-of-file condition).
-			break;
+			if (fsinfo.FSI_Nxt_Free >= 2 && fsinfo.FSI_Nxt_Free < disk->cluster_count) {
+				disk->next_free = fsinfo.FSI_Nxt_Free;
+			}
 		}
+	}
 
-		if (next_cluster == 0xFFFFFFFF) {
-			// Cluster is allocated and is the final cluster for the file (indicates end-of-file).
-			break;
-		}
+	// Build the bitmap, on small volumes this also loads the whole FAT into the FAT cache
+	unsigned int mapped = (disk->cluster_count < fat_FREE_MAP_CLUSTERS) ? disk->cluster_count : fat_FREE_MAP_CLUSTERS;
+	unsigned int free_count = 0;
 
-		current_file_cluster = next_cluster & 0x0FFFFFFF;
+	for (unsigned int i = 0; i < sizeof(disk->free_map); i++) {
+		disk->free_map[i] = 0xFF;
 	}
 
-	return cluster_count;
+	for (unsigned int cluster = 2; cluster < mapped; cluster++) {
+		if ((fat_read_fat_entry(disk, cluster) & 0x0FFFFFFF) == 0) {
+			disk->free_map[cluster / 8] &= ~(1 << (cluster % 8));
+			free_count++;
+		}
+	}
+
+	// With the whole volume mapped the count is exact, the stored one might be stale after an unclean unmount
+	if (mapped == disk->cluster_count && free_count != disk->free_count) {
+		disk->free_count = free_count;
+		disk->fsinfo_dirty = 1;
+	}
 }
 
-static void fat_update_entry(fat_FILE* dir) {
-	if (dir->first_parent_cluster < 2) {
+// Writes the free cluster count and the next free hint back to the FSInfo sector
+static void fat_free_map_flush(fat_DISK* disk) {
+	if (!disk->fsinfo_present || !disk->fsinfo_dirty) {
 		return;
 	}
 
-	fat_DIR parent_dir;
-	fat_file_default(&parent_dir.dir_file, dir->disk);
-	parent_dir.dir_file.fat_dir.DIR_FstClusLO = dir->first_parent_cluster;
-	parent_dir.dir_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&parent_dir.dir_file) * parent_dir.dir_file.disk->bpb.BPB_SecPerClus * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec;
+	unsigned int offset = disk->bpb.BPB_FSInfo * disk->bpb.BPB_BytsPerSec;
+	fat_disk_write(disk, &disk->free_count, offset + 488, sizeof(disk->free_count));
+	fat_disk_write(disk, &disk->next_free, offset + 492, sizeof(disk->next_free));
+	disk->fsinfo_dirty = 0;
+}
 
-	fat_fseek(&parent_dir.dir_file, dir->entry_position, fat_SEEK_SET);
-	fat_fwrite((unsigned char*)&dir->fat_dir, sizeof(fat_dir_entry), 1, &parent_dir.dir_file);
+static void fat_write_fat_entry(fat_DISK* disk, unsigned int cluster, unsigned int value) {
+	// The free map and the FAT have to change together, fat_sync() must not see only one of them
+	disk->busy ++;
+	fat_free_map_update(disk, cluster, value);
+
+	// Each entry is 4 bytes long
+	unsigned int fat_entry = cluster * 4;
+
+	// Only the cached block is updated, the backup FAT catches up when the block is written back.
+	// The high 4 bits of the entry are reserved and have to be preserved
+	fat_cache_block* slot = fat_table_block(disk, fat_entry / fat_CACHE_BLOCK_SIZE);
+	unsigned int* entry = (unsigned int*)(slot->data + fat_entry % fat_CACHE_BLOCK_SIZE);
+	*entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+	slot->dirty = 1;
+
+	disk->busy --;
 }
 
-static void fat_read_entry(fat_FILE* dir) {
-	fat_DIR parent_dir;
-	fat_file_default(&parent_dir.dir_file, dir->disk);
-	parent_dir.dir_file.fat_dir.DIR_FstClusLO = dir->first_parent_cluster;
-	parent_dir.dir_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&parent_dir.dir_file) * parent_dir.dir_file.disk->bpb.BPB_SecPerClus * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec;
+/* cluster extent map */
 
-	fat_fseek(&parent_dir.dir_file, dir->entry_position, fat_SEEK_SET);
-	fat_fread((unsigned char*)&dir->fat_dir, sizeof(fat_dir_entry), 1, &parent_dir.dir_file);
+unsigned int fat_first_cluster(fat_dir_entry* entry) {
+	// FAT32 cluster numbers are 28 bits long, the high word is only used by FAT32
+	return (entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16)) & 0x0FFFFFFF;
 }
 
-static void fat_clear_cluster(fat_DISK* disk, unsigned int cluster) {
-	unsigned int first_data_sector = disk->bpb.BPB_RsvdSecCnt + (disk->bpb.BPB_NumFATs * disk->bpb.BPB_FATSz32);
-	unsigned int cluster_offset = first_data_sector + (cluster - 2) * disk->bpb.BPB_SecPerClus;
-	unsigned int cluster_size_bytes = disk->bpb.BPB_SecPerClus * disk->bpb.BPB_BytsPerSec;
-	unsigned char clear_buffer[cluster_size_bytes];
+void fat_set_first_cluster(fat_dir_entry* entry, unsigned int cluster) {
+	entry->DIR_FstClusLO = cluster & 0xFFFF;
+	entry->DIR_FstClusHI = (cluster >> 16) & 0x0FFF;
+}
 
-	for (unsigned int i = 0; i < cluster_size_bytes; i++) {
-		clear_buffer[i] = 0;
-	}
+// Returns 1 if the FAT entry value does not point to a next cluster (free, bad or end of chain)
+static unsigned char fat_is_chain_end(unsigned int next_cluster) {
+	next_cluster &= 0x0FFFFFFF;
+	return next_cluster < 2 || next_cluster >= 0x0FFFFFF7;
+}
 
-	disk->write_func(clear_buffer, cluster_offset * disk->bpb.BPB_BytsPerSec, cluster_size_bytes, disk->user_args);
+static void fat_chain_init(fat_DISK* disk) {
+	for (int i = 0; i < fat_CHAIN_MAPS; i++) {
+		disk->chain_maps[i].cluster = 0;
+		disk->chain_maps[i].extents = NULL;
+		disk->chain_maps[i].capacity = 0;
+	}
+	disk->chain_clock = 0;
 }
 
-unsigned char fat_fwrite(void* data_in, unsigned int element_size, unsigned int element_count, fat_FILE* file) {
-	fat_dir_entry* file_dir = &file->fat_dir;
+// Returns the map of the chain that starts at the given cluster, the least recently used map is reused if the chain is not mapped yet
+static fat_chain_map* fat_chain_find(fat_DISK* disk, unsigned int first_cluster) {
+	fat_chain_map* victim = &disk->chain_maps[0];
 
-	unsigned int first_fat_sector = file->disk->bpb.BPB_RsvdSecCnt;
-	unsigned int first_data_sector = first_fat_sector + (file->disk->bpb.BPB_NumFATs * file->disk->bpb.BPB_FATSz32);
+	for (int i = 0; i < fat_CHAIN_MAPS; i++) {
+		fat_chain_map* map = &disk->chain_maps[i];
 
-	unsigned int current_file_cluster = file_dir->DIR_FstClusLO;
-	unsigned int cluster_write_data_offset = 0;
-	unsigned int write_total_bytes = 0;
+		if (map->cluster == first_cluster) {
+			map->last_use = ++disk->chain_clock;
+			return map;
+		}
 
-	unsigned int cluster_size = file->disk->bpb.BPB_SecPerClus * file->disk->bpb.BPB_BytsPerSec;
+		if (map->cluster == 0 || (victim->cluster != 0 && map->last_use < victim->last_use)) {
+			victim = map;
+		}
+	}
 
-	unsigned int data_size = element_size * element_count;
+	// The extent array is kept, it is reused for the new chain
+	victim->cluster = first_cluster;
+	victim->length = 0;
+	victim->last_use = ++disk->chain_clock;
+	victim->count = 0;
+	return victim;
+}
 
-	while (1) {
-		if (current_file_cluster < 2) {
-			break;
+// Forgets the map of the chain that starts at the given cluster, called when the chain is freed or a new one starts there
+static void fat_chain_forget(fat_DISK* disk, unsigned int first_cluster) {
+	for (int i = 0; i < fat_CHAIN_MAPS; i++) {
+		if (disk->chain_maps[i].cluster == first_cluster) {
+			disk->chain_maps[i].cluster = 0;
 		}
+	}
+}
 
-		unsigned int next_cluster = fat_read_fat_entry(file->disk, current_file_cluster, 0);
+static void fat_extent_append(fat_chain_map* map, unsigned int index, unsigned int cluster) {
+	if (map->count > 0) {
+		fat_extent* last = &map->extents[map->count - 1];
 
-		if (next_cluster == 0x0FFFFFF7) {
-			// Cluster is bad
-			break;
+		// Only the region right after the mapped part can be added
+		if (index != last->index + last->length) {
+			return;
 		}
 
-		if (next_cluster == 0x0 || (next_cluster >= 0x0FFFFFF8 && next_cluster <= 0x0FFFFFFF)) {
-			unsigned char new_end = 1;
+		if (cluster == last->cluster + last->length) {
+			last->length++;
+			return;
+		}
+	}
+	else if (index != 0) {
+		return;
+	}
 
-			// Cluster is free, allocate a new cluster or if it is the last cluster, check if the data fits
-			if (file->cursor + data_size <= cluster_write_data_offset + cluster_size) {
-				if (next_cluster == 0x0FFFFFFF) {
-					new_end = 0;
-				}
-				
-				// Set the current cluster as the last cluster
-				next_cluster = 0x0FFFFFFF;
+	if (map->count == map->capacity) {
+		unsigned int capacity = (map->capacity == 0) ? fat_EXTENT_INITIAL : map->capacity * 2;
+		fat_extent* extents = (map->extents == NULL) ? kmalloc(capacity * sizeof(fat_extent)) : krealloc(map->extents, capacity * sizeof(fat_extent));
+
+		if (extents == NULL) {
+			// Out of memory, krealloc() already freed the old array. The chain is followed through the FAT from now on
+			map->extents = NULL;
+			map->capacity = 0;
+			map->count = 0;
+			return;
+		}
+
+		map->extents = extents;
+		map->capacity = capacity;
+	}
+
+	fat_extent* extent = &map->extents[map->count++];
+	extent->index = index;
+	extent->cluster = cluster;
+	extent->length = 1;
+}
+
+// Returns the disk cluster that holds the cluster with the given index within the file, or 0 if the chain is shorter than that.
+// If run is not NULL it receives the number of physically contiguous clusters starting at the returned cluster.
+static unsigned int fat_file_cluster(fat_FILE* file, unsigned int index, unsigned int* run) {
+	unsigned int first_cluster = fat_first_cluster(&file->fat_dir);
+
+	if (first_cluster < 2) {
+		return 0;
+	}
+
+	fat_chain_map* map = fat_chain_find(file->disk, first_cluster);
+
+	if (map->length != 0 && index >= map->length) {
+		return 0;
+	}
+
+	if (map->count == 0) {
+		fat_extent_append(map, 0, first_cluster);
+	}
+
+	// Without memory for the map the chain is followed from the first cluster
+	fat_extent first = { .index = 0, .cluster = first_cluster, .length = 1 };
+	fat_extent* extent = &first;
+
+	// Binary search for the last run that starts at or before the index
+	if (map->count > 0) {
+		unsigned int low = 0;
+		unsigned int high = map->count;
+		while (high - low > 1) {
+			unsigned int middle = (low + high) / 2;
+			if (map->extents[middle].index <= index) {
+				low = middle;
 			}
-			else{
-				// The remaining data does not fit in the current cluster
-				// Find next free cluster
-				unsigned int disk_size = (file->disk->bpb.BPB_TotSec32 == 0) ? file->disk->bpb.BPB_TotSec16 : file->disk->bpb.BPB_TotSec32;
-				unsigned int free_cluster = current_file_cluster + 1;
-				fat_invalidate_cache();
-				while (fat_read_fat_entry(file->disk, free_cluster, 1) != 0x0) {
-					free_cluster++;
-					if (free_cluster * file->disk->bpb.BPB_SecPerClus >= disk_size) {
-						// No free clusters
-						return 0;
-					}
-				}
-				// Set the current cluster to point to the next cluster
-				next_cluster = free_cluster;
+			else {
+				high = middle;
 			}
+		}
 
-			if (new_end){
-				fat_write_fat_entry(file->disk, current_file_cluster, next_cluster);
+		extent = &map->extents[low];
+	}
 
-				// Clear the new cluster
-				fat_clear_cluster(file->disk, next_cluster);
-			}
+	if (index < extent->index + extent->length) {
+		if (run != NULL) {
+			*run = extent->length - (index - extent->index);
+		}
+		return extent->cluster + (index - extent->index);
+	}
+
+	// The index is past the mapped part, follow the FAT chain from the end of the run
+	unsigned int position = extent->index + extent->length - 1;
+	unsigned int cluster = extent->cluster + extent->length - 1;
+
+	while (position < index) {
+		unsigned int next_cluster = fat_read_fat_entry(file->disk, cluster);
+
+		if (fat_is_chain_end(next_cluster)) {
+			// Remember the length, so that the chain is not walked again to count its clusters
+			map->length = position + 1;
+			return 0;
 		}
 
-		unsigned int cluster_offset = first_data_sector + (current_file_cluster - 2) * file->disk->bpb.BPB_SecPerClus;
-		
-		cluster_write_data_offset += cluster_size;
-		unsigned int part_size = cluster_size;
+		cluster = next_cluster & 0x0FFFFFFF;
+		position++;
+		fat_extent_append(map, position, cluster);
+	}
+
+	// Keep mapping while the chain stays physically contiguous so that
+	// the caller can transfer the whole run with a single disk access
+	unsigned int length = 1;
+	while (run != NULL && length < fat_EXTENT_LOOKAHEAD) {
+		unsigned int next_cluster = fat_read_fat_entry(file->disk, cluster + length - 1);
+
+		if ((next_cluster & 0x0FFFFFFF) != cluster + length) {
+			break;
+		}
+
+		fat_extent_append(map, position + length, cluster + length);
+		length++;
+	}
+
+	if (run != NULL) {
+		*run = length;
+	}
+	return cluster;
+}
+
+unsigned char fat_fread(void* data_out, unsigned int element_size, unsigned int element_count, fat_FILE* file) {
+	/*
+	* In order to read the contents of a file, first we need to read the DIR_FstClusHI and DIR_FstClusLO values from the directory entry.
+	* This value is the first cluster of the file where the data is stored.
+	* In order to access the rest of the file, we need to read the FAT table.
+	* The FAT table contains the cluster number of the next cluster in the file.
+	* The clusters found along the way are remembered in the chain map of the file.
+	*/
+
+	fat_dir_entry* file_dir = &file->fat_dir;
+
+	unsigned int first_fat_sector = file->disk->bpb.BPB_RsvdSecCnt;
+	unsigned int first_data_sector = first_fat_sector + (file->disk->bpb.BPB_NumFATs * file->disk->bpb.BPB_FATSz32);
+
+	unsigned int read_total_bytes = 0;
+
+	unsigned int cluster_size = file->disk->bpb.BPB_SecPerClus * file->disk->bpb.BPB_BytsPerSec;
+
+	unsigned int data_size = element_size * element_count;
+
+	// Don't read more than the file size
+	if (file->cursor >= file_dir->DIR_FileSize) {
+		data_size = 0;
+	}
+	else if (data_size > file_dir->DIR_FileSize - file->cursor) {
+		data_size = file_dir->DIR_FileSize - file->cursor;
+	}
+
+	while (read_total_bytes < data_size) {
+		unsigned int position = file->cursor + read_total_bytes;
+		unsigned int run = 0;
+		unsigned int current_file_cluster = fat_file_cluster(file, position / cluster_size, &run);
+
+		if (current_file_cluster == 0) {
+			// The cluster chain is shorter than the file size
+			break;
+		}
+
+		// Read the whole contiguous run at once, the first cluster might be read from the middle
+		unsigned int skip_bytes = position % cluster_size;
+		unsigned int bytes_to_read = run * cluster_size - skip_bytes;
+
+		if (bytes_to_read > data_size - read_total_bytes) {
+			bytes_to_read = data_size - read_total_bytes;
+		}
+
+		unsigned int cluster_offset = first_data_sector + (current_file_cluster - 2) * file->disk->bpb.BPB_SecPerClus;
+		unsigned int src_read_offset = cluster_offset * file->disk->bpb.BPB_BytsPerSec + skip_bytes;
+
+		// Directories are kept in the cache, they are read over and over by lookups
+		fat_disk_read(file->disk, (unsigned char*)data_out + read_total_bytes, src_read_offset, bytes_to_read, !(file_dir->DIR_Attr & fat_ATTR_DIRECTORY));
+		read_total_bytes += bytes_to_read;
+	}
+
+	file->cursor += read_total_bytes;
+
+	return 1;
+}
+
+unsigned int fat_file_cluster_count(fat_FILE* file) {
+	unsigned int cluster_count = 0;
+	unsigned int run = 0;
+
+	if (fat_first_cluster(&file->fat_dir) < 2) {
+		return 0;
+	}
+
+	// The length is known once the end of the chain was reached
+	fat_chain_map* map = fat_chain_find(file->disk, fat_first_cluster(&file->fat_dir));
+
+	if (map->length != 0) {
+		return map->length;
+	}
+
+	// Walk to the end of the chain, skipping over the runs that are already mapped
+	while (fat_file_cluster(file, cluster_count, &run) != 0) {
+		cluster_count += run;
+	}
+
+	return cluster_count;
+}
+
+static void fat_update_entry(fat_FILE* dir) {
+	if (dir->first_parent_cluster < 2) {
+		return;
+	}
+
+	fat_DIR parent_dir;
+	fat_file_default(&parent_dir.dir_file, dir->disk);
+	fat_set_first_cluster(&parent_dir.dir_file.fat_dir, dir->first_parent_cluster);
+	parent_dir.dir_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&parent_dir.dir_file) * parent_dir.dir_file.disk->bpb.BPB_SecPerClus * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec;
+
+	fat_fseek(&parent_dir.dir_file, dir->entry_position, fat_SEEK_SET);
+	fat_fwrite((unsigned char*)&dir->fat_dir, sizeof(fat_dir_entry), 1, &parent_dir.dir_file);
+}
+
+static void fat_read_entry(fat_FILE* dir) {
+	fat_DIR parent_dir;
+	fat_file_default(&parent_dir.dir_file, dir->disk);
+	fat_set_first_cluster(&parent_dir.dir_file.fat_dir, dir->first_parent_cluster);
+	parent_dir.dir_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&parent_dir.dir_file) * parent_dir.dir_file.disk->bpb.BPB_SecPerClus * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec;
+
+	fat_fseek(&parent_dir.dir_file, dir->entry_position, fat_SEEK_SET);
+	fat_fread((unsigned char*)&dir->fat_dir, sizeof(fat_dir_entry), 1, &parent_dir.dir_file);
+}
+
+// Zeroes the cluster starting from the given byte offset within it
+static void fat_clear_cluster(fat_DISK* disk, unsigned int cluster, unsigned int from, unsigned int to) {
+	unsigned int first_data_sector = disk->bpb.BPB_RsvdSecCnt + (disk->bpb.BPB_NumFATs * disk->bpb.BPB_FATSz32);
+	unsigned int cluster_offset = first_data_sector + (cluster - 2) * disk->bpb.BPB_SecPerClus;
+
+	if (from >= to) {
+		return;
+	}
+
+	// Clusters can be up to 64 KiB, clear them in pieces so the buffer fits on the stack
+	unsigned char clear_buffer[fat_CLEAR_CHUNK_SIZE];
+
+	for (unsigned int i = 0; i < fat_CLEAR_CHUNK_SIZE; i++) {
+		clear_buffer[i] = 0;
+	}
+
+	for (unsigned int cleared = from; cleared < to; cleared += fat_CLEAR_CHUNK_SIZE) {
+		unsigned int size = to - cleared;
+
+		if (size > fat_CLEAR_CHUNK_SIZE) {
+			size = fat_CLEAR_CHUNK_SIZE;
+		}
+
+		fat_disk_write(disk, clear_buffer, cluster_offset * disk->bpb.BPB_BytsPerSec + cleared, size);
+	}
+}
+
+// Frees the clusters of the chain that starts at the given cluster
+static void fat_free_chain(fat_DISK* disk, unsigned int current_file_cluster) {
+	unsigned int next_cluster = 0;
+
+	fat_chain_forget(disk, current_file_cluster);
+
+	while (1) {
+		if (current_file_cluster < 2) {
+			break;
+		}
+
+		// The high 4 bits of the entry are reserved
+		next_cluster = fat_read_fat_entry(disk, current_file_cluster) & 0x0FFFFFFF;
+
+		if (next_cluster == 0x0FFFFFF7) {
+			// Cluster is bad
+			break;
+		}
+
+		if (next_cluster == 0x0) {
+			// Cluster is free
+			break;
+		}
+
+		// Set the current cluster as free
+		fat_write_fat_entry(disk, current_file_cluster, 0x0);
+
+		if (next_cluster >= 0x0FFFFFF8 && next_cluster <= 0x0FFFFFFF) {
+			// Last cluster in the file.
+			// May be interpreted as an allocated cluster and the final	cluster in the file(indicating end-of-file condition).
+			break;
+		}
+
+		current_file_cluster = next_cluster;
+	}
+}
+
+// Links new, cleared clusters at the end of the cluster chain of the file until it is `clusters` long or the allocated run ends,
+// the run is searched for right after the last cluster so that the file stays contiguous. Returns 0 if the disk is full.
+// The bytes of the file from write_start up to write_end are about to be written by the caller, that part of the new
+// clusters is not cleared, so a large write costs one disk write per sector instead of two
+static unsigned char fat_file_grow(fat_FILE* file, unsigned int clusters, unsigned int write_start, unsigned int write_end) {
+	unsigned int cluster_count = fat_file_cluster_count(file);
+	unsigned int cluster_size = file->disk->bpb.BPB_SecPerClus * file->disk->bpb.BPB_BytsPerSec;
+
+	if (cluster_count == 0) {
+		return 0;
+	}
+
+	unsigned int last_cluster = fat_file_cluster(file, cluster_count - 1, NULL);
+	unsigned int wanted = (clusters > cluster_count) ? clusters - cluster_count : 1;
+
+	unsigned int run_length = 0;
+	unsigned int run_cluster = fat_alloc_run(file->disk, last_cluster + 1, wanted, &run_length);
+
+	if (run_cluster == 0) {
+		// No free clusters
+		return 0;
+	}
+
+	// Chain the run together, mark its last cluster as the end of the file and link it to the chain
+	for (unsigned int i = 0; i < run_length; i++) {
+		fat_write_fat_entry(file->disk, run_cluster + i, (i + 1 < run_length) ? run_cluster + i + 1 : 0x0FFFFFFF);
+	}
+	fat_write_fat_entry(file->disk, last_cluster, run_cluster);
+
+	fat_chain_map* map = fat_chain_find(file->disk, fat_first_cluster(&file->fat_dir));
+	map->length = cluster_count + run_length;
+
+	// Clear what the write won't cover, the head before the written part and the tail after it
+	for (unsigned int i = 0; i < run_length; i++) {
+		unsigned int cluster_start = (cluster_count + i) * cluster_size;
+		unsigned int cluster_end = cluster_start + cluster_size;
+
+		if (write_start >= cluster_end || write_end <= cluster_start) {
+			fat_clear_cluster(file->disk, run_cluster + i, 0, cluster_size);
+		}
+		else {
+			fat_clear_cluster(file->disk, run_cluster + i, 0, (write_start > cluster_start) ? write_start - cluster_start : 0);
+			fat_clear_cluster(file->disk, run_cluster + i, (write_end < cluster_end) ? write_end - cluster_start : cluster_size, cluster_size);
+		}
+
+		fat_extent_append(map, cluster_count + i, run_cluster + i);
+	}
+
+	return 1;
+}
+
+unsigned char fat_fwrite(void* data_in, unsigned int element_size, unsigned int element_count, fat_FILE* file) {
+	fat_dir_entry* file_dir = &file->fat_dir;
+
+	unsigned int first_fat_sector = file->disk->bpb.BPB_RsvdSecCnt;
+	unsigned int first_data_sector = first_fat_sector + (file->disk->bpb.BPB_NumFATs * file->disk->bpb.BPB_FATSz32);
+
+	unsigned int write_total_bytes = 0;
+	unsigned char success = 1;
+
+	unsigned int cluster_size = file->disk->bpb.BPB_SecPerClus * file->disk->bpb.BPB_BytsPerSec;
+
+	unsigned int data_size = element_size * element_count;
+
+	while (write_total_bytes < data_size) {
+		unsigned int position = file->cursor + write_total_bytes;
+		unsigned int run = 0;
+		unsigned int current_file_cluster = fat_file_cluster(file, position / cluster_size, &run);
+
+		if (current_file_cluster == 0) {
+			// The write goes past the end of the cluster chain, allocate clusters for the rest of it and try again
+			if (!fat_file_grow(file, (file->cursor + data_size + cluster_size - 1) / cluster_size, file->cursor, file->cursor + data_size)) {
+				success = 0;
+				break;
+			}
+			continue;
+		}
+
+		// Write the whole contiguous run at once, the first cluster might be written from the middle
+		unsigned int skip_bytes = position % cluster_size;
+		unsigned int bytes_to_write = run * cluster_size - skip_bytes;
+
+		if (bytes_to_write > data_size - write_total_bytes) {
+			bytes_to_write = data_size - write_total_bytes;
+		}
+
+		unsigned int cluster_offset = first_data_sector + (current_file_cluster - 2) * file->disk->bpb.BPB_SecPerClus;
+		unsigned int dst_write_offset = cluster_offset * file->disk->bpb.BPB_BytsPerSec + skip_bytes;
+
+		fat_disk_write(file->disk, (unsigned char*)data_in + write_total_bytes, dst_write_offset, bytes_to_write);
+		write_total_bytes += bytes_to_write;
+	}
+
+	file->cursor += write_total_bytes;
+
+	if (file->cursor > file_dir->DIR_FileSize) {
+		file_dir->DIR_FileSize = file->cursor;
+		fat_update_entry(file);
+	}
+
+	return success;
+}
+
+// Cuts the cluster chain of the file after `clusters` clusters and zeroes the last kept cluster past `size`,
+// so that the bytes past the end of the file always read back as zeros once the file grows again
+static void fat_file_shrink(fat_FILE* file, unsigned int clusters, unsigned int size) {
+	unsigned int cluster_size = file->disk->bpb.BPB_SecPerClus * file->disk->bpb.BPB_BytsPerSec;
+
+	// The directory entry always points to a cluster, keep at least the first one
+	if (clusters == 0) {
+		clusters = 1;
+	}
+
+	unsigned int last_cluster = fat_file_cluster(file, clusters - 1, NULL);
+
+	if (last_cluster == 0) {
+		return;
+	}
+
+	unsigned int next_cluster = fat_read_fat_entry(file->disk, last_cluster);
+	fat_write_fat_entry(file->disk, last_cluster, 0x0FFFFFFF);
+
+	if (!fat_is_chain_end(next_cluster)) {
+		fat_free_chain(file->disk, next_cluster & 0x0FFFFFFF);
+	}
+
+	if (size < clusters * cluster_size) {
+		fat_clear_cluster(file->disk, last_cluster, size - (clusters - 1) * cluster_size, cluster_size);
+	}
+
+	// Forget the runs past the new end of the chain
+	fat_chain_map* map = fat_chain_find(file->disk, fat_first_cluster(&file->fat_dir));
+	map->length = clusters;
+
+	for (unsigned int i = 0; i < map->count; i++) {
+		fat_extent* extent = &map->extents[i];
+
+		if (extent->index >= clusters) {
+			map->count = i;
+			break;
+		}
+
+		if (extent->index + extent->length > clusters) {
+			extent->length = clusters - extent->index;
+		}
+	}
+}
+
+unsigned char fat_ftruncate(fat_FILE* file, unsigned int size) {
+	unsigned int cluster_size = file->disk->bpb.BPB_SecPerClus * file->disk->bpb.BPB_BytsPerSec;
+	unsigned int clusters = (size + cluster_size - 1) / cluster_size;
+
+	if (size > file->fat_dir.DIR_FileSize) {
+		// New clusters are cleared and the tail of the last one is already zero, so the new part reads back as zeros
+		unsigned int old_count = fat_file_cluster_count(file);
+
+		for (unsigned int cluster_count = old_count; cluster_count < clusters; cluster_count = fat_file_cluster_count(file)) {
+			if (!fat_file_grow(file, clusters, 0, 0)) {
+				// Give back what was allocated so far
+				fat_file_shrink(file, old_count, file->fat_dir.DIR_FileSize);
+				return 0;
+			}
+		}
+	}
+	else if (size < file->fat_dir.DIR_FileSize) {
+		fat_file_shrink(file, clusters, size);
+	}
+
+	file->fat_dir.DIR_FileSize = size;
+	fat_update_entry(file);
+
+	return 1;
+}
+
+unsigned char fat_fallocate(fat_FILE* file, unsigned int size) {
+	fat_DISK* disk = file->disk;
+	unsigned int cluster_size = disk->bpb.BPB_SecPerClus * disk->bpb.BPB_BytsPerSec;
+	unsigned int clusters = (size + cluster_size - 1) / cluster_size;
+	unsigned int cluster_count = fat_file_cluster_count(file);
+
+	if (cluster_count >= clusters) {
+		if (size > file->fat_dir.DIR_FileSize) {
+			file->fat_dir.DIR_FileSize = size;
+			fat_update_entry(file);
+		}
+		return 1;
+	}
+
+	if (file->fat_dir.DIR_FileSize == 0 && cluster_count == 1) {
+		// The file is empty, move it to a run that holds the whole size instead of
+		// growing it from its first cluster, which might be followed by a used one
+		unsigned int run_length = 0;
+		unsigned int run_cluster = fat_alloc_run(disk, disk->next_free, clusters, &run_length);
+
+		if (run_cluster != 0 && run_length == clusters) {
+			for (unsigned int i = 0; i < run_length; i++) {
+				fat_write_fat_entry(disk, run_cluster + i, (i + 1 < run_length) ? run_cluster + i + 1 : 0x0FFFFFFF);
+				fat_clear_cluster(disk, run_cluster + i, 0, cluster_size);
+			}
+
+			fat_free_chain(disk, fat_first_cluster(&file->fat_dir));
+			fat_chain_forget(disk, run_cluster);
+			fat_set_first_cluster(&file->fat_dir, run_cluster);
+			file->fat_dir.DIR_FileSize = size;
+			fat_update_entry(file);
+
+			return 1;
+		}
+	}
+
+	// Grow the chain, every step takes the longest free run it can find
+	for (unsigned int old_count = cluster_count; cluster_count < clusters; cluster_count = fat_file_cluster_count(file)) {
+		if (!fat_file_grow(file, clusters, 0, 0)) {
+			// Give back what was allocated so far
+			fat_file_shrink(file, old_count, file->fat_dir.DIR_FileSize);
+			return 0;
+		}
+	}
+
+	if (size > file->fat_dir.DIR_FileSize) {
+		file->fat_dir.DIR_FileSize = size;
+		fat_update_entry(file);
+	}
+
+	return 1;
+}
+
+int fat_fseek(fat_FILE* file, int offset, int origin) {
+	if (origin == fat_SEEK_SET) {
+		file->cursor = offset;
+	}
+	else if (origin == fat_SEEK_CUR) {
+		file->cursor += offset;
+	}
+	else if (origin == fat_SEEK_END) {
+		file->cursor = file->fat_dir.DIR_FileSize + offset;
+	}
+
+	return 1;
+}
+
+int fat_dirseek(fat_DIR* dir, int offset, int origin) {
+	if (origin == fat_SEEK_SET) {
+		dir->dir_file.cursor = offset;
+	}
+	else if (origin == fat_SEEK_CUR) {
+		dir->dir_file.cursor += offset;
+	}
+	else if (origin == fat_SEEK_END) {
+		return 0;
+	}
+
+	return 1;
+}
+
+int fat_ftell(fat_FILE* file) {
+	return file->cursor;
+}
+
+/* directory scanning */
+
+// Copies the part of a long file name held by the long name entry to its place in the long_filename buffer,
+// returns 1 if this was the last entry of the name (which is actually the first one in the directory)
+static unsigned char fat_lfn_collect(fat_lfn_entry* entry, unsigned short* long_filename) {
+	unsigned char long_filename_index = entry->LDIR_Ord & 0x0F;
+	unsigned int long_filename_offset = (long_filename_index - 1) * 13;
+
+	// the long file name is split into 3 parts in the single entry
+	for (int i = 0; i < 5; i++) {
+		long_filename[long_filename_offset + i] = entry->LDIR_Name1[i];
+	}
+	for (int i = 0; i < 6; i++) {
+		long_filename[long_filename_offset + 5 + i] = entry->LDIR_Name2[i];
+	}
+	for (int i = 0; i < 2; i++) {
+		long_filename[long_filename_offset + (5 + 6) + i] = entry->LDIR_Name3[i];
+	}
+
+	if (entry->LDIR_Ord & 0x40) {
+		// add the null terminator
+		long_filename[long_filename_offset + 13] = '\0';
+		return 1;
+	}
+
+	return 0;
+}
+
+// Returns the directory entry at the given offset, the directory is read into the scan buffer of the disk
+// span bytes at a time instead of one entry at a time. The span is a power of two up to fat_DIR_BUFFER_SIZE,
+// lookups of a single entry use a small one to keep the blocks of other directories in the cache.
+// The offset has to be within DIR_FileSize
+static fat_dir_entry* fat_dir_entry_at(fat_FILE* directory, unsigned int offset, unsigned int span) {
+	fat_DISK* disk = directory->disk;
+	unsigned int cluster = fat_first_cluster(&directory->fat_dir);
+
+	if (disk->dir_buffer_cluster != cluster || offset < disk->dir_buffer_offset || offset + sizeof(fat_dir_entry) > disk->dir_buffer_offset + disk->dir_buffer_length) {
+		unsigned int start = offset - offset % span;
+		unsigned int length = directory->fat_dir.DIR_FileSize - start;
+
+		if (length > span) {
+			length = span;
+		}
+
+		fat_fseek(directory, start, fat_SEEK_SET);
+		fat_fread(disk->dir_buffer, 1, length, directory);
+
+		disk->dir_buffer_cluster = cluster;
+		disk->dir_buffer_offset = start;
+		disk->dir_buffer_length = length;
+	}
+
+	return (fat_dir_entry*)(disk->dir_buffer + (offset - disk->dir_buffer_offset));
+}
+
+/* directory index */
+
+// FNV-1a hash of the case-folded name
+static unsigned int fat_name_hash(const unsigned short* name) {
+	unsigned int hash = 2166136261;
+
+	for (int i = 0; name[i] != '\0'; i++) {
+		unsigned short c = name[i];
+		hash = (hash ^ ((c < 0x80) ? (unsigned short)to_lowercase(c) : c)) * 16777619;
+	}
+
+	return hash;
+}
+
+// Same as fat_name_hash() but for the first component of the path
+static unsigned int fat_path_hash(const char* path) {
+	unsigned int hash = 2166136261;
+
+	for (int i = 0; path[i] != '\0' && path[i] != '/'; i++) {
+		unsigned char c = path[i];
+		hash = (hash ^ ((c < 0x80) ? (unsigned char)to_lowercase(c) : c)) * 16777619;
+	}
+
+	return hash;
+}
+
+static void fat_index_clear(fat_DISK* disk) {
+	for (int i = 0; i < fat_INDEX_DIRECTORIES; i++) {
+		disk->index_dirs[i].cluster = 0;
+		disk->index_dirs[i].tag = 0;
+	}
+	for (int i = 0; i < fat_INDEX_SLOTS; i++) {
+		disk->index_slots[i].tag = 0;
+	}
+	disk->index_used = 0;
+}
+
+static void fat_index_init(fat_DISK* disk) {
+	fat_index_clear(disk);
+	disk->index_clock = 0;
+	disk->dir_buffer_cluster = 0;
+	disk->dir_buffer_offset = 0;
+	disk->dir_buffer_length = 0;
+}
+
+static fat_index_dir* fat_index_find(fat_DISK* disk, unsigned int cluster) {
+	for (int i = 0; i < fat_INDEX_DIRECTORIES; i++) {
+		if (disk->index_dirs[i].tag != 0 && disk->index_dirs[i].cluster == cluster) {
+			disk->index_dirs[i].last_use = ++disk->index_clock;
+			return &disk->index_dirs[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Forgets the index of the directory, its slots stay occupied until the whole index is cleared
+static void fat_index_drop(fat_DISK* disk, unsigned int cluster) {
+	fat_index_dir* index = fat_index_find(disk, cluster);
+
+	if (index != NULL) {
+		index->cluster = 0;
+		index->tag = 0;
+	}
+}
+
+static unsigned char fat_index_insert(fat_DISK* disk, fat_index_dir* index, unsigned int hash, unsigned int position) {
+	// Keep the table at most 3/4 full so that probing stays short and always ends on an empty slot
+	if (disk->index_used + 1 > fat_INDEX_SLOTS * 3 / 4) {
+		return 0;
+	}
+
+	unsigned int slot = hash % fat_INDEX_SLOTS;
+	while (disk->index_slots[slot].tag != 0) {
+		slot = (slot + 1) % fat_INDEX_SLOTS;
+	}
+
+	disk->index_slots[slot].tag = index->tag;
+	disk->index_slots[slot].hash = hash;
+	disk->index_slots[slot].position = position;
+	disk->index_used++;
+
+	return 1;
+}
+
+// Adds every entry of the directory to the index, returns 0 if the index ran out of slots
+static unsigned char fat_index_scan(fat_FILE* directory, fat_index_dir* index) {
+	unsigned short long_filename[260];
+	unsigned short short_filename[13];
+	unsigned char lfn_present = 0;
+	unsigned int group_start = 0;
+
+	index->free_start = directory->fat_dir.DIR_FileSize;
+
+	for (unsigned int offset = 0; offset < directory->fat_dir.DIR_FileSize; offset += sizeof(fat_dir_entry)) {
+		fat_dir_entry* entry = fat_dir_entry_at(directory, offset, fat_DIR_BUFFER_SIZE);
 
-		if (cluster_write_data_offset > file->cursor) {
-			unsigned int bytes_to_write = (data_size > (part_size + write_total_bytes)) ? part_size : (data_size - write_total_bytes);
-			unsigned int dst_write_offset = cluster_offset * file->disk->bpb.BPB_BytsPerSec;
-			
-			if (cluster_write_data_offset - file->cursor <= cluster_size) {
-				// if writing to the first cluster, we might want to skip the first bytes
-				// next clusters will always be written from the beginning
-				unsigned int skip_bytes = cluster_size - (cluster_write_data_offset - file->cursor);
-				dst_write_offset += skip_bytes;
-
-				if (bytes_to_write + skip_bytes > part_size) {
-					// If the read goes over the cluster boundary, trim the read size
-					bytes_to_write -= (bytes_to_write + skip_bytes) - part_size;
-				}
+		if (entry->DIR_Name[0] == 0x00 || entry->DIR_Name[0] == 0xE5) {
+			if (offset < index->free_start) {
+				index->free_start = offset;
 			}
 
-			// Write the part of the cluster that is needed
-			// subtract the size of the cluster because it has already been added to the total size
-			file->disk->write_func((unsigned char*)data_in + write_total_bytes, dst_write_offset, bytes_to_write, file->disk->user_args);
+			if (entry->DIR_Name[0] == 0x00) {
+				break;
+			}
 
-			write_total_bytes += bytes_to_write;
+			continue;
 		}
 
+		if (entry->DIR_Attr == 0x0F) {
+			if (fat_lfn_collect((fat_lfn_entry*)entry, long_filename)) {
+				// The entry group starts with the last long name entry
+				lfn_present = 1;
+				group_start = offset;
+			}
+			continue;
+		}
 
-		if (next_cluster >= 0x0FFFFFF8 && next_cluster <= 0x0FFFFFFF) {
-			// Last cluster in the file.
-			// May be interpreted as an allocated cluster and the final	cluster in the file(indicating end-of-file condition).
-			break;
+		if (!lfn_present) {
+			group_start = offset;
 		}
 
-		if (next_cluster == 0xFFFFFFFF) {
-			// Cluster is allocated and is the final cluster for the file (indicates end-of-file).
-			break;
+		shortname_to_longname((const char*)entry->DIR_Name, short_filename);
+		unsigned int short_hash = fat_name_hash(short_filename);
+
+		if (!fat_index_insert(directory->disk, index, short_hash, group_start)) {
+			return 0;
 		}
 
-		current_file_cluster = next_cluster & 0x0FFFFFFF;
-	}
+		if (lfn_present) {
+			unsigned int long_hash = fat_name_hash(long_filename);
 
-	file->cursor += write_total_bytes;
+			if (long_hash != short_hash && !fat_index_insert(directory->disk, index, long_hash, group_start)) {
+				return 0;
+			}
+		}
 
-	if (file->cursor > file_dir->DIR_FileSize) {
-		file_dir->DIR_FileSize = file->cursor;
-		fat_update_entry(file);
+		lfn_present = 0;
 	}
 
 	return 1;
 }
 
-int fat_fseek(fat_FILE* file, int offset, int origin) {
-	if (origin == fat_SEEK_SET) {
-		file->cursor = offset;
-	}
-	else if (origin == fat_SEEK_CUR) {
-		file->cursor += offset;
-	}
-	else if (origin == fat_SEEK_END) {
-		file->cursor = file->fat_dir.DIR_FileSize + offset;
-	}
+// Indexes the directory, taking the place of the least recently used indexed directory.
+// If the directory has too many entries to be indexed it is remembered as such, so that lookups don't try again
+static fat_index_dir* fat_index_build(fat_FILE* directory) {
+	fat_DISK* disk = directory->disk;
 
-	return 1;
-}
+	for (int attempt = 0; attempt < 2; attempt++) {
+		fat_index_dir* index = &disk->index_dirs[0];
+		for (int i = 0; i < fat_INDEX_DIRECTORIES; i++) {
+			if (disk->index_dirs[i].tag == 0) {
+				index = &disk->index_dirs[i];
+				break;
+			}
+			if (disk->index_dirs[i].last_use < index->last_use) {
+				index = &disk->index_dirs[i];
+			}
+		}
 
-int fat_dirseek(fat_DIR* dir, int offset, int origin) {
-	if (origin == fat_SEEK_SET) {
-		dir->dir_file.cursor = offset;
-	}
-	else if (origin == fat_SEEK_CUR) {
-		dir->dir_file.cursor += offset;
-	}
-	else if (origin == fat_SEEK_END) {
-		return 0;
+		index->cluster = fat_first_cluster(&directory->fat_dir);
+		index->tag = ++disk->index_clock;
+		index->size = directory->fat_dir.DIR_FileSize;
+		index->last_use = disk->index_clock;
+		index->complete = 1;
+
+		if (fat_index_scan(directory, index)) {
+			return index;
+		}
+
+		// The slots are taken by other and forgotten directories, start over with an empty index
+		fat_index_clear(disk);
 	}
 
-	return 1;
-}
+	fat_index_dir* index = &disk->index_dirs[0];
+	index->cluster = fat_first_cluster(&directory->fat_dir);
+	index->tag = ++disk->index_clock;
+	index->size = directory->fat_dir.DIR_FileSize;
+	index->last_use = disk->index_clock;
+	index->complete = 0;
 
-int fat_ftell(fat_FILE* file) {
-	return file->cursor;
+	return index;
 }
 
-// Returns fat_NOT_FOUND if not found, fat_FOUND_DIR if found and is a directory, fat_FOUND_FILE if found and is a file
-// If read_at_cursor is set to 1, the function will read the entry at the cursor position and return the result. The entry can be a file or a directory. The is_file parameter will be ignored.
-// If is_file is set to 1, the function will return fat_FOUND_FILE only if the entry is a file. fat_FOUND_DIR will not be returned, even if the directory with the same name exists.
-// If is_file is set to 0, the function will return fat_FOUND_DIR only if the entry is a directory. fat_FOUND_FILE will not be returned, even if the file with the same name exists.
-static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_dir, const char* path, unsigned char is_file, unsigned char read_at_cursor, unsigned char use_shortname) {
-	fat_file_default(&subdir_out->dir_file, root_dir->dir_file.disk);
-	if (file_out != NULL) {
-		fat_file_default(file_out, root_dir->dir_file.disk);
+// Adds the entry group of a newly created file to the index of its directory, if the directory is indexed.
+// The search for free entries starts at free_start, so if the group was placed there everything up to it is in use
+static void fat_index_add(fat_FILE* directory, fat_FILE* file, unsigned int group_start) {
+	fat_DISK* disk = directory->disk;
+	fat_index_dir* index = fat_index_find(disk, file->first_parent_cluster);
+
+	if (index == NULL) {
+		return;
 	}
 
-	// Special case for the root directory
-	if (root_dir->dir_file.fat_dir.DIR_FstClusLO < 2) {
-		root_dir->dir_file.fat_dir.DIR_FstClusLO = 2;
+	// The directory might have grown to make room for the entries, lookups only scan up to the remembered size
+	index->size = fat_file_cluster_count(directory) * disk->bpb.BPB_SecPerClus * disk->bpb.BPB_BytsPerSec;
+
+	if (!index->complete) {
+		return;
 	}
 
-	// The directory is a file that contains the directory entries
-	fat_FILE directory_file = {
-		.disk = root_dir->dir_file.disk,
-		.fat_dir = root_dir->dir_file.fat_dir,
-		.cursor = 0
-	};
-	// Directories do not hold information about their size so
-	// set the file size to the number of sectors of the directory
-	directory_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&directory_file) * directory_file.disk->bpb.BPB_SecPerClus * directory_file.disk->bpb.BPB_BytsPerSec;
+	unsigned short short_filename[13];
+	shortname_to_longname((const char*)file->fat_dir.DIR_Name, short_filename);
+	unsigned int short_hash = fat_name_hash(short_filename);
+	unsigned int long_hash = file->lfn_present ? fat_name_hash(file->long_filename) : short_hash;
 
-	// For iterating through the directory
-	unsigned int dir_offset = 0;
-	unsigned int entries = 0;
+	if (!fat_index_insert(disk, index, short_hash, group_start) || (long_hash != short_hash && !fat_index_insert(disk, index, long_hash, group_start))) {
+		// Out of slots, the directory is indexed again by the next lookup
+		fat_index_drop(disk, file->first_parent_cluster);
+		return;
+	}
+
+	if (group_start == index->free_start) {
+		index->free_start = file->entry_position + sizeof(fat_dir_entry);
+	}
+}
 
+// The scan descends into subdirectories through the full lookup
+static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_dir, const char* path, unsigned char is_file, unsigned char read_at_cursor, unsigned char use_shortname);
+
+// Scans the directory entries starting at dir_offset, if single is set the scan ends after the first short name entry.
+// Returns the same values as fat_find_full()
+static int fat_find_scan(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_dir, fat_FILE* directory_file, const char* path, unsigned char is_file, unsigned char read_at_cursor, unsigned char use_shortname, unsigned int dir_offset, unsigned char single) {
 	// Long file name:
 	// "Up to 20 of these 13-character entries may be chained, supporting a maximum length of 255 UCS-2 characters"
 	// 20 * 13 = 260 just to be safe
@@ -535,16 +1477,12 @@ static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_
 
 	while (1) {
 		// Check if reached the end of the directory
-		if (dir_offset >= directory_file.fat_dir.DIR_FileSize) {
+		if (dir_offset >= directory_file->fat_dir.DIR_FileSize) {
 			break;
 		}
 
-		// Read the directory entry
-		// TODO: fat_fread function performs at least 2 reads each time it's called, and it's called for each directory entry which is a lot of reads,
-		// in real world application it would probably be better to read for example one cluster at a time and then iterate through the entries in memory.
-		// The way it's implemented now is more readable though, so it is what it is for now.
-		fat_fseek(&directory_file, dir_offset, fat_SEEK_SET);
-		fat_fread((unsigned char*)&subdir_out->dir_file.fat_dir, sizeof(fat_dir_entry), 1, &directory_file);
+		// Read the directory entry from the scan buffer
+		memory_copy(&subdir_out->dir_file.fat_dir, fat_dir_entry_at(directory_file, dir_offset, single ? directory_file->disk->bpb.BPB_BytsPerSec : fat_DIR_BUFFER_SIZE), sizeof(fat_dir_entry));
 		dir_offset += sizeof(fat_dir_entry);
 
 		if (subdir_out->dir_file.fat_dir.DIR_Name[0] == 0x00) {
@@ -559,27 +1497,8 @@ static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_
 
 		if (subdir_out->dir_file.fat_dir.DIR_Attr == 0x0F) {
 			// Long file name
-			unsigned char long_filename_index = subdir_out->dir_file.fat_dir.DIR_Name[0] & 0x0F;
-			unsigned int long_filename_offset = (long_filename_index - 1) * 13;
-
-			// the long file name is split into 3 parts in the single entry
-			for (int i = 0; i < 5; i++) {
-				subdir_out->dir_file.long_filename[long_filename_offset + i] = subdir_out->dir_file.fat_lfn.LDIR_Name1[i];
-			}
-			for (int i = 0; i < 6; i++) {
-				subdir_out->dir_file.long_filename[long_filename_offset + 5 + i] = subdir_out->dir_file.fat_lfn.LDIR_Name2[i];
-			}
-			for (int i = 0; i < 2; i++) {
-				subdir_out->dir_file.long_filename[long_filename_offset + (5 + 6) + i] = subdir_out->dir_file.fat_lfn.LDIR_Name3[i];
-			}
-
-			if (subdir_out->dir_file.fat_dir.DIR_Name[0] & 0x40) {
-				// Last long file name entry
-				// but actually, it's the first one in the memory
+			if (fat_lfn_collect(&subdir_out->dir_file.fat_lfn, subdir_out->dir_file.long_filename)) {
 				lfn_present = 1;
-
-				// add the null terminator
-				subdir_out->dir_file.long_filename[long_filename_offset + 13] = '\0';
 			}
 
 			continue;
@@ -595,7 +1514,7 @@ static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_
 		}
 
 		if (read_at_cursor){
-			if (entries == root_dir->dir_file.cursor) {
+			{
 				found = (subdir_out->dir_file.fat_dir.DIR_Attr & fat_ATTR_DIRECTORY) ? fat_FOUND_DIR : fat_FOUND_FILE;
 				if (file_out != NULL && found == fat_FOUND_FILE) {
 					file_out->fat_dir = subdir_out->dir_file.fat_dir;
@@ -603,10 +1522,11 @@ static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_
 				}
 				fat_FILE* file_out_ptr = (found == fat_FOUND_FILE) ? file_out : &subdir_out->dir_file;
 				file_out_ptr->entry_position = dir_offset - sizeof(fat_dir_entry);
-				file_out_ptr->first_parent_cluster = directory_file.fat_dir.DIR_FstClusLO;
+				file_out_ptr->first_parent_cluster = fat_first_cluster(&directory_file->fat_dir);
 				file_out_ptr->lfn_present = lfn_present;
 
-				root_dir->dir_file.cursor++;
+				// Continue after this entry on the next call
+				root_dir->dir_file.cursor = dir_offset;
 				break;
 			}
 		}
@@ -625,7 +1545,7 @@ static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_
 							found = fat_FOUND_DIR;
 
 							subdir_out->dir_file.entry_position = dir_offset - sizeof(fat_dir_entry);
-							subdir_out->dir_file.first_parent_cluster = directory_file.fat_dir.DIR_FstClusLO;
+							subdir_out->dir_file.first_parent_cluster = fat_first_cluster(&directory_file->fat_dir);
 							subdir_out->dir_file.lfn_present = lfn_present;
 
 							break;
@@ -648,7 +1568,7 @@ static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_
 								file_out->fat_dir = subdir_out->dir_file.fat_dir;
 
 								file_out->entry_position = dir_offset - sizeof(fat_dir_entry);
-								file_out->first_parent_cluster = directory_file.fat_dir.DIR_FstClusLO;
+								file_out->first_parent_cluster = fat_first_cluster(&directory_file->fat_dir);
 								file_out->lfn_present = lfn_present;
 
 								memory_copy(file_out->long_filename, subdir_out->dir_file.long_filename, sizeof(subdir_out->dir_file.long_filename));
@@ -664,12 +1584,84 @@ static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_
 			lfn_present = 0;
 		}
 
-		entries++;
+		if (single) {
+			// Only the entry the scan started at was requested
+			break;
+		}
 	}
 
 	return found;
 }
 
+// Returns fat_NOT_FOUND if not found, fat_FOUND_DIR if found and is a directory, fat_FOUND_FILE if found and is a file
+// If read_at_cursor is set to 1, the function will read the entry at the cursor position and return the result. The entry can be a file or a directory. The is_file parameter will be ignored.
+// If is_file is set to 1, the function will return fat_FOUND_FILE only if the entry is a file. fat_FOUND_DIR will not be returned, even if the directory with the same name exists.
+// If is_file is set to 0, the function will return fat_FOUND_DIR only if the entry is a directory. fat_FOUND_FILE will not be returned, even if the file with the same name exists.
+static int fat_find_full(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_dir, const char* path, unsigned char is_file, unsigned char read_at_cursor, unsigned char use_shortname) {
+	fat_file_default(&subdir_out->dir_file, root_dir->dir_file.disk);
+	if (file_out != NULL) {
+		fat_file_default(file_out, root_dir->dir_file.disk);
+	}
+
+	// Special case for the root directory, ".." entries pointing to it hold cluster 0
+	if (fat_first_cluster(&root_dir->dir_file.fat_dir) < 2) {
+		fat_set_first_cluster(&root_dir->dir_file.fat_dir, fat_first_cluster(&root_dir->dir_file.disk->root_directory.dir_file.fat_dir));
+	}
+
+	// The directory is a file that contains the directory entries
+	fat_FILE directory_file = {
+		.disk = root_dir->dir_file.disk,
+		.fat_dir = root_dir->dir_file.fat_dir,
+		.cursor = 0
+	};
+
+	// Directories do not hold information about their size so set the file size to the number
+	// of sectors of the directory, indexed directories remember it from the time they were indexed
+	fat_index_dir* index = fat_index_find(directory_file.disk, fat_first_cluster(&directory_file.fat_dir));
+
+	if (index != NULL) {
+		directory_file.fat_dir.DIR_FileSize = index->size;
+	}
+	else {
+		directory_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&directory_file) * directory_file.disk->bpb.BPB_SecPerClus * directory_file.disk->bpb.BPB_BytsPerSec;
+	}
+
+	if (read_at_cursor) {
+		// For iterating through the directory, when reading at cursor the scan resumes
+		// from the byte offset stored in the cursor instead of the start of the directory
+		return fat_find_scan(subdir_out, file_out, root_dir, &directory_file, path, is_file, read_at_cursor, use_shortname, root_dir->dir_file.cursor, 0);
+	}
+
+	if (index == NULL) {
+		index = fat_index_build(&directory_file);
+	}
+
+	if (!index->complete) {
+		// Too large to be indexed, fall back to scanning the whole directory
+		return fat_find_scan(subdir_out, file_out, root_dir, &directory_file, path, is_file, read_at_cursor, use_shortname, 0, 0);
+	}
+
+	// Every entry of the directory is in the index, so only the entries with a matching hash have to be checked
+	unsigned int hash = fat_path_hash(path);
+	unsigned int slot = hash % fat_INDEX_SLOTS;
+
+	while (directory_file.disk->index_slots[slot].tag != 0) {
+		fat_index_slot* entry = &directory_file.disk->index_slots[slot];
+
+		if (entry->tag == index->tag && entry->hash == hash) {
+			int found = fat_find_scan(subdir_out, file_out, root_dir, &directory_file, path, is_file, read_at_cursor, use_shortname, entry->position, 1);
+
+			if (found != fat_NOT_FOUND) {
+				return found;
+			}
+		}
+
+		slot = (slot + 1) % fat_INDEX_SLOTS;
+	}
+
+	return fat_NOT_FOUND;
+}
+
 static int fat_find(fat_DIR* subdir_out, fat_FILE* file_out, fat_DIR* root_dir, const char* path, unsigned char is_file, unsigned char read_at_cursor) {
 	return fat_find_full(subdir_out, file_out, root_dir, path, is_file, read_at_cursor, 0);
 }
@@ -690,55 +1682,14 @@ int fat_opendir(fat_DIR* subdir_out, fat_DIR* root_dir, const char* path) {
 	}
 	int success = fat_find(subdir_out, NULL, root_dir, path, 0, 0);
 	subdir_out->dir_file.cursor = 0;
-	if (subdir_out->dir_file.fat_dir.DIR_FstClusLO < 2) {
-		subdir_out->dir_file.fat_dir.DIR_FstClusLO = 2;
+	if (fat_first_cluster(&subdir_out->dir_file.fat_dir) < 2) {
+		fat_set_first_cluster(&subdir_out->dir_file.fat_dir, fat_first_cluster(&root_dir->dir_file.disk->root_directory.dir_file.fat_dir));
 	}
 	return success;
 }
 
 void fat_remove_fat_chain(fat_FILE* file){
-	unsigned int first_fat_sector = file->disk->bpb.BPB_RsvdSecCnt;
-	unsigned int first_data_sector = first_fat_sector + (file->disk->bpb.BPB_NumFATs * file->disk->bpb.BPB_FATSz32);
-
-	unsigned int current_file_cluster = file->fat_dir.DIR_FstClusLO;
-	unsigned int next_cluster = 0;
-	unsigned int cluster_size = file->disk->bpb.BPB_SecPerClus * file->disk->bpb.BPB_BytsPerSec;
-
-	while (1) {
-		if (current_file_cluster < 2) {
-			break;
-		}
-
-		next_cluster = fat_read_fat_entry(file->disk, current_file_cluster, 0);
-
-		if (next_cluster == 0x0FFFFFF7) {
-			// Cluster is bad
-			break;
-		}
-
-		if (next_cluster == 0x0) {
-			// Cluster is free
-			break;
-		}
-
-		unsigned int cluster_offset = first_data_sector + (current_file_cluster - 2) * file->disk->bpb.BPB_SecPerClus;
-
-		// Set the current cluster as free
-		fat_write_fat_entry(file->disk, current_file_cluster, 0x0);
-
-		if (next_cluster >= 0x0FFFFFF8 && next_cluster <= 0x0FFFFFFF) {
-			// Last cluster in the file.
-			// May be interpreted as an allocated cluster and the final	cluster in the file(indicating end-of-file condition).
-			break;
-		}
-
-		if (next_cluster == 0xFFFFFFFF) {
-			// Cluster is allocated and is the final cluster for the file (indicates end-of-file).
-			break;
-		}
-
-		current_file_cluster = next_cluster & 0x0FFFFFFF;
-	}
+	fat_free_chain(file->disk, fat_first_cluster(&file->fat_dir));
 }
 
 unsigned char fat_lfn_checksum(const unsigned char* shortname) {
@@ -756,8 +1707,7 @@ unsigned char fat_lfn_checksum(const unsigned char* shortname) {
 void fat_update_lfn(fat_FILE* file, unsigned char remove) {
 	fat_DIR parent_dir;
 	fat_file_default(&parent_dir.dir_file, file->disk);
-	parent_dir.dir_file.fat_dir.DIR_FstClusLO = file->first_parent_cluster;
-	parent_dir.dir_file.fat_dir.DIR_FstClusHI = file->first_parent_cluster >> 16;
+	fat_set_first_cluster(&parent_dir.dir_file.fat_dir, file->first_parent_cluster);
 	parent_dir.dir_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&parent_dir.dir_file) * parent_dir.dir_file.disk->bpb.BPB_SecPerClus * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec;
 
 	if (file->lfn_present){
@@ -779,6 +1729,10 @@ void fat_update_lfn(fat_FILE* file, unsigned char remove) {
 
 		unsigned int entry_position = file->entry_position;
 		while (1) {
+			if (entry_position < sizeof(fat_dir_entry)) {
+				// Reached the start of the directory
+				break;
+			}
 			entry_position -= sizeof(fat_dir_entry);
 			
 			if (remove){
@@ -827,6 +1781,7 @@ void fat_update_lfn(fat_FILE* file, unsigned char remove) {
 }
 
 unsigned char fat_fremove(fat_FILE* file) {
+	fat_index_drop(file->disk, file->first_parent_cluster);
 	fat_update_lfn(file, 1);
 
 	// Set the entry in the directory as free
@@ -863,6 +1818,8 @@ unsigned char fat_dirremove(fat_DIR* dir) {
 	}
 
 	// Set the entry in the directory as free
+	fat_index_drop(dir->dir_file.disk, dir->dir_file.first_parent_cluster);
+	fat_index_drop(dir->dir_file.disk, fat_first_cluster(&dir->dir_file.fat_dir));
 	dir->dir_file.fat_dir.DIR_Name[0] = 0xE5;
 	fat_update_entry(&dir->dir_file);
 
@@ -887,6 +1844,116 @@ unsigned char fat_remove(fat_DIR* root_dir, const char* path, unsigned char is_f
 	return 0;
 }
 
+// Returns 1 if a file or a directory in the directory already uses the short name (in the directory entry format).
+// The size of the directory has to be set
+static unsigned char fat_shortname_taken(fat_DIR* parent_dir, const unsigned char* shortname) {
+	fat_FILE* directory = &parent_dir->dir_file;
+	fat_index_dir* index = fat_index_find(directory->disk, fat_first_cluster(&directory->fat_dir));
+
+	unsigned short name[13];
+	shortname_to_longname((const char*)shortname, name);
+
+	if (index == NULL || !index->complete) {
+		// Not indexed yet, the lookup indexes the directory for the next names
+		fat_DIR helper_dir;
+		char helper_path[13];
+		fat_longname_to_string(name, helper_path);
+
+		return fat_find_full(&helper_dir, NULL, parent_dir, helper_path, 1, 0, 1) != fat_NOT_FOUND || fat_find_full(&helper_dir, NULL, parent_dir, helper_path, 0, 0, 1) != fat_NOT_FOUND;
+	}
+
+	// Only the entry groups with a matching hash have to be read
+	unsigned int hash = fat_name_hash(name);
+	unsigned int slot = hash % fat_INDEX_SLOTS;
+
+	while (directory->disk->index_slots[slot].tag != 0) {
+		fat_index_slot* entry = &directory->disk->index_slots[slot];
+
+		if (entry->tag == index->tag && entry->hash == hash) {
+			// Skip the long name entries of the group
+			unsigned int offset = entry->position;
+			fat_dir_entry* dir_entry = fat_dir_entry_at(directory, offset, directory->disk->bpb.BPB_BytsPerSec);
+
+			while (dir_entry->DIR_Attr == 0x0F && offset + 2 * sizeof(fat_dir_entry) <= directory->fat_dir.DIR_FileSize) {
+				offset += sizeof(fat_dir_entry);
+				dir_entry = fat_dir_entry_at(directory, offset, directory->disk->bpb.BPB_BytsPerSec);
+			}
+
+			unsigned char same = 1;
+			for (int i = 0; i < 11; i++) {
+				if (dir_entry->DIR_Name[i] != shortname[i]) {
+					same = 0;
+					break;
+				}
+			}
+
+			if (same) {
+				return 1;
+			}
+		}
+
+		slot = (slot + 1) % fat_INDEX_SLOTS;
+	}
+
+	return 0;
+}
+
+// Puts a numeric tail on the short name of a file with a long name, DIR_Name holds the basis name created from the long name.
+// The first names are in the "LONGNA~1.TXT" format, after that all but two characters of the basis are replaced
+// with a hash of the long name ("LO3F2A~1.TXT"), so that many files with a common prefix don't go through every number.
+// Returns 0 if no unique short name was found
+static unsigned char fat_shortname_generate(fat_DIR* parent_dir, fat_FILE* file) {
+	const char* hex_digits = "0123456789ABCDEF";
+
+	unsigned char basis[8];
+	unsigned int basis_length = 0;
+	for (int i = 0; i < 8; i++) {
+		basis[i] = file->fat_dir.DIR_Name[i];
+	}
+	while (basis_length < 8 && basis[basis_length] != ' ') {
+		basis_length++;
+	}
+
+	unsigned int hash = fat_name_hash(file->long_filename);
+	hash = (hash ^ (hash >> 16)) & 0xFFFF;
+
+	for (unsigned int attempt = 1; attempt < fat_SHORTNAME_BASIS_TRIES + 1000; attempt++) {
+		unsigned int prefix_length = basis_length;
+		unsigned int tail = attempt;
+
+		if (attempt > fat_SHORTNAME_BASIS_TRIES) {
+			prefix_length = (basis_length < 2) ? basis_length : 2;
+			tail = attempt - fat_SHORTNAME_BASIS_TRIES;
+		}
+
+		for (unsigned int i = 0; i < 8; i++) {
+			file->fat_dir.DIR_Name[i] = (i < prefix_length) ? basis[i] : ' ';
+		}
+
+		if (attempt > fat_SHORTNAME_BASIS_TRIES) {
+			for (int i = 0; i < 4; i++) {
+				file->fat_dir.DIR_Name[prefix_length++] = hex_digits[(hash >> (12 - 4 * i)) & 0xF];
+			}
+		}
+
+		// The tail goes right after the prefix or replaces its end if there is no room left
+		char tail_str[5];
+		tail_str[0] = '~';
+		unsigned int tail_length = 1 + fat_itoa(tail, tail_str + 1, 10);
+		unsigned int tail_position = (prefix_length < 8 - tail_length) ? prefix_length : 8 - tail_length;
+
+		for (unsigned int i = 0; i < tail_length; i++) {
+			file->fat_dir.DIR_Name[tail_position + i] = tail_str[i];
+		}
+
+		if (!fat_shortname_taken(parent_dir, file->fat_dir.DIR_Name)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 int fat_create(fat_FILE* new_file_out, fat_DIR* root_dir, const char* path, unsigned char attributes) {
 	// Find the parent directory
 	unsigned int path_length = 0;
@@ -968,49 +2035,20 @@ int fat_create(fat_FILE* new_file_out, fat_DIR* root_dir, const char* path, unsi
 
 	unsigned int lfn_entries = 0;
 
+	// In FAT32, the size of the directory file is not saved in the directory entry (DIR_FileSize is 0), so we need to calculate it
+	// The size is required for the fat_fread and fat_fwrite functions to work correctly
+	parent_dir.dir_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&parent_dir.dir_file) * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec * parent_dir.dir_file.disk->bpb.BPB_SecPerClus;
+
 	if (new_file_out->lfn_present) {
 		// The file name is too long, long file name will be used
-
-		// Create short version of the file name
-		// The short name is in the format: "FILE~1.TXT"
-		// The short name should be unique, so we increment the number at the end of the name if the name is already taken
-		unsigned int repeat = 1;
-		while (repeat < 1000) {
-			char repeat_str[4];
-			int repeat_len = fat_itoa(repeat, repeat_str, 10);
-
-			// Copy to the short name
-			new_file_out->fat_dir.DIR_Name[8 - repeat_len - 1] = '~';
-			for (int i = 0; i < repeat_len; i++) {
-				new_file_out->fat_dir.DIR_Name[8 - repeat_len + i] = repeat_str[i];
-			}
-
-			// Check if the short name is unique
-			fat_DIR helper_dir;
-			char helper_path[13];
-			for (int i = 0; i < 8; i++) {
-				helper_path[i] = new_file_out->fat_dir.DIR_Name[i];
-			}
-			helper_path[8] = '.';
-			for (int i = 0; i < 3; i++) {
-				helper_path[9 + i] = new_file_out->fat_dir.DIR_Name[8 + i];
-				if (helper_path[9 + i] == ' ') {
-					helper_path[9 + i] = '\0';
-					break;
-				}
-			}
-			helper_path[12] = '\0';
-
-			if (fat_find_full(&helper_dir, NULL, &parent_dir, helper_path, 1, 0, 1) == fat_NOT_FOUND) {
-				break;
-			}
-
-			repeat++;
+		// Create a unique short version of the file name, like "FILE~1.TXT"
+		if (!fat_shortname_generate(&parent_dir, new_file_out)) {
+			return 0;
 		}
 
-		// "name_length + 1" for the null terminator,
-		// "name_length + 1 - 1" and "/ 13 + 1" to round up
-		lfn_entries = (name_length + 1 - 1) / 13 + 1;
+		// Must match fat_update_lfn, a name that fills the last entry
+		// exactly has no null terminator, "- 1" and "/ 13 + 1" to round up
+		lfn_entries = (name_length - 1) / 13 + 1;
 	}
 
 	/* Create file */
@@ -1021,11 +2059,12 @@ int fat_create(fat_FILE* new_file_out, fat_DIR* root_dir, const char* path, unsi
 	unsigned int required_entries = 1 + lfn_entries;
 	unsigned int found_contiguous_entries = 0;
 
-	// In FAT32, the size of the directory file is not saved in the directory entry (DIR_FileSize is 0), so we need to calculate it
-	// The size is required for the fat_fread and fat_fwrite functions to work correctly
-	parent_dir.dir_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&parent_dir.dir_file) * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec * parent_dir.dir_file.disk->bpb.BPB_SecPerClus;
+	// Find the first free entry in the directory, an indexed directory knows where the entries in use end
+	fat_index_dir* index = fat_index_find(parent_dir.dir_file.disk, fat_first_cluster(&parent_dir.dir_file.fat_dir));
+	if (index != NULL && index->complete) {
+		dir_offset = index->free_start;
+	}
 
-	// Find the first free entry in the directory
 	while (1){
 		if (dir_offset + sizeof(fat_dir_entry) > parent_dir.dir_file.fat_dir.DIR_FileSize) {
 			// The directory is full, increase the size of the directory with new zeroed entries
@@ -1058,29 +2097,26 @@ int fat_create(fat_FILE* new_file_out, fat_DIR* root_dir, const char* path, unsi
 
 	// Save the entry position
 	new_file_out->entry_position = dir_offset;
-	new_file_out->first_parent_cluster = parent_dir.dir_file.fat_dir.DIR_FstClusLO + (parent_dir.dir_file.fat_dir.DIR_FstClusHI << 16);
+	new_file_out->first_parent_cluster = fat_first_cluster(&parent_dir.dir_file.fat_dir);
 
 	// Allocate a new cluster for the file
-	unsigned int disk_size = (parent_dir.dir_file.disk->bpb.BPB_TotSec32 == 0) ? parent_dir.dir_file.disk->bpb.BPB_TotSec16 : parent_dir.dir_file.disk->bpb.BPB_TotSec32;
-	unsigned int free_cluster = 2;
-	fat_invalidate_cache();
-	while (fat_read_fat_entry(parent_dir.dir_file.disk, free_cluster, 1) != 0x0) {
-		free_cluster++;
-		if (free_cluster * parent_dir.dir_file.disk->bpb.BPB_SecPerClus >= disk_size) {
-			// No free clusters
-			return 0;
-		}
+	unsigned int free_length = 0;
+	unsigned int free_cluster = fat_alloc_run(parent_dir.dir_file.disk, parent_dir.dir_file.disk->next_free, 1, &free_length);
+	if (free_cluster == 0) {
+		// No free clusters
+		return 0;
 	}
 
-	new_file_out->fat_dir.DIR_FstClusLO = free_cluster;
-	new_file_out->fat_dir.DIR_FstClusHI = free_cluster >> 16;
+	fat_set_first_cluster(&new_file_out->fat_dir, free_cluster);
+	fat_chain_forget(parent_dir.dir_file.disk, free_cluster);
 	
 	fat_write_fat_entry(parent_dir.dir_file.disk, free_cluster, 0x0FFFFFFF);
-	fat_clear_cluster(parent_dir.dir_file.disk, free_cluster);
+	fat_clear_cluster(parent_dir.dir_file.disk, free_cluster, 0, parent_dir.dir_file.disk->bpb.BPB_SecPerClus * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec);
 
 	// Update the parent directory with the new entry
 	fat_update_entry(new_file_out);
 	fat_update_lfn(new_file_out, 0);
+	fat_index_add(&parent_dir.dir_file, new_file_out, dir_offset - lfn_entries * sizeof(fat_dir_entry));
 
 	return 1;
 }
@@ -1107,8 +2143,7 @@ int fat_create_dir(fat_DIR* new_dir_out, fat_DIR* root_dir, const char* path, un
 	// Create . and .. entries
 	fat_DIR parent_dir;
 	fat_file_default(&parent_dir.dir_file, new_dir_out->dir_file.disk);
-	parent_dir.dir_file.fat_dir.DIR_FstClusLO = new_dir_out->dir_file.first_parent_cluster;
-	parent_dir.dir_file.fat_dir.DIR_FstClusHI = new_dir_out->dir_file.first_parent_cluster >> 16;
+	fat_set_first_cluster(&parent_dir.dir_file.fat_dir, new_dir_out->dir_file.first_parent_cluster);
 	parent_dir.dir_file.fat_dir.DIR_FileSize = fat_file_cluster_count(&parent_dir.dir_file) * parent_dir.dir_file.disk->bpb.BPB_SecPerClus * parent_dir.dir_file.disk->bpb.BPB_BytsPerSec;
 
 	fat_dir_entry entry;
@@ -1158,11 +2193,7 @@ int fat_fopen(fat_FILE* file_out, fat_DIR* root_dir, const char* path, const cha
 		if (find_success == fat_FOUND_FILE) {
 			if (mode[0] == 'w') {
 				// File exists, truncate it
-				file_out->fat_dir.DIR_FileSize = 0;
-				fat_update_entry(file_out);
-				fat_remove_fat_chain(file_out);
-				fat_write_fat_entry(file_out->disk, file_out->fat_dir.DIR_FstClusLO, 0x0FFFFFFF);
-				success = 1;
+				success = fat_ftruncate(file_out, 0);
 			}
 			else if (mode[0] == 'a') {
 				// Seek to the end of the file
@@ -1182,6 +2213,10 @@ int fat_init(fat_DISK* disk, fat_disk_access_func_t read_func, fat_disk_access_f
 	disk->read_func = read_func;
 	disk->write_func = write_func;
 	disk->user_args = user_args;
+	fat_cache_init(disk);
+	fat_table_init(disk);
+	fat_index_init(disk);
+	fat_chain_init(disk);
 
 	// Read the BPB
 	disk->read_func((unsigned char*)&disk->bpb, 0x00, sizeof(fat_bpb), disk->user_args);
@@ -1204,13 +2239,50 @@ int fat_init(fat_DISK* disk, fat_disk_access_func_t read_func, fat_disk_access_f
 
 	// Read the root directory
 	fat_file_default(&disk->root_directory.dir_file, disk);
-	disk->root_directory.dir_file.fat_dir.DIR_FstClusLO = (disk->bpb.BPB_RootClus == 0) ? 2 : disk->bpb.BPB_RootClus;
+	fat_set_first_cluster(&disk->root_directory.dir_file.fat_dir, (disk->bpb.BPB_RootClus == 0) ? 2 : disk->bpb.BPB_RootClus);
 	disk->root_directory.dir_file.fat_dir.DIR_FileSize = -1;
+	disk->root_directory.dir_file.fat_dir.DIR_Attr = fat_ATTR_DIRECTORY;
 
 	unsigned int first_fat_sector = disk->bpb.BPB_RsvdSecCnt;
 	unsigned int first_data_sector = first_fat_sector + (disk->bpb.BPB_NumFATs * disk->bpb.BPB_FATSz32);
 	disk->root_directory.dir_file.entry_position = first_data_sector * disk->bpb.BPB_BytsPerSec;
 
+	// Find out which clusters are free
+	fat_free_map_load(disk);
+
+	return 1;
+}
+
+int fat_sync(fat_DISK* disk) {
+	if (disk->busy) {
+		return 0;
+	}
+
+	fat_free_map_flush(disk);
+	fat_table_flush(disk);
+
+	// Write the blocks in ascending order so that the device head only sweeps once
+	unsigned int last = 0;
+	unsigned char first = 1;
+
+	while (1) {
+		fat_cache_block* next = NULL;
+		for (int i = 0; i < fat_CACHE_BLOCKS; i++) {
+			fat_cache_block* slot = &disk->cache[i];
+			if (slot->dirty && (first || slot->block > last) && (next == NULL || slot->block < next->block)) {
+				next = slot;
+			}
+		}
+
+		if (next == NULL) {
+			break;
+		}
+
+		fat_cache_writeback(disk, next);
+		last = next->block;
+		first = 0;
+	}
+
 	return 1;
 }
 
@@ -27,6 +27,33 @@ typedef void(*fat_disk_access_func_t)(unsigned char* data, unsigned int offset_i
 #define fat_ATTR_DIRECTORY 0x10
 #define fat_ATTR_ARCHIVE 0x20
 
+// Number of blocks held by the write-back cache of each disk
+#define fat_CACHE_BLOCKS 16
+// Size of a single cache block in bytes, this should match the sector size of the device
+#define fat_CACHE_BLOCK_SIZE 512
+// Number of blocks held by the FAT cache of each disk, FATs that fit are cached whole
+#define fat_TABLE_CACHE_BLOCKS 32
+// Number of cluster chains whose runs are mapped at the same time on each disk
+#define fat_CHAIN_MAPS 16
+// Number of runs the extent array of a chain map is allocated for first, it doubles whenever it fills up
+#define fat_EXTENT_INITIAL 8
+// Number of contiguous clusters mapped ahead when a file is first read past its mapped part
+#define fat_EXTENT_LOOKAHEAD 256
+// Number of clusters covered by the free cluster bitmap of each disk, clusters past it are checked in the FAT
+#define fat_FREE_MAP_CLUSTERS 16384
+// Number of clusters the allocator looks through for a longer run once it found a free, but too short one
+#define fat_ALLOC_SEARCH 1024
+// Size of the buffer directories are scanned through, in bytes
+#define fat_DIR_BUFFER_SIZE 2048
+// Size of the zeroed buffer new clusters are cleared with, clusters larger than that are cleared in pieces
+#define fat_CLEAR_CHUNK_SIZE 4096
+// Number of directories whose entries are indexed by name at the same time on each disk
+#define fat_INDEX_DIRECTORIES 16
+// Number of slots in the name index of each disk, shared by all indexed directories
+#define fat_INDEX_SLOTS 4096
+// Number of "NAME~1.TXT" style short names tried for a long name before falling back to ones with a hash of the name in them
+#define fat_SHORTNAME_BASIS_TRIES 4
+
 #pragma pack(1)
 typedef struct fat_bpb_s {
 	/*
@@ -67,6 +94,18 @@ typedef struct fat_bpb_s {
 } fat_bpb;
 #pragma pack()
 
+#pragma pack(1)
+typedef struct fat_fsinfo_s {
+	unsigned int FSI_LeadSig;			// 0x41615252
+	unsigned char FSI_Reserved1[480];
+	unsigned int FSI_StrucSig;			// 0x61417272
+	unsigned int FSI_Free_Count;		// last known free cluster count, 0xFFFFFFFF if unknown
+	unsigned int FSI_Nxt_Free;			// cluster where the search for free clusters should start, 0xFFFFFFFF if unknown
+	unsigned char FSI_Reserved2[12];
+	unsigned int FSI_TrailSig;			// 0xAA550000
+} fat_fsinfo;
+#pragma pack()
+
 #pragma pack(1)
 typedef struct fat_dir_entry_s {
 	unsigned char DIR_Name[11];
@@ -100,6 +139,12 @@ typedef struct fat_lfn_entry_s {
 // forward declaration
 typedef struct fat_DISK_s fat_DISK;
 
+typedef struct fat_extent_s {
+	unsigned int index;		// position of the first cluster of the run within the file, in clusters
+	unsigned int cluster;	// first cluster of the run on the disk
+	unsigned int length;	// number of physically contiguous clusters in the run
+} fat_extent;
+
 typedef struct fat_FILE_s {
 	union {
 		fat_dir_entry fat_dir;
@@ -117,12 +162,80 @@ typedef struct fat_DIR_s {
 	fat_FILE dir_file;
 } fat_DIR;
 
+typedef struct fat_cache_block_s {
+	unsigned int block;		// index of the cached block on the disk, 0xFFFFFFFF if the slot is empty
+	unsigned int last_use;	// value of the cache clock on last access, used to pick the eviction victim
+	unsigned char data[fat_CACHE_BLOCK_SIZE];
+	unsigned char dirty;	// set if the block was modified and has to be written back
+} fat_cache_block;
+
+typedef struct fat_index_slot_s {
+	unsigned int tag;		// tag of the indexed directory the slot belongs to, 0 if the slot is empty
+	unsigned int hash;		// hash of the case-folded short or long name
+	unsigned int position;	// offset of the first entry of the entry group (long name entries included) within the directory
+} fat_index_slot;
+
+typedef struct fat_chain_map_s {
+	unsigned int cluster;	// first cluster of the mapped chain, 0 if the slot is empty
+	unsigned int length;	// number of clusters in the chain, 0 if its end was not reached yet
+	unsigned int last_use;	// value of the chain clock on last access, used to pick the map to forget
+	unsigned int count;		// number of runs in the extent array
+	unsigned int capacity;	// number of runs the extent array has room for
+	fat_extent* extents;	// runs of the chain mapped so far sorted by index, allocated with kmalloc()
+} fat_chain_map;
+
+typedef struct fat_index_dir_s {
+	unsigned int cluster;	// first cluster of the indexed directory
+	unsigned int tag;		// identifies the slots of this directory, 0 if the directory is not indexed
+	unsigned int size;		// size of the directory in bytes
+	unsigned int free_start;	// offset of the first free entry, all entries before it are in use
+	unsigned int last_use;	// value of the index clock on last access, used to pick the directory to forget
+	unsigned char complete;	// set if all entries are in the index, cleared if the directory is too large to be indexed
+} fat_index_dir;
+
 typedef struct fat_DISK_s {
 	fat_disk_access_func_t read_func;
 	fat_disk_access_func_t write_func;
 	void* user_args;
 	fat_bpb bpb;
 	fat_DIR root_directory;
+
+	// Write-back cache, small writes (directory entries, FAT entries, partial sectors)
+	// are kept here until fat_sync() is called or the block has to be evicted
+	fat_cache_block cache[fat_CACHE_BLOCKS];
+	unsigned int cache_clock;
+	unsigned int busy;			// nesting depth of the accessors in progress, fat_sync() waits for 0
+
+	// FAT cache, the block index is counted from the start of the FAT. Holds the whole FAT of small volumes
+	// and the most recently used part of it otherwise, the backup copies are only updated when a block is written back
+	fat_cache_block table_cache[fat_TABLE_CACHE_BLOCKS];
+
+	// Free space tracking, loaded from the FAT and the FSInfo sector by fat_init(),
+	// the FSInfo sector is updated by fat_sync() if any of the values changed
+	unsigned int cluster_count;		// number of the last data cluster + 1
+	unsigned int free_count;		// number of free clusters, 0xFFFFFFFF if unknown
+	unsigned int next_free;			// cluster where the next search for free clusters starts
+	unsigned char fsinfo_present;	// set if the volume has a valid FSInfo sector
+	unsigned char fsinfo_dirty;		// set if free_count or next_free changed since the FSInfo sector was written
+	unsigned char free_map[fat_FREE_MAP_CLUSTERS / 8];	// one bit per cluster, set if the cluster is in use
+
+	// Directory scanning, the buffer holds a part of the directory starting at the given first cluster,
+	// it is emptied by any write to the disk. The index maps names to entries of recently searched directories,
+	// created entries are added to the index of their directory, an indexed directory is forgotten when an entry is removed in it
+	unsigned char dir_buffer[fat_DIR_BUFFER_SIZE];
+	unsigned int dir_buffer_cluster;
+	unsigned int dir_buffer_offset;
+	unsigned int dir_buffer_length;
+	fat_index_dir index_dirs[fat_INDEX_DIRECTORIES];
+	fat_index_slot index_slots[fat_INDEX_SLOTS];
+	unsigned int index_used;		// number of occupied slots, including the ones of forgotten directories
+	unsigned int index_clock;
+
+	// Cluster chains of recently accessed files and directories, keyed by their first cluster and shared by all handles,
+	// so that reads and writes don't have to follow the FAT chain from the first cluster on every call. A map is trimmed
+	// when its chain is cut and forgotten when the chain is freed from its first cluster
+	fat_chain_map chain_maps[fat_CHAIN_MAPS];
+	unsigned int chain_clock;
 } fat_DISK;
 
 /**
@@ -149,6 +262,27 @@ unsigned char fat_fread(void* data_out, unsigned int element_size, unsigned int
 */
 unsigned char fat_fwrite(void* data_in, unsigned int element_size, unsigned int element_count, fat_FILE* file);
 
+/**
+ * @brief Change the size of the file, shrinking frees the clusters past the new end and growing appends zeros
+ * 
+ * @param file file to resize, the cursor is not moved
+ * @param size new size of the file in bytes
+ * 
+ * @return 1 if the file was resized, 0 if the disk is full
+*/
+unsigned char fat_ftruncate(fat_FILE* file, unsigned int size);
+
+/**
+ * @brief Allocate the clusters for the first size bytes of the file up front, the file is never shrunk.
+ * Empty files are moved to a single contiguous run when one is free, so that later writes don't have to seek
+ * 
+ * @param file file to allocate the clusters for
+ * @param size number of bytes that have to be backed by clusters, the file size grows to it if it is smaller
+ * 
+ * @return 1 if the clusters were allocated, 0 if the disk is full
+*/
+unsigned char fat_fallocate(fat_FILE* file, unsigned int size);
+
 /**
  * @brief Move the cursor in the file
  * 
@@ -169,6 +303,25 @@ int fat_fseek(fat_FILE* file, int offset, int origin);
 */
 int fat_ftell(fat_FILE* file);
 
+/**
+ * @brief Get the first cluster of the file or directory described by the entry
+ * 
+ * @param entry directory entry to read the cluster number from
+ * 
+ * @return The 28 bit cluster number built from DIR_FstClusHI and DIR_FstClusLO
+*/
+unsigned int fat_first_cluster(fat_dir_entry* entry);
+
+/**
+ * @brief Set the first cluster of the file or directory described by the entry
+ * 
+ * @param entry directory entry to update
+ * @param cluster the 28 bit cluster number, split into DIR_FstClusHI and DIR_FstClusLO
+ * 
+ * @return None
+*/
+void fat_set_first_cluster(fat_dir_entry* entry, unsigned int cluster);
+
 /**
  * @brief Reset the cursor in the directory
  * 
@@ -191,6 +344,7 @@ int fat_dirseek(fat_DIR* dir, int offset, int origin);
 
 /**
  * @brief Read the directory entry at the cursor position, entry can be a file or a directory. Useful for iterating over the directory.
+ * The cursor is a byte offset into the directory and is moved past the returned entry, so it can be saved and restored with fat_dirseek().
  * 
  * @param dir_out valid directory if found and entry is a directory
  * @param file_out valid file if found and entry is a file
@@ -291,6 +445,15 @@ int fat_fopen(fat_FILE* file_out, fat_DIR* root_dir, const char* path, const cha
 */
 int fat_init(fat_DISK* disk, fat_disk_access_func_t read_func, fat_disk_access_func_t write_func, void* user_args);
 
+/**
+ * @brief Write all dirty blocks of the write-back cache to the disk
+ * 
+ * @param disk FAT disk to flush
+ * 
+ * @return 1 if the cache was flushed, 0 if the disk is in the middle of an access and the flush has to be retried later
+*/
+int fat_sync(fat_DISK* disk);
+
 /* helper functions */
 
 /**
@@ -1,26 +1,40 @@
 #include "fatfs.h"
 #include "fat.h"
 #include "floppy.h"
+#include "ata.h"
+#include "virtio.h"
+#include "ramdisk.h"
 #include "kmalloc.h"
 #include "errno.h"
 #include "print.h"
 #include "memory.h"
 #include "util.h"
+#include "timer.h"
 
 //#define FATFS_DEBUG_LOG(...) kprintf(__VA_ARGS__);
 #define FATFS_DEBUG_LOG(...)
 
 /* private */
 
-void read_func(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args) {
-	floppy_read(data_out, offset_in, size_in);
-}
+// state of a mounted volume, created once by fatfs_load() and shared by all vRefs
+// on the mount, the disk holds the caches so it must outlive the vRefs
+typedef struct fatfs_volume_s {
+	fat_DISK disk;
+	fatfs_flush_func_t flush;
+	struct fatfs_volume_s* next;
+} fatfs_volume;
 
-void write_func(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args) {
-	floppy_write(data_in, offset_in, size_in, true);
-}
+// all mounted volumes, for the periodic write-back
+static fatfs_volume* volumes = NULL;
+
+// set by the timer, the write-back itself happens in fatfs_writeback()
+static volatile bool writeback_due = false;
 
-fat_DISK disk;
+// invoked periodically from the timer interrupt, the device accesses are too slow to
+// be made there (the floppy waits for its motor) so the flush is only requested here
+static void fatfs_writeback_tick() {
+	writeback_due = true;
+}
 
 typedef struct state_data_s {
 	bool is_dir;
@@ -35,20 +49,13 @@ typedef struct state_data_s {
 int fatfs_root(vRef* dst) {
 	FATFS_DEBUG_LOG("fatfs: root\n");
 
-	if (!floppy_init()){
-		FATFS_DEBUG_LOG("fatfs: floppy init fail\n");
-		return -LINUX_EIO;
-	}
+	fatfs_volume* volume = dst->driver->context;
 
-	if (fat_init(&disk, read_func, write_func, 0)) {
-		state_data* state = kmalloc(sizeof(state_data));
-		dst->state = state;
-		state->is_dir = true;
-		fat_copy_DIR(&state->dir, &disk.root_directory);
-		return 0;
-	}
-	FATFS_DEBUG_LOG("fatfs: root fail\n");
-	return -LINUX_EIO;
+	state_data* state = kmalloc(sizeof(state_data));
+	dst->state = state;
+	state->is_dir = true;
+	fat_copy_DIR(&state->dir, &volume->disk.root_directory);
+	return 0;
 }
 
 int fatfs_clone(vRef* dst, vRef* src) {
@@ -60,8 +67,8 @@ int fatfs_clone(vRef* dst, vRef* src) {
 	return 0;
 }
 
-int fatfs_open(vRef* vref, const char* basename, uint32_t flags) {
-	FATFS_DEBUG_LOG("fatfs: open %s\n", basename);
+int fatfs_open(vRef* vref, const char* name, int length, uint32_t flags) {
+	FATFS_DEBUG_LOG("fatfs: open %d\n", length);
 
 	state_data* state = vref->state;
 
@@ -73,6 +80,16 @@ int fatfs_open(vRef* vref, const char* basename, uint32_t flags) {
 		return -LINUX_ENOTDIR;
 	}
 
+	if (length >= FILE_MAX_NAME) {
+		return -LINUX_ENAMETOOLONG;
+	}
+
+	// the FAT library takes paths, so the name can't be passed as-is as it
+	// points into the middle of the full path and would be treated as a multi-segment path
+	char basename[FILE_MAX_NAME];
+	memcpy(basename, name, length);
+	basename[length] = 0;
+
 	fat_DIR parent_dir = state->dir;
 
 	if (flags & OPEN_DIRECTORY) {
@@ -166,27 +183,33 @@ int fatfs_list(vRef* vref, vEntry* entries, int max) {
 
 	state_data* state = vref->state;
 
-	if (state->is_dir) {
-		fat_DIR* dir = &state->dir;
-		fat_rewinddir(dir);
-		fat_DIR* dir_entry;
-		fat_FILE* file_entry;
-		for (int i = 0; i < max; i++) {
-			int result = fat_readdir(dir_entry, file_entry, dir);
-			if (result != fat_NOT_FOUND){
-				fat_FILE* file_representation = (result == fat_FOUND_FILE) ? file_entry : &dir_entry->dir_file;
-				entries[i].seek_offset = dir_entry->dir_file.entry_position;
-				entries[i].name_length = fat_longname_to_string(file_representation->long_filename, entries[i].name);
-				entries[i].type = (result == fat_FOUND_FILE) ? DT_REG : DT_DIR;
-			}
-			else {
-				break;
-			}
+	if (!state->is_dir) {
+		return -LINUX_ENOTDIR;
+	}
+
+	fat_DIR* dir = &state->dir;
+	fat_DIR dir_entry;
+	fat_FILE file_entry;
+	int count = 0;
+
+	// continue from where the last call stopped, the directory cursor is a byte
+	// offset into the directory so it can be used directly as the resume cookie
+	while (count < max) {
+		unsigned int cookie = dir->dir_file.cursor;
+		int result = fat_readdir(&dir_entry, &file_entry, dir);
+
+		if (result == fat_NOT_FOUND) {
+			break;
 		}
-		return 0;
+
+		fat_FILE* file_representation = (result == fat_FOUND_FILE) ? &file_entry : &dir_entry.dir_file;
+		entries[count].seek_offset = cookie;
+		entries[count].name_length = fat_longname_to_string(file_representation->long_filename, entries[count].name);
+		entries[count].type = (result == fat_FOUND_FILE) ? DT_REG : DT_DIR;
+		count ++;
 	}
 
-	return -LINUX_EIO;
+	return count;
 }
 
 int fatfs_mkdir(vRef* vref, const char* name) {
@@ -257,23 +280,148 @@ int fatfs_readlink(vRef* vref, const char* name, char* buffer, int size) {
 	return fatfs_read(vref, buffer, size);
 }
 
-int fatf_lookup(vRef* vref, char* name) {
-    FATFS_DEBUG_LOG("fatfs: lookup\n");
-    state_data* state = vref->state;
+int fatfs_lookup(vRef* vref, char* buffer, int size) {
+	FATFS_DEBUG_LOG("fatfs: lookup\n");
+	state_data* state = vref->state;
+
+	fatfs_volume* volume = vref->driver->context;
+
+	// check if root, then return -1
+	if (state->is_dir && (fat_first_cluster(&state->dir.dir_file.fat_dir) == fat_first_cluster(&volume->disk.root_directory.dir_file.fat_dir))) {
+		return -1;
+	}
+
+	fat_FILE* file = (state->is_dir) ? &state->dir.dir_file : &state->file;
+	int length = wstrlen((short*) file->long_filename);
+
+	if (length >= size) {
+		return -1;
+	}
+
+	return fat_longname_to_string(file->long_filename, buffer);
+}
+
+// Writes the dirty blocks of the volume and makes the device store them durably
+static bool fatfs_sync_volume(fatfs_volume* volume) {
+	if (!fat_sync(&volume->disk)) {
+		return false;
+	}
+
+	return volume->flush == NULL || volume->flush(volume->disk.user_args);
+}
+
+int fatfs_sync(vRef* vref) {
+	FATFS_DEBUG_LOG("fatfs: sync\n");
+
+	// all files share the write-back cache of the disk, FAT keeps no metadata
+	// that could be flushed separately so fsync() and fdatasync() are the same thing
+	if (vref != NULL) {
+		fatfs_volume* volume = vref->driver->context;
+		return fatfs_sync_volume(volume) ? 0 : -LINUX_EIO;
+	}
+
+	int result = 0;
 
-    // check if root, then return -1
-    if (state->is_dir && (state->dir.dir_file.fat_dir.DIR_FstClusLO <= 2)) {
-        return -1;
-    }
+	for (fatfs_volume* volume = volumes; volume != NULL; volume = volume->next) {
+		if (!fatfs_sync_volume(volume)) {
+			result = -LINUX_EIO;
+		}
+	}
 
-    fat_longname_to_string(state->file.long_filename, name);
-    return 0;
+	return result;
+}
+
+void fatfs_writeback() {
+	if (!writeback_due) {
+		return;
+	}
+
+	writeback_due = false;
+
+	// a volume that is in the middle of a disk access makes fat_sync() refuse
+	// to touch the cache, the dirty blocks will be picked up on the next request
+	for (fatfs_volume* volume = volumes; volume != NULL; volume = volume->next) {
+		fat_sync(&volume->disk);
+	}
+}
+
+int fatfs_resize(vRef* vref, uint32_t size, bool allocate) {
+	FATFS_DEBUG_LOG("fatfs: resize %d\n", size);
+
+	state_data* state = vref->state;
+
+	if (state->is_dir) {
+		return -LINUX_EISDIR;
+	}
+
+	fat_FILE* file = &state->file;
+	unsigned char success = allocate ? fat_fallocate(file, size) : fat_ftruncate(file, size);
+
+	// running out of clusters is the only way the FAT library can fail here
+	return success ? 0 : -LINUX_ENOSPC;
 }
 
 /* public */
 
-void fatfs_load(FilesystemDriver* driver) {
-	memcpy(driver->identifier, "FatFS", 5);
+void fatfs_floppy_read(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	floppy_read(data_out, offset_in, size_in);
+}
+
+void fatfs_floppy_write(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	floppy_write(data_in, offset_in, size_in, true);
+}
+
+void fatfs_ata_read(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	ata_read(data_out, offset_in, size_in);
+}
+
+void fatfs_ata_write(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	ata_write(data_in, offset_in, size_in);
+}
+
+void fatfs_virtio_read(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	virtio_blk_read(data_out, offset_in, size_in);
+}
+
+void fatfs_virtio_write(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	virtio_blk_write(data_in, offset_in, size_in);
+}
+
+bool fatfs_virtio_flush(void* user_args) {
+	return virtio_blk_flush();
+}
+
+void fatfs_ramdisk_read(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	ramdisk_read(data_out, offset_in, size_in);
+}
+
+void fatfs_ramdisk_write(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args) {
+	ramdisk_write(data_in, offset_in, size_in);
+}
+
+bool fatfs_ramdisk_flush(void* user_args) {
+	return ramdisk_flush();
+}
+
+int fatfs_load(FilesystemDriver* driver, fat_disk_access_func_t read_func, fat_disk_access_func_t write_func, fatfs_flush_func_t flush_func, void* user_args) {
+	fatfs_volume* volume = kmalloc(sizeof(fatfs_volume));
+	volume->flush = flush_func;
+
+	if (!fat_init(&volume->disk, read_func, write_func, user_args)) {
+		kfree(volume);
+		FATFS_DEBUG_LOG("fatfs: load fail\n");
+		return -LINUX_EIO;
+	}
+
+	if (volumes == NULL) {
+		timer_register(fatfs_writeback_tick, FATFS_WRITEBACK_TICKS);
+	}
+
+	volume->next = volumes;
+	volumes = volume;
+
+	memcpy(driver->identifier, "FatFS", 6);
+	driver->context = volume;
 
 	// export driver functions
 	driver->root = fatfs_root;
@@ -288,4 +436,9 @@ void fatfs_load(FilesystemDriver* driver) {
 	driver->remove = fatfs_remove;
 	driver->stat = fatfs_stat;
 	driver->readlink = fatfs_readlink;
+	driver->lookup = fatfs_lookup;
+	driver->sync = fatfs_sync;
+	driver->resize = fatfs_resize;
+
+	return 0;
 }
@@ -1,3 +1,56 @@
 #include "vfs.h"
+#include "fat.h"
 
-void fatfs_load(FilesystemDriver* driver);
+/**
+ * @brief Flushes the device write cache (or queue) of a volume, returns false if any of the writes failed.
+ */
+typedef bool (*fatfs_flush_func_t) (void* user_args);
+
+/**
+ * @brief Initialize the FAT volume accessed through the given functions and fill the driver
+ *        with it, the volume state is created once here and shared by all vRefs on the mount.
+ *        Every call creates a separate volume, so many volumes can be mounted at once.
+ *
+ * @param[out] driver The driver to fill, it has to outlive the mount.
+ * @param[in] read_func Function used to read from the underlying device.
+ * @param[in] write_func Function used to write to the underlying device.
+ * @param[in] flush_func Function that makes the written data durable after a sync, NULL if the device needs none.
+ * @param[in] user_args Passed to the access functions, to tell the devices apart.
+ *
+ * @return Returns 0 on success and a negated ERRNO code on error
+ *         LINUX_EIO     - The device does not hold a valid FAT32 volume
+ */
+int fatfs_load(FilesystemDriver* driver, fat_disk_access_func_t read_func, fat_disk_access_func_t write_func, fatfs_flush_func_t flush_func, void* user_args);
+
+/**
+ * @brief Writes the dirty blocks of all mounted volumes back if the periodic write-back timer
+ *        has expired since the last call, otherwise does nothing. Has to be called outside of
+ *        interrupt handlers with interrupts disabled, the idle loop of the kernel calls it on every turn.
+ */
+void fatfs_writeback();
+
+/**
+ * @brief Access functions for a volume on the floppy disk, floppy_init() has to be called first.
+ */
+void fatfs_floppy_read(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args);
+void fatfs_floppy_write(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args);
+
+/**
+ * @brief Access functions for a volume on the ATA hard disk, ata_init() has to be called first.
+ */
+void fatfs_ata_read(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args);
+void fatfs_ata_write(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args);
+
+/**
+ * @brief Access functions for a volume on the virtio-blk disk, virtio_blk_init() has to be called first.
+ */
+void fatfs_virtio_read(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args);
+void fatfs_virtio_write(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args);
+bool fatfs_virtio_flush(void* user_args);
+
+/**
+ * @brief Access functions for a volume on the RAM disk, ramdisk_init() has to be called first.
+ */
+void fatfs_ramdisk_read(unsigned char* data_out, unsigned int offset_in, unsigned int size_in, void* user_args);
+void fatfs_ramdisk_write(unsigned char* data_in, unsigned int offset_in, unsigned int size_in, void* user_args);
+bool fatfs_ramdisk_flush(void* user_args);
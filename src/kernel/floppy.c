@@ -1,6 +1,13 @@
 #include "floppy.h"
+#include "config.h"
+#include "dma.h"
 #include "io.h"
+#include "interrupt.h"
+#include "kmalloc.h"
+#include "memory.h"
 #include "print.h"
+#include "routine.h"
+#include "timer.h"
 #include "types.h"
 
 //#define FLOPPY_DEBUG_ON
@@ -12,6 +19,20 @@
 #endif
 
 #define FLOPPY_144_SECTORS_PER_TRACK 18
+#define FLOPPY_SECTOR_SIZE 512
+#define FLOPPY_TRACK_SIZE (FLOPPY_144_SECTORS_PER_TRACK * FLOPPY_SECTOR_SIZE)
+#define FLOPPY_NO_TRACK 0xFFFFFFFF
+#define FLOPPY_NO_CYLINDER 0xFF
+
+// the motor needs about half a second to reach its speed, the idle check runs a few times a second
+#define FLOPPY_MOTOR_SPINUP_TICKS (TIMER_FREQUENCY / 2)
+#define FLOPPY_MOTOR_CHECK_TICKS (TIMER_FREQUENCY / 4)
+
+// the floppy controller is wired to the ISA DMA channel 2 and raises IRQ6
+#define FLOPPY_DMA_CHANNEL 2
+#define FLOPPY_INTERRUPT 0x26
+// enough for a whole cylinder (both heads), the most a single multitrack command can transfer
+#define FLOPPY_DMA_BUFFER_SIZE (2 * FLOPPY_TRACK_SIZE)
 
 enum FloppyRegisters
 {
@@ -92,8 +113,36 @@ enum FloppyOptionBits
     SK_BIT = 0x20,      // Skip deleted sectors
 };
 
+typedef struct {
+    uint32_t track;     // cylinder * 2 + head, FLOPPY_NO_TRACK if the slot is empty
+    uint32_t last_use;  // value of the track clock on last access, used to pick the slot to reuse
+    uint8_t* data;
+} FloppyTrack;
+
 /* private */
 
+// all transfers go through this buffer, the caller's memory might not be reachable by the DMA controller
+static uint8_t* dma_buffer = NULL;
+
+// recently read tracks, reads are served from here and writes update the cached copy
+static FloppyTrack track_cache[FLOPPY_TRACK_CACHE];
+static uint32_t track_clock = 0;
+
+// state of the command that is waiting for its IRQ, the handler stores the result bytes (or
+// the status and cylinder from SENSE INTERRUPT for commands without a result phase) in `result`
+static volatile bool irq_expected = false;
+static volatile bool irq_done = false;
+static bool irq_sense = false;
+static uint8_t result[7];
+
+// cylinder each drive's heads are on, FLOPPY_NO_CYLINDER when unknown (before calibration or after an error)
+static uint8_t drive_cylinder[4] = {FLOPPY_NO_CYLINDER, FLOPPY_NO_CYLINDER, FLOPPY_NO_CYLINDER, FLOPPY_NO_CYLINDER};
+
+// the motor is left spinning between requests and turned off by floppy_motor_idle()
+static volatile bool motor_on = false;
+static volatile uint32_t motor_last_use = 0;
+static volatile bool never = false; // never set, waiting on it just sleeps
+
 static bool floppy_wait_msr(uint32_t timeout, uint8_t mask, uint8_t value){
     uint8_t msr = 0;
 	for(uint32_t i = 0; i < timeout; i++){
@@ -110,10 +159,6 @@ static bool floppy_wait_msr(uint32_t timeout, uint8_t mask, uint8_t value){
     return false;
 }
 
-static bool floppy_wait_ready(uint32_t timeout){
-    return floppy_wait_msr(timeout, RQM, RQM);
-}
-
 static bool floppy_wait_ready_send(uint32_t timeout){
     return floppy_wait_msr(timeout, RQM | DIO, RQM);
 }
@@ -127,6 +172,90 @@ static void floppy_send_command(uint8_t command){
     outb(DATA_FIFO, command);
 }
 
+static uint8_t floppy_receive(){
+    if(!floppy_wait_msr(0xffff, RQM | DIO, RQM | DIO)){
+        floppy_debug_msg("Error: Floppy has no result byte to send\n");
+    }
+
+    return inb(DATA_FIFO);
+}
+
+// Reads the result of the command that just ended, commands without a result phase are acknowledged with SENSE INTERRUPT
+static void floppy_collect(){
+    if (irq_sense){
+        floppy_send_command(SENSE_INTERRUPT);
+        result[0] = floppy_receive(); // status
+        result[1] = floppy_receive(); // cylinder
+        return;
+    }
+
+    for (int i = 0; i < 7; i++){
+        result[i] = floppy_receive();
+    }
+}
+
+static void floppy_irq(int number, int error, int* eax, int ecx, int edx, int ebx, int esi, int edi){
+    // nobody waits for this one, it was caused by a reset
+    if (!irq_expected){
+        return;
+    }
+
+    irq_expected = false;
+    floppy_collect();
+    irq_done = true;
+}
+
+// Must be called before the command is issued, as the IRQ can arrive as soon as the last command byte is sent
+static void floppy_expect(bool sense){
+    irq_sense = sense;
+    irq_done = false;
+    irq_expected = true;
+}
+
+// Waits for the end of the command issued after floppy_expect() and collects its result
+static bool floppy_finish(){
+    if (!int_wait_flag(&irq_done, FLOPPY_TIMEOUT_TICKS)){
+        irq_expected = false;
+        floppy_debug_msg("Error: Floppy IRQ timeout\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Sleeps for the given number of timer ticks
+static void floppy_sleep(uint32_t ticks){
+    int_wait_flag(&never, ticks);
+}
+
+// Turns the motor on if it is not already spinning, must be called before every command that accesses the disk
+static void floppy_motor_start(){
+    motor_last_use = timer_ticks();
+
+    if (motor_on){
+        return;
+    }
+
+    outb(DIGITAL_OUTPUT_REGISTER, RESET | IRQ | DRIVE1_MOTOR | DRIVE1);
+    motor_on = true;
+
+    floppy_debug_msg("Floppy motor on\n");
+    floppy_sleep(FLOPPY_MOTOR_SPINUP_TICKS);
+}
+
+// Timer callback, turns off the motor after FLOPPY_MOTOR_IDLE_TICKS without a request
+static void floppy_motor_idle(){
+    if (!motor_on || timer_ticks() - motor_last_use < FLOPPY_MOTOR_IDLE_TICKS){
+        return;
+    }
+
+    // the heads stay where they are, so the known cylinder remains valid
+    outb(DIGITAL_OUTPUT_REGISTER, RESET | IRQ | DRIVE1);
+    motor_on = false;
+
+    floppy_debug_msg("Floppy motor off\n");
+}
+
 static uint8_t get_version(){
     floppy_send_command(VERSION);
 
@@ -140,127 +269,73 @@ static uint8_t get_version(){
 }
 
 static bool floppy_calibrate(uint8_t drive){
+    floppy_expect(true);
     floppy_send_command(RECALIBRATE);
     floppy_send_command(drive);
 
-    if(!floppy_wait_ready(0xffffff)){
+    if(!floppy_finish()){
         floppy_debug_msg("Error: Floppy not ready after recalibrate\n");
         return false;
     }
 
-    floppy_send_command(SENSE_INTERRUPT);
-    uint8_t status = inb(DATA_FIFO);
+    uint8_t status = result[0];
     floppy_debug_msg("Calibrate status: 0x%x\n", status);
-    uint8_t cylinder = inb(DATA_FIFO);
+    uint8_t cylinder = result[1];
     floppy_debug_msg("Calibrate cylinder: %d\n", cylinder);
 
     if(cylinder != 0 || status != (0x20 | drive)){
         floppy_debug_msg("Error: Floppy calibration failed\n");
+        drive_cylinder[drive] = FLOPPY_NO_CYLINDER;
         return false;
     }
 
+    drive_cylinder[drive] = 0;
     return true;
 }
 
 static bool floppy_seek(uint8_t head, uint8_t cylinder){
+    floppy_motor_start();
+
+    // both heads move together, there is nothing to do if the drive is already on that cylinder
+    if (drive_cylinder[DRIVE1] == cylinder){
+        return true;
+    }
+
     for (int i = 0; i < 10; i++){
+        floppy_expect(true);
         floppy_send_command(SEEK);
         floppy_send_command(head << 2 | DRIVE1);
         floppy_send_command(cylinder);
 
-        if(!floppy_wait_ready(0xffffff)){
+        if(!floppy_finish()){
             floppy_debug_msg("Error: Floppy not ready after seek\n");
             return false;
         }
 
-        floppy_send_command(SENSE_INTERRUPT);
-        uint8_t status = inb(DATA_FIFO);
+        uint8_t status = result[0];
         floppy_debug_msg("Seek status: 0x%x\n", status);
-        uint8_t cylinder_result = inb(DATA_FIFO);
+        uint8_t cylinder_result = result[1];
         floppy_debug_msg("Seek cylinder: %d\n", cylinder);
 
         if(cylinder == cylinder_result){
+            drive_cylinder[DRIVE1] = cylinder;
             return true;
         }
     }
 
     floppy_debug_msg("Error: Floppy seek failed\n");
+    drive_cylinder[DRIVE1] = FLOPPY_NO_CYLINDER;
     return false;
 }
 
-static bool floppy_read_sector(uint8_t head, uint8_t cylinder, uint8_t sector, uint8_t* buffer){
-    if(!floppy_seek(head, cylinder)){
-        return false;
-    }
-
-    // issue read command
-    floppy_send_command(READ_DATA | MFM_BIT | SK_BIT); // MT_BIT
-    floppy_send_command(head << 2 | DRIVE1);
-    floppy_send_command(cylinder);
-    floppy_send_command(head);
-    floppy_send_command(sector); // first sector
-    floppy_send_command(2); // sector size = 512 bytes
-    floppy_send_command(sector); // last sector
-    floppy_send_command(0x1b); // gap length
-    floppy_send_command(0xff); // data length
-
-    if(!floppy_wait_ready(0xffffff)){
-        floppy_debug_msg("Error: Floppy not ready after read command\n");
-        return false;
-    }
-
-    // read incoming data
-    uint32_t i = 0;
-    while (true){
-        if (!floppy_wait_msr(0x1, RQM | DIO | NDMA, RQM | NDMA | DIO) || i > 512){
-            break;
-        }
-        uint8_t data = inb(DATA_FIFO);
-        buffer[i] = data;
-        if (i < 32) {
-            floppy_debug_msg("%x ", data);
-            if (i % 16 == 15){
-                floppy_debug_msg("\n");
-            }
-        }
-        i++;
-    }
-
-    floppy_debug_msg("Read %d bytes\n", i);
-    if (i != 512){
-        floppy_debug_msg("Error: Floppy read failed\n");
-        return false;
-    }
-
-    if (!floppy_wait_ready(0xffffff)){
-        floppy_debug_msg("Error: Floppy not ready after read\n");
-        return false;
-    }
-
-    // read command result
-    uint8_t st0 = inb(DATA_FIFO);
-    uint8_t st1 = inb(DATA_FIFO);
-    uint8_t st2 = inb(DATA_FIFO);
-    uint8_t result_cylinder = inb(DATA_FIFO);
-    uint8_t result_head = inb(DATA_FIFO);
-    uint8_t result_sector = inb(DATA_FIFO);
-    uint8_t result_2 = inb(DATA_FIFO);
-    floppy_debug_msg("R ST0: 0x%x, ST1: 0x%x, ST2: 0x%x, Cylinder: %d, Head: %d, Sector: %d, 2: %d\n", st0, st1, st2, result_cylinder, result_head, result_sector, result_2);
-
-    if ((st0 & 0xC0) || result_cylinder != cylinder || result_head != head || result_sector != sector || result_2 != 2){
-        floppy_debug_msg("Error: Floppy read failed\n");
-        return false;
-    }
-
-    return true;
-}
-
 static bool floppy_reset(){
     /*========= reset ==========*/
     // disable controller
     outb(DIGITAL_OUTPUT_REGISTER, 0x00);
-    // enable controller, select drive 1
-    outb(DIGITAL_OUTPUT_REGISTER, RESET | DRIVE1_MOTOR | DRIVE1);
+    // enable controller with DMA, select drive 1
+    outb(DIGITAL_OUTPUT_REGISTER, RESET | IRQ | DRIVE1_MOTOR | DRIVE1);
+    motor_on = true;
+    motor_last_use = timer_ticks();
 
     // sense interrupt 4 times
     for(uint8_t i = 0; i < 4; i++){
@@ -274,7 +349,7 @@ static bool floppy_reset(){
     /*======== specify drive parameters ========*/
     floppy_send_command(SPECIFY);
     floppy_send_command(0xdf);
-    floppy_send_command(0x03); // non-DMA mode
+    floppy_send_command(0x02); // DMA mode
 
     // recalibrate drive
     if(!floppy_calibrate(DRIVE1)){
@@ -284,87 +359,165 @@ static bool floppy_reset(){
     return true;
 }
 
-static bool floppy_write_sector(uint8_t head, uint8_t cylinder, uint8_t sector, uint8_t* buffer){
-    if (!floppy_seek(head, cylinder)){
+static void lba_to_chs(uint32_t lba, uint8_t* cylinder, uint8_t* head, uint8_t* sector){
+    *cylinder = lba / (2 * FLOPPY_144_SECTORS_PER_TRACK);
+    *head = ((lba % (2 * FLOPPY_144_SECTORS_PER_TRACK)) / FLOPPY_144_SECTORS_PER_TRACK);
+    *sector = ((lba % (2 * FLOPPY_144_SECTORS_PER_TRACK)) % FLOPPY_144_SECTORS_PER_TRACK + 1);
+}
+
+// Moves `count` consecutive sectors starting at `lba` between the disk and the DMA buffer with a single command.
+// The sectors have to be on one cylinder, a range that continues from head 0 onto head 1 uses a multitrack command
+static bool floppy_transfer(bool write, uint32_t lba, uint32_t count){
+    uint8_t head, cylinder, sector;
+    lba_to_chs(lba, &cylinder, &head, &sector);
+
+    // with MT the controller continues on head 1 after the end of the track on head 0,
+    // the transfer then ends when the DMA count runs out
+    bool multitrack = sector + count - 1 > FLOPPY_144_SECTORS_PER_TRACK;
+    uint8_t last_sector = multitrack ? FLOPPY_144_SECTORS_PER_TRACK : sector + count - 1;
+
+    if(!floppy_seek(head, cylinder)){
         return false;
     }
 
-    // issue write command
-    floppy_send_command(WRITE_DATA | MFM_BIT | SK_BIT); // MT_BIT
+    // the DMA controller moves the data while the command executes
+    dma_start(FLOPPY_DMA_CHANNEL, dma_buffer, count * FLOPPY_SECTOR_SIZE, write ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
+
+    // issue read or write command, skipping deleted sectors is only valid when reading
+    floppy_expect(false);
+    floppy_send_command((write ? (WRITE_DATA | MFM_BIT) : (READ_DATA | MFM_BIT | SK_BIT)) | (multitrack ? MT_BIT : 0));
     floppy_send_command(head << 2 | DRIVE1);
     floppy_send_command(cylinder);
     floppy_send_command(head);
     floppy_send_command(sector); // first sector
     floppy_send_command(2); // sector size = 512 bytes
-    floppy_send_command(sector); // last sector
+    floppy_send_command(last_sector); // last sector
     floppy_send_command(0x1b); // gap length
     floppy_send_command(0xff); // data length
 
-    if (!floppy_wait_ready(0xffffff)){
-        floppy_debug_msg("Error: Floppy not ready after write command\n");
+    // the controller raises the IRQ after the last sector was transferred, in the meantime the processor is halted
+    if(!floppy_finish()){
+        floppy_debug_msg("Error: Floppy not ready after transfer\n");
+        drive_cylinder[DRIVE1] = FLOPPY_NO_CYLINDER;
+        return false;
+    }
+
+    // command result, the reported position is the one after the last transferred sector
+    uint8_t st0 = result[0];
+    uint8_t st1 = result[1];
+    uint8_t st2 = result[2];
+    uint8_t result_2 = result[6];
+    floppy_debug_msg("%c ST0: 0x%x, ST1: 0x%x, ST2: 0x%x, Cylinder: %d, Head: %d, Sector: %d, 2: %d\n", write ? 'W' : 'R', st0, st1, st2, result[3], result[4], result[5], result_2);
+
+    if ((st0 & 0xC0) || result_2 != 2){
+        floppy_debug_msg("Error: Floppy transfer failed\n");
+
+        // the heads might not be where we think they are, seek again before the next attempt
+        drive_cylinder[DRIVE1] = FLOPPY_NO_CYLINDER;
         return false;
     }
 
-    // write data
-    uint32_t i = 0;
-    while (true){
-        if (!floppy_wait_msr(0x1, RQM | DIO | NDMA, RQM | NDMA) || i > 512){
-            break;
+    return true;
+}
+
+static FloppyTrack* floppy_track_find(uint32_t track){
+    for (int i = 0; i < FLOPPY_TRACK_CACHE; i++){
+        if (track_cache[i].track == track){
+            track_cache[i].last_use = ++track_clock;
+            return &track_cache[i];
         }
-        outb(DATA_FIFO, buffer[i]);
-        i++;
     }
 
-    floppy_debug_msg("Wrote %d bytes\n", i);
-    if (i != 512){
-        floppy_debug_msg("Error: Floppy write failed\n");
-        return false;
+    return NULL;
+}
+
+// Takes the least recently used slot of the track cache for the given track
+static FloppyTrack* floppy_track_claim(uint32_t track){
+    FloppyTrack* entry = &track_cache[0];
+
+    for (int i = 1; i < FLOPPY_TRACK_CACHE; i++){
+        if (track_cache[i].last_use < entry->last_use){
+            entry = &track_cache[i];
+        }
+    }
+
+    entry->track = track;
+    entry->last_use = ++track_clock;
+    return entry;
+}
+
+// Returns the cached copy of the track, reading it from the disk if needed. If `both` is set and the track is
+// on head 0, the track on the other side of the cylinder is read by the same (multitrack) command if it's missing too
+static FloppyTrack* floppy_track_load(uint32_t track, bool both){
+    FloppyTrack* entry = floppy_track_find(track);
+
+    if (entry != NULL){
+        return entry;
+    }
+
+    uint32_t count = (both && track % 2 == 0 && floppy_track_find(track + 1) == NULL) ? 2 : 1;
+
+    if (!floppy_transfer(false, track * FLOPPY_144_SECTORS_PER_TRACK, count * FLOPPY_144_SECTORS_PER_TRACK)){
+        return NULL;
     }
 
-    // for some reason, the msr is not ready after writing no matter how long you wait
-    // so we just wait shorter than usual, because it's not going to work anyway
-    // I literally issue the read command in the same way and it works, but the write command doesn't
-    if (!floppy_wait_ready(0xff)){
-        floppy_debug_msg("Error: Floppy not ready after write\n");
-        // absolutely unacceptable, but I ran out of ideas, TODO: fix this
-        floppy_reset();  
-        return true; // <-- it should be false
-    }
-
-    // read command result
-    uint8_t st0 = inb(DATA_FIFO);
-    uint8_t st1 = inb(DATA_FIFO);
-    uint8_t st2 = inb(DATA_FIFO);
-    uint8_t result_cylinder = inb(DATA_FIFO);
-    uint8_t result_head = inb(DATA_FIFO);
-    uint8_t result_sector = inb(DATA_FIFO);
-    uint8_t result_2 = inb(DATA_FIFO);
-    floppy_debug_msg("W ST0: 0x%x, ST1: 0x%x, ST2: 0x%x, Cylinder: %d, Head: %d, Sector: %d, 2: %d\n", st0, st1, st2, result_cylinder, result_head, result_sector, result_2);
-
-    if ((st0 & 0xC0) || result_cylinder != cylinder || result_head != head || result_sector != sector || result_2 != 2){
-        floppy_debug_msg("Error: Floppy write failed\n");
+    // the cache holds at least two tracks, so claiming the second slot doesn't take the first one back
+    entry = floppy_track_claim(track);
+    memcpy(entry->data, dma_buffer, FLOPPY_TRACK_SIZE);
+
+    if (count == 2){
+        memcpy(floppy_track_claim(track + 1)->data, dma_buffer + FLOPPY_TRACK_SIZE, FLOPPY_TRACK_SIZE);
+    }
+
+    return entry;
+}
+
+// Writes `count` whole sectors starting at `lba`, the sectors have to be on one cylinder
+static bool floppy_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer){
+    memcpy(dma_buffer, buffer, count * FLOPPY_SECTOR_SIZE);
+
+    if (!floppy_transfer(true, lba, count)){
         return false;
     }
 
+    // keep the cached copies of the written tracks up to date
+    while (count > 0){
+        uint32_t sector = lba % FLOPPY_144_SECTORS_PER_TRACK;
+        uint32_t length = FLOPPY_144_SECTORS_PER_TRACK - sector;
+
+        if (length > count){
+            length = count;
+        }
+
+        FloppyTrack* entry = floppy_track_find(lba / FLOPPY_144_SECTORS_PER_TRACK);
+
+        if (entry != NULL){
+            memcpy(entry->data + sector * FLOPPY_SECTOR_SIZE, buffer, length * FLOPPY_SECTOR_SIZE);
+        }
+
+        buffer += length * FLOPPY_SECTOR_SIZE;
+        lba += length;
+        count -= length;
+    }
+
     return true;
 }
 
-static void lba_to_chs(uint32_t lba, uint8_t* cylinder, uint8_t* head, uint8_t* sector){
-    *cylinder = lba / (2 * FLOPPY_144_SECTORS_PER_TRACK);
-    *head = ((lba % (2 * FLOPPY_144_SECTORS_PER_TRACK)) / FLOPPY_144_SECTORS_PER_TRACK);
-    *sector = ((lba % (2 * FLOPPY_144_SECTORS_PER_TRACK)) % FLOPPY_144_SECTORS_PER_TRACK + 1);
-}
+// Writes the part of a single sector between `offset` and `offset + size`, the rest of the sector
+// is read first if `preserve` is set, otherwise it's zeroed
+static bool floppy_write_partial(uint32_t lba, uint32_t offset, uint32_t size, const uint8_t* buffer, bool preserve){
+    uint8_t sector[FLOPPY_SECTOR_SIZE];
 
-static bool floppy_read_lba(uint32_t lba, uint8_t* buffer){
-    uint8_t head, cylinder, sector;
-    lba_to_chs(lba, &cylinder, &head, &sector);
-    return floppy_read_sector(head, cylinder, sector, buffer);
-}
+    if (preserve){
+        if (!floppy_read(sector, lba * FLOPPY_SECTOR_SIZE, FLOPPY_SECTOR_SIZE)){
+            return false;
+        }
+    } else {
+        memset(sector, 0, FLOPPY_SECTOR_SIZE);
+    }
 
-static bool floppy_write_lba(uint32_t lba, uint8_t* buffer){
-    uint8_t head, cylinder, sector;
-    lba_to_chs(lba, &cylinder, &head, &sector);
-    return floppy_write_sector(head, cylinder, sector, buffer);
+    memcpy(sector + offset, buffer, size);
+    return floppy_write_sectors(lba, 1, sector);
 }
 
 /* public */
@@ -380,10 +533,11 @@ bool floppy_init(){
     }
 
     /*======== configure procedure ========*/
-    // configure drive polling mode on, FIFO off, threshold = 1, implied seek on, precompensation 0
+    // configure drive polling mode on, FIFO on, threshold = 8, implied seek on, precompensation 0
+    // the FIFO gives the DMA controller some slack before the data overruns
     floppy_send_command(CONFIGURE);
     floppy_send_command(0x00);
-    floppy_send_command(IMPLIED_SEEK_ENABLED | FIFO_DISABLED | ((1 - 1) & THRESHOLD_MASK));
+    floppy_send_command(IMPLIED_SEEK_ENABLED | ((8 - 1) & THRESHOLD_MASK));
     floppy_send_command(0x00);
 
     /*======== lock configuration ========*/
@@ -396,11 +550,39 @@ bool floppy_init(){
         return false;
     }
 
+    /*======== DMA buffer ========*/
+    dma_buffer = dma_alloc(FLOPPY_DMA_BUFFER_SIZE);
+
+    if (dma_buffer == NULL){
+        floppy_debug_msg("Error: Floppy DMA buffer allocation failed\n");
+        return false;
+    }
+
+    /*======== track cache ========*/
+    uint8_t* track_data = kmalloc(FLOPPY_TRACK_CACHE * FLOPPY_TRACK_SIZE);
+
+    if (track_data == NULL){
+        floppy_debug_msg("Error: Floppy track cache allocation failed\n");
+        return false;
+    }
+
+    for (int i = 0; i < FLOPPY_TRACK_CACHE; i++){
+        track_cache[i].track = FLOPPY_NO_TRACK;
+        track_cache[i].last_use = 0;
+        track_cache[i].data = track_data + i * FLOPPY_TRACK_SIZE;
+    }
+
+    // take over IRQ6, commands from now on wait for it instead of spinning on the status register
+    isr_register(FLOPPY_INTERRUPT, floppy_irq);
+
     if(!floppy_reset()){
         floppy_debug_msg("Error: Floppy reset failed\n");
         return false;
     }
 
+    // the reset left the motor on, it will be turned off once the drive is idle
+    timer_register(floppy_motor_idle, FLOPPY_MOTOR_CHECK_TICKS);
+
     floppy_debug_msg("Floppy initialized successfully\n");
     return true;
 }
@@ -408,29 +590,28 @@ bool floppy_init(){
 bool floppy_read(void* buffer, uint32_t address, uint32_t size){
     floppy_debug_msg("Reading %d bytes from address 0x%x\n", size, address);
 
-    uint8_t tmp_buffer[512];
+    uint32_t end = address + size;
+    uint8_t* output = buffer;
 
-    uint32_t start_lba = address / 512;
-    uint32_t end_lba = (address + size) / 512;
-    uint32_t output_buffer_index = 0;
+    while (address < end){
+        uint32_t track = address / FLOPPY_TRACK_SIZE;
+        uint32_t offset = address % FLOPPY_TRACK_SIZE;
+        uint32_t length = FLOPPY_TRACK_SIZE - offset;
 
-    for (uint32_t lba = start_lba; lba <= end_lba; lba++){
-        if (!floppy_read_lba(lba, tmp_buffer)){
-            return false;
+        if (length > end - address){
+            length = end - address;
         }
 
-        uint32_t start = 0;
-        uint32_t end = 512;
-        if (lba == start_lba){
-            start = address % 512;
-        }
-        if (lba == end_lba){
-            end = (address + size) % 512;
-        }
+        // if the read continues on the next track, fetch the whole cylinder at once
+        FloppyTrack* entry = floppy_track_load(track, address + length < end);
 
-        for (uint32_t i = start; i < end; i++){
-            ((uint8_t*)buffer)[output_buffer_index++] = tmp_buffer[i];
+        if (entry == NULL){
+            return false;
         }
+
+        memcpy(output, entry->data + offset, length);
+        output += length;
+        address += length;
     }
 
     return true;
@@ -439,33 +620,47 @@ bool floppy_read(void* buffer, uint32_t address, uint32_t size){
 bool floppy_write(void* buffer, uint32_t address, uint32_t size, bool preserve){
     floppy_debug_msg("Writing %d bytes to address 0x%x\n", size, address);
 
-    uint8_t tmp_buffer[512];
+    const uint8_t* input = buffer;
+    uint32_t end = address + size;
+
+    // only the sectors that are partially covered need to be merged with what is on the disk
+    uint32_t head = address % FLOPPY_SECTOR_SIZE;
 
-    uint32_t start_lba = address / 512;
-    uint32_t end_lba = (address + size) / 512;
-    uint32_t input_buffer_index = 0;
+    if (head != 0 && address < end){
+        uint32_t length = FLOPPY_SECTOR_SIZE - head;
 
-    for (uint32_t lba = start_lba; lba <= end_lba; lba++){
-        if (preserve){
-            if (!floppy_read_lba(lba, tmp_buffer)){
-                return false;
-            }
+        if (length > end - address){
+            length = end - address;
         }
 
-        uint32_t start = 0;
-        uint32_t end = 512;
-        if (lba == start_lba){
-            start = address % 512;
+        if (!floppy_write_partial(address / FLOPPY_SECTOR_SIZE, head, length, input, preserve)){
+            return false;
         }
-        if (lba == end_lba){
-            end = (address + size) % 512;
+
+        input += length;
+        address += length;
+    }
+
+    // whole sectors are written directly, one command per cylinder
+    while (end - address >= FLOPPY_SECTOR_SIZE){
+        uint32_t lba = address / FLOPPY_SECTOR_SIZE;
+        uint32_t count = (end - address) / FLOPPY_SECTOR_SIZE;
+        uint32_t left = 2 * FLOPPY_144_SECTORS_PER_TRACK - lba % (2 * FLOPPY_144_SECTORS_PER_TRACK);
+
+        if (count > left){
+            count = left;
         }
 
-        for (uint32_t i = start; i < end; i++){
-            tmp_buffer[i] = ((uint8_t*)buffer)[input_buffer_index++];
+        if (!floppy_write_sectors(lba, count, input)){
+            return false;
         }
 
-        if (!floppy_write_lba(lba, tmp_buffer)){
+        input += count * FLOPPY_SECTOR_SIZE;
+        address += count * FLOPPY_SECTOR_SIZE;
+    }
+
+    if (address < end){
+        if (!floppy_write_partial(address / FLOPPY_SECTOR_SIZE, 0, end - address, input, preserve)){
             return false;
         }
     }
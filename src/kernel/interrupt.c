@@ -7,6 +7,7 @@
 #include "util.h"
 #include "pic.h"
 #include "syscall.h"
+#include "timer.h"
 
 static void context_switch(int number, int error, int* eax, int ecx, int edx, int ebx, int esi, int edi);
 
@@ -15,6 +16,7 @@ static void context_switch(int number, int error, int* eax, int ecx, int edx, in
 // Used by the wait subsystem
 static int key;
 static int locked;
+static volatile bool waiting;
 
 // You can use this handle to debug the incoming interrupts
 static void int_debug_handle(int number, int error, int* eax, int ecx, int edx, int ebx, int esi, int edi) {
@@ -29,8 +31,12 @@ static void int_debug_handle(int number, int error, int* eax, int ecx, int edx,
 // Forward syscalls to the syscall system
 static void int_linux_handle(int number, int error, int* eax, int ecx, int edx, int ebx, int esi, int edi) {
 
+	// the sixth argument is passed in ebp, it is not given to the handlers but isr_tail saved it
+	// with 'pusha', five slots below eax
+	int ebp = eax[-5];
+
 	// write the return value, this change be visible after 'iret' ('int 0x80' in the calling code)
-	*eax = sys_linux(*eax, ebx, ecx, edx, esi, edi);
+	*eax = sys_linux(*eax, ebx, ecx, edx, esi, edi, ebp);
 
 }
 
@@ -61,11 +67,39 @@ void int_wait() {
 	}
 }
 
+bool int_wait_flag(volatile bool* flag, uint32_t timeout) {
+	uint32_t flags;
+	__asm volatile ("pushf; pop %0; cli" : "=r" (flags));
+
+	uint32_t start = timer_ticks();
+	waiting = true;
+
+	// the flag is checked with interrupts disabled, and as 'sti' only takes effect after the
+	// following instruction an interrupt that sets it can't slip in between the check and 'hlt'
+	while (!*flag && timer_ticks() - start < timeout) {
+		__asm volatile ("sti; hlt; cli");
+	}
+
+	waiting = false;
+
+	// restore the interrupt flag of the caller
+	if (flags & 0x200) {
+		__asm volatile ("sti");
+	}
+
+	return *flag;
+}
+
+bool int_waiting() {
+	return waiting;
+}
+
 void int_init() {
 
 	// init the wait subsystem
 	locked = false;
 	key = 0xFF;
+	waiting = false;
 
 	// Fill the IDT will valid gate descriptors
 	isr_init(MEMORY_MAP_IDT);
@@ -77,7 +111,7 @@ void int_init() {
 
 	isr_register(0x80, int_linux_handle); // forward syscalls to the syscall system
 	isr_register(0x20, context_switch);   // stop the timer spam, route timer interrupts to the scheduler
-	isr_register(0x26, NULL);             // stop the floppy spam
+	isr_register(0x26, NULL);             // stop the floppy spam, until the floppy driver takes over IRQ6
 
 	// Point the processor at the IDT and enable interrupts
 	idtr_store(MEMORY_MAP_IDT, 0x81);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "types.h"
+
 /**
  * @brief Initializes the interrupt system and handlers.
  *        This call enables system interrupts.
@@ -25,3 +27,24 @@ void int_lock(int interrupt);
  * @return None.
  */
 void int_wait();
+
+/**
+ * @brief Halts the processor until an interrupt handler sets the given flag or the timeout passes,
+ *        interrupts are enabled for the duration of the wait. The kernel code that waits is not reentrant,
+ *        so timer interrupts that arrive meanwhile only advance the clock, they neither switch processes nor run timer callbacks.
+ *
+ * @note Must not be called from an IRQ handler, the PIC holds back IRQs of lower priority until the current one is handled.
+ *
+ * @param[in] flag The flag to wait for.
+ * @param[in] timeout Maximum number of timer ticks to wait.
+ *
+ * @return true if the flag was set, false if the wait timed out.
+ */
+bool int_wait_flag(volatile bool* flag, uint32_t timeout);
+
+/**
+ * @brief Checks if the kernel is currently waiting inside int_wait_flag().
+ *
+ * @return true during int_wait_flag(), false otherwise.
+ */
+bool int_waiting();
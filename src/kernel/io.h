@@ -20,3 +20,41 @@ void outb(uint16_t port, uint8_t data);
  * @return The byte read from the port.
  */
 uint8_t inb(uint16_t port);
+
+/**
+ * @brief Writes a word (16 bits) to a port.
+ * 
+ * @param port The port to write to.
+ * @param data The word to write.
+ * 
+ * @return None.
+ */
+void outw(uint16_t port, uint16_t data);
+
+/**
+ * @brief Reads a word (16 bits) from a port.
+ * 
+ * @param port The port to read from.
+ * 
+ * @return The word read from the port.
+ */
+uint16_t inw(uint16_t port);
+
+/**
+ * @brief Writes a double word (32 bits) to a port.
+ * 
+ * @param port The port to write to.
+ * @param data The double word to write.
+ * 
+ * @return None.
+ */
+void outl(uint16_t port, uint32_t data);
+
+/**
+ * @brief Reads a double word (32 bits) from a port.
+ * 
+ * @param port The port to read from.
+ * 
+ * @return The double word read from the port.
+ */
+uint32_t inl(uint16_t port);
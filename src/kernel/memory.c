@@ -80,6 +80,20 @@ int streq(const char* lcstr, const char* rcstr) {
 	return true;
 }
 
+int strneq(const char* str, int length, const char* cstr) {
+
+	for (int i = 0; i < length; i ++) {
+
+		// also stops if cstr is shorter than the slice
+		if ((cstr[i] == 0) || (str[i] != cstr[i])) {
+			return false;
+		}
+
+	}
+
+	return cstr[length] == 0;
+}
+
 int strcpy(char* buffer, const char* cstr) {
 	int length = strlen(cstr);
 	memcpy(buffer, cstr, length);
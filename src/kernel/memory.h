@@ -70,6 +70,18 @@ int wstrlen(const short* wstr);
  */
 int streq(const char* lcstr, const char* rcstr);
 
+/**
+ * @brief Check if a length-delimited string is equal to a null-terminated string,
+ *        the comparison never reads more than `length` characters from `str`.
+ *
+ * @param[in] str    Pointer to the string, it does not need to be null-terminated.
+ * @param[in] length Number of characters in `str`.
+ * @param[in] cstr   Pointer to the null-terminated c-string.
+ *
+ * @return Returns 1 if the strings are equal, 0 otherwise.
+ */
+int strneq(const char* str, int length, const char* cstr);
+
 /**
  * @brief Copies `bytes` bytes from `cstr` to `buffer`. The memory blocks must not overlap,
  *        if they do, consider using `memmove()` with strlen().
@@ -0,0 +1,116 @@
+#include "pci.h"
+#include "io.h"
+
+// configuration mechanism #1, the address of a register is written to the first port and the register is accessed through the second
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+#define PCI_ENABLE         0x80000000
+
+// offsets of the registers in the configuration space header
+#define PCI_ID             0x00
+#define PCI_COMMAND        0x04
+#define PCI_CLASS          0x08
+#define PCI_HEADER         0x0C
+#define PCI_BAR0           0x10
+#define PCI_INTERRUPT      0x3C
+
+#define PCI_HEADER_MULTI   0x80
+#define PCI_BAR_IO         0x01
+
+/* private */
+
+static uint32_t pci_config_read(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+	outl(PCI_CONFIG_ADDRESS, PCI_ENABLE | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC));
+	return inl(PCI_CONFIG_DATA);
+}
+
+// Fills the descriptor with the identity of the function, returns false if there is no such function
+static bool pci_probe(PciDevice* out, uint8_t bus, uint8_t device, uint8_t function) {
+	uint32_t id = pci_config_read(bus, device, function, PCI_ID);
+
+	if ((id & 0xFFFF) == 0xFFFF) {
+		return false;
+	}
+
+	uint32_t class = pci_config_read(bus, device, function, PCI_CLASS);
+
+	out->bus = bus;
+	out->device = device;
+	out->function = function;
+	out->vendor_id = id & 0xFFFF;
+	out->device_id = id >> 16;
+	out->class = class >> 24;
+	out->subclass = (class >> 16) & 0xFF;
+	out->interface = (class >> 8) & 0xFF;
+	out->irq = pci_config_read(bus, device, function, PCI_INTERRUPT) & 0xFF;
+
+	return true;
+}
+
+// Calls the matcher for every function present in the system, stops at the first match
+static bool pci_scan(PciDevice* out, bool (*matches) (PciDevice*, uint32_t, uint32_t), uint32_t first, uint32_t second) {
+	for (int bus = 0; bus < 256; bus ++) {
+		for (int device = 0; device < 32; device ++) {
+
+			if (!pci_probe(out, bus, device, 0)) {
+				continue;
+			}
+
+			// only multi-function devices have anything beyond function 0
+			int functions = (pci_config_read(bus, device, 0, PCI_HEADER) >> 16) & PCI_HEADER_MULTI ? 8 : 1;
+
+			for (int function = 0; function < functions; function ++) {
+				if (pci_probe(out, bus, device, function) && matches(out, first, second)) {
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+static bool pci_match_class(PciDevice* device, uint32_t class, uint32_t subclass) {
+	return device->class == class && device->subclass == subclass;
+}
+
+static bool pci_match_id(PciDevice* device, uint32_t vendor_id, uint32_t device_id) {
+	return device->vendor_id == vendor_id && device->device_id == device_id;
+}
+
+/* public */
+
+uint32_t pci_read(PciDevice* device, uint8_t offset) {
+	return pci_config_read(device->bus, device->device, device->function, offset);
+}
+
+void pci_write(PciDevice* device, uint8_t offset, uint32_t value) {
+	outl(PCI_CONFIG_ADDRESS, PCI_ENABLE | (device->bus << 16) | (device->device << 11) | (device->function << 8) | (offset & 0xFC));
+	outl(PCI_CONFIG_DATA, value);
+}
+
+bool pci_find_class(PciDevice* device, uint8_t class, uint8_t subclass) {
+	return pci_scan(device, pci_match_class, class, subclass);
+}
+
+bool pci_find_id(PciDevice* device, uint16_t vendor_id, uint16_t device_id) {
+	return pci_scan(device, pci_match_id, vendor_id, device_id);
+}
+
+uint32_t pci_bar(PciDevice* device, int index) {
+	uint32_t bar = pci_read(device, PCI_BAR0 + index * 4);
+
+	if (bar & PCI_BAR_IO) {
+		return bar & ~0x3;
+	}
+
+	return bar & ~0xF;
+}
+
+void pci_enable(PciDevice* device, uint16_t bits) {
+	uint32_t command = pci_read(device, PCI_COMMAND);
+
+	// the upper half is the status register, its bits are cleared by writing ones so keep it zero
+	pci_write(device, PCI_COMMAND, (command & 0xFFFF) | bits);
+}
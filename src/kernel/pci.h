@@ -0,0 +1,90 @@
+#pragma once
+
+#include "types.h"
+
+/**
+ * @brief Location and identity of a PCI function, as found by pci_find_class() or pci_find_id().
+ */
+typedef struct {
+	uint8_t bus;
+	uint8_t device;
+	uint8_t function;
+
+	uint16_t vendor_id;
+	uint16_t device_id;
+	uint8_t class;
+	uint8_t subclass;
+	uint8_t interface;
+	uint8_t irq;        // the interrupt line the firmware assigned to the function, 0xFF if none
+} PciDevice;
+
+// bits of the PCI command register
+#define PCI_COMMAND_IO     0x01
+#define PCI_COMMAND_MEMORY 0x02
+#define PCI_COMMAND_MASTER 0x04
+
+/**
+ * @brief Reads a 32 bit register from the configuration space of a PCI function.
+ *
+ * @param[in] device The function to read from.
+ * @param[in] offset Offset of the register, must be a multiple of 4.
+ *
+ * @return The value of the register.
+ */
+uint32_t pci_read(PciDevice* device, uint8_t offset);
+
+/**
+ * @brief Writes a 32 bit register in the configuration space of a PCI function.
+ *
+ * @param[in] device The function to write to.
+ * @param[in] offset Offset of the register, must be a multiple of 4.
+ * @param[in] value The value to write.
+ *
+ * @return None.
+ */
+void pci_write(PciDevice* device, uint8_t offset, uint32_t value);
+
+/**
+ * @brief Finds the first PCI function of the given class and subclass by probing
+ *        the configuration space of every bus, device and function.
+ *
+ * @param[out] device Filled with the function that was found.
+ * @param[in] class The base class code (for example 0x01 for mass storage controllers).
+ * @param[in] subclass The subclass code (for example 0x01 for IDE controllers).
+ *
+ * @return true if such a function was found, false otherwise.
+ */
+bool pci_find_class(PciDevice* device, uint8_t class, uint8_t subclass);
+
+/**
+ * @brief Finds the first PCI function with the given vendor and device ID.
+ *
+ * @param[out] device Filled with the function that was found.
+ * @param[in] vendor_id The vendor ID.
+ * @param[in] device_id The device ID.
+ *
+ * @return true if such a function was found, false otherwise.
+ */
+bool pci_find_id(PciDevice* device, uint16_t vendor_id, uint16_t device_id);
+
+/**
+ * @brief Returns the base address from one of the six BARs of a function,
+ *        with the flag bits masked out. I/O BARs give a port number.
+ *
+ * @param[in] device The function to query.
+ * @param[in] index Index of the BAR, 0 to 5.
+ *
+ * @return The base address, or 0 if the BAR is not implemented.
+ */
+uint32_t pci_bar(PciDevice* device, int index);
+
+/**
+ * @brief Sets the given bits in the command register of a function, used to
+ *        enable I/O decoding, memory decoding and bus mastering (see PCI_COMMAND_*).
+ *
+ * @param[in] device The function to modify.
+ * @param[in] bits The bits to set.
+ *
+ * @return None.
+ */
+void pci_enable(PciDevice* device, uint16_t bits);
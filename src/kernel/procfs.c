@@ -42,9 +42,9 @@ static void uint_to_str(unsigned int num, char *buffer, int buffer_size, int bas
 	buffer[j] = '\0';
 }
 
-static unsigned int str_to_uint(const char* str, int base) {
+static unsigned int str_to_uint(const char* str, int length, int base) {
 	unsigned int result = 0;
-	while (*str) {
+	while (length --) {
 		char c = *str;
 		int value;
 
@@ -78,6 +78,7 @@ typedef enum {
 	PROC_LEAF_EXE,  /* /$pid/exe */
 	PROC_LEAF_CWD,  /* /$pid/cwd */
 	PROC_LEAF_SELF, /* /self     */
+	PROC_LEAF_VFSSTAT, /* /vfsstat */
 } ProcNode;
 
 typedef struct {
@@ -109,6 +110,63 @@ static int proc_sread(void* output_buffer, int output_size, void* file_buffer, i
 	return bytes;
 }
 
+static const char* proc_operations[VFS_OP_COUNT] = {
+	"open", "read", "write", "seek", "list", "stat", "lookup"
+};
+
+static int proc_append(char* buffer, int offset, const char* string) {
+	int length = strlen(string);
+	memcpy(buffer + offset, string, length);
+	return offset + length;
+}
+
+static int proc_append_uint(char* buffer, int offset, uint32_t value) {
+	char tmp[16];
+	uint_to_str(value, tmp, 16, 10);
+
+	offset = proc_append(buffer, offset, " ");
+	return proc_append(buffer, offset, tmp);
+}
+
+// generates the content of /vfsstat, one line per mount and operation:
+// <mount path> <driver> <operation> <calls> <errors> <bytes> <microseconds>
+static int proc_vfsstat(char** output) {
+	int count = vfs_mounts(NULL, 0);
+	vNode** nodes = kmalloc(sizeof(vNode*) * count);
+	vfs_mounts(nodes, count);
+
+	// path + identifier + operation + 4 numbers per line
+	int line = FILE_MAX_NAME + 16 + 8 + 4 * 12;
+	char* buffer = kmalloc(count * VFS_OP_COUNT * line + 1);
+	int offset = 0;
+
+	for (int i = 0; i < count; i ++) {
+		vNode* node = nodes[i];
+
+		char path[FILE_MAX_NAME];
+		vfs_mountpath(node, path, FILE_MAX_NAME);
+
+		for (int op = 0; op < VFS_OP_COUNT; op ++) {
+			vCounter* counter = node->counters + op;
+
+			offset = proc_append(buffer, offset, path);
+			offset = proc_append(buffer, offset, " ");
+			offset = proc_append(buffer, offset, node->driver->identifier);
+			offset = proc_append(buffer, offset, " ");
+			offset = proc_append(buffer, offset, proc_operations[op]);
+			offset = proc_append_uint(buffer, offset, counter->calls);
+			offset = proc_append_uint(buffer, offset, counter->errors);
+			offset = proc_append_uint(buffer, offset, counter->bytes);
+			offset = proc_append_uint(buffer, offset, counter->micros);
+			offset = proc_append(buffer, offset, "\n");
+		}
+	}
+
+	kfree(nodes);
+	*output = buffer;
+	return offset;
+}
+
 /* exported */
 
 int procfs_root(vRef* dst) {
@@ -128,14 +186,20 @@ int procfs_clone(vRef* dst, vRef* src) {
 	return 0;
 }
 
-int procfs_open(vRef* vref, const char* basename, uint32_t flags) {
-	kprintf("procfs: open %s\n", basename);
+int procfs_open(vRef* vref, const char* name, int length, uint32_t flags) {
+	kprintf("procfs: open %d\n", length);
 	ProcState* state = vref->state;
 
 	// in the root only active PIDs and 'self' are valid
 	if (state->node == PROC_NODE_ROOT) {
 
-		if (streq(basename, "self")) {
+		if (strneq(name, length, "vfsstat")) {
+			state->offset = 0;
+			state->node = PROC_LEAF_VFSSTAT;
+			return 0;
+		}
+
+		if (strneq(name, length, "self")) {
 			state->pid = scheduler_get_current_pid();
 			state->offset = 0;
 
@@ -148,7 +212,7 @@ int procfs_open(vRef* vref, const char* basename, uint32_t flags) {
 			return 0;
 		}
 
-		int expected = str_to_uint(basename, 10);
+		int expected = str_to_uint(name, length, 10);
 		int pid = 0;
 
 		while (scheduler_process_list(&pid)) {
@@ -165,13 +229,13 @@ int procfs_open(vRef* vref, const char* basename, uint32_t flags) {
 
 	if (state->node == PROC_NODE_PROC) {
 
-		if (streq(basename, "..")) {
+		if (strneq(name, length, "..")) {
 			state->node = PROC_NODE_ROOT;
 			state->offset = 0;
 			return 0;
 		}
 
-		if (streq(basename, "fd")) {
+		if (strneq(name, length, "fd")) {
 			state->offset = 0;
 
 			if (flags & OPEN_NOFOLLOW) {
@@ -183,7 +247,7 @@ int procfs_open(vRef* vref, const char* basename, uint32_t flags) {
 			return 0;
 		}
 
-		if (streq(basename, "exe")) {
+		if (strneq(name, length, "exe")) {
 			state->offset = 0;
 
 			if (flags & OPEN_NOFOLLOW) {
@@ -196,7 +260,7 @@ int procfs_open(vRef* vref, const char* basename, uint32_t flags) {
 		}
 
 		// This is link and thus this is highly incorrect
-		if (streq(basename, "cwd")) {
+		if (strneq(name, length, "cwd")) {
 			state->offset = 0;
 			state->node = PROC_LEAF_CWD;
 			return 0;
@@ -207,7 +271,7 @@ int procfs_open(vRef* vref, const char* basename, uint32_t flags) {
 
 	if (state->node == PROC_NODE_FD) {
 
-		if (streq(basename, "..")) {
+		if (strneq(name, length, "..")) {
 			state->offset = 0;
 			state->node = PROC_NODE_PROC;
 			return 0;
@@ -249,16 +313,29 @@ int procfs_read(vRef* vref, void* buffer, uint32_t size) {
 		return proc_sread(buffer, size, tmp, 16, vref);
 	}
 
+	if (state->node == PROC_LEAF_VFSSTAT) {
+		char* text;
+		int length = proc_vfsstat(&text);
+		int bytes = proc_sread(buffer, size, text, length, vref);
+		kfree(text);
+		return bytes;
+	}
+
 	return -LINUX_EINVAL;
 }
 
 int procfs_write(vRef* vref, void* buffer, uint32_t size) {
 	kprintf("procfs: write %d\n", size);
+	ProcState* state = vref->state;
 
 	// ignore arguments
-	(void) vref;
 	(void) buffer;
-	(void) size;
+
+	// writing anything to vfsstat clears the counters
+	if (state->node == PROC_LEAF_VFSSTAT) {
+		vfs_reset_counters();
+		return size;
+	}
 
 	return -LINUX_EROFS; // never allow writing to ProcFS
 }
@@ -285,8 +362,8 @@ int procfs_list(vRef* vref, vEntry* buffer, int max) {
 	ProcState* state = vref->state;
 
 	if (state->node == PROC_NODE_ROOT) {
-		int size = 3; // ., .., self
-		int i = 3;
+		int size = 4; // ., .., self, vfsstat
+		int i = 4;
 
 		int pid = 0;
 		while (scheduler_process_list(&pid)) {
@@ -307,6 +384,10 @@ int procfs_list(vRef* vref, vEntry* buffer, int max) {
 		entries[2].type = DT_LNK;
 		entries[2].name_length = 5;
 
+		memcpy(entries[3].name, "vfsstat", 8);
+		entries[3].type = DT_REG;
+		entries[3].name_length = 7;
+
 		pid = 0;
 		while (scheduler_process_list(&pid)) {
 
@@ -423,6 +504,12 @@ int procfs_stat(vRef* vref, vStat* stat) {
 		return 0;
 	}
 
+	if (state->node == PROC_LEAF_VFSSTAT) {
+		stat->type = DT_REG;
+		stat->writtable = true;
+		return 0;
+	}
+
 	return -LINUX_EIO;
 }
 
@@ -456,42 +543,61 @@ int procfs_readlink(vRef* vref, const char* name, char* buffer, int size) {
 	return -LINUX_EINVAL;
 }
 
-int procfs_lookup(vRef* vref, char* name) {
+int procfs_lookup(vRef* vref, char* buffer, int size) {
 	kprintf("procfs: lookup\n");
 	ProcState* state = vref->state;
+	char name[16];
 
 	if (state->node == PROC_NODE_PROC) {
 		uint_to_str(state->pid, name, 16, 10);
-		return 0;
-	}
-
-	if (state->node == PROC_NODE_FD) {
+	} else if (state->node == PROC_NODE_FD) {
 		memcpy(name, "fd", 3);
-		return 0;
-	}
-
-	if (state->node == PROC_LEAF_CWD) {
+	} else if (state->node == PROC_LEAF_CWD) {
 		memcpy(name, "cwd", 4);
-		return 0;
-	}
-
-	if (state->node == PROC_LEAF_EXE) {
+	} else if (state->node == PROC_LEAF_EXE) {
 		memcpy(name, "exe", 4);
-		return 0;
+	} else if (state->node == PROC_LEAF_SELF) {
+		memcpy(name, "self", 5);
+	} else if (state->node == PROC_LEAF_VFSSTAT) {
+		memcpy(name, "vfsstat", 8);
+	} else {
+		return -1;
 	}
 
-	if (state->node == PROC_LEAF_SELF) {
-		memcpy(name, "self", 5);
-		return 0;
+	int length = strlen(name);
+
+	if (length >= size) {
+		return -1;
 	}
 
-	return -1;
+	memcpy(buffer, name, length + 1);
+	return length;
+}
+
+int procfs_sync(vRef* vref) {
+	kprintf("procfs: sync\n");
+
+	// there is nothing to flush, all nodes are generated on the fly
+	(void) vref;
+
+	return 0;
+}
+
+int procfs_resize(vRef* vref, uint32_t size, bool allocate) {
+	kprintf("procfs: resize %d\n", size);
+
+	// ignore arguments
+	(void) vref;
+	(void) allocate;
+
+	return -LINUX_EINVAL; // all nodes are generated on the fly, they have no size to change
 }
 
 /* public */
 
 void procfs_load(FilesystemDriver* driver) {
 	memcpy(driver->identifier, "ProcFS", 7);
+	driver->context = NULL;
 
 	// export driver functions
 	driver->root = procfs_root;
@@ -507,4 +613,6 @@ void procfs_load(FilesystemDriver* driver) {
 	driver->stat = procfs_stat;
 	driver->readlink = procfs_readlink;
 	driver->lookup = procfs_lookup;
+	driver->sync = procfs_sync;
+	driver->resize = procfs_resize;
 }
@@ -0,0 +1,93 @@
+#include "ramdisk.h"
+#include "config.h"
+#include "floppy.h"
+#include "kmalloc.h"
+#include "memory.h"
+
+// modifications are tracked per floppy track, which the floppy driver writes with a single command
+#define RAMDISK_BLOCK_SIZE (18 * 512)
+#define RAMDISK_BLOCKS ((RAMDISK_SIZE + RAMDISK_BLOCK_SIZE - 1) / RAMDISK_BLOCK_SIZE)
+
+/* private */
+
+static uint8_t* memory = NULL;
+static bool dirty[RAMDISK_BLOCKS];
+
+static bool ramdisk_range(uint32_t address, uint32_t size) {
+	return memory != NULL && address <= RAMDISK_SIZE && size <= RAMDISK_SIZE - address;
+}
+
+/* public */
+
+bool ramdisk_init() {
+	memory = kmalloc(RAMDISK_SIZE);
+
+	if (memory == NULL) {
+		return false;
+	}
+
+	memset(dirty, 0, sizeof(dirty));
+
+	// one long read, the floppy driver fetches whole cylinders at a time
+	if (!floppy_read(memory, 0, RAMDISK_SIZE)) {
+		kfree(memory);
+		memory = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+bool ramdisk_read(void* buffer, uint32_t address, uint32_t size) {
+	if (!ramdisk_range(address, size)) {
+		return false;
+	}
+
+	memcpy(buffer, memory + address, size);
+	return true;
+}
+
+bool ramdisk_write(void* buffer, uint32_t address, uint32_t size) {
+	if (!ramdisk_range(address, size)) {
+		return false;
+	}
+
+	memcpy(memory + address, buffer, size);
+
+	for (uint32_t block = address / RAMDISK_BLOCK_SIZE; block * RAMDISK_BLOCK_SIZE < address + size; block ++) {
+		dirty[block] = true;
+	}
+
+	return true;
+}
+
+bool ramdisk_flush() {
+	bool success = true;
+
+	for (uint32_t block = 0; block < RAMDISK_BLOCKS; block ++) {
+		if (!dirty[block]) {
+			continue;
+		}
+
+		// merge the following modified blocks into one write
+		uint32_t end = block + 1;
+
+		while (end < RAMDISK_BLOCKS && dirty[end]) {
+			end ++;
+		}
+
+		uint32_t address = block * RAMDISK_BLOCK_SIZE;
+		uint32_t size = (end * RAMDISK_BLOCK_SIZE < RAMDISK_SIZE ? end * RAMDISK_BLOCK_SIZE : RAMDISK_SIZE) - address;
+
+		// the blocks stay dirty if the write fails, the next flush will retry them
+		if (floppy_write(memory + address, address, size, false)) {
+			memset(dirty + block, 0, end - block);
+		} else {
+			success = false;
+		}
+
+		block = end;
+	}
+
+	return success;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+/**
+ * @brief Creates the RAM disk as a copy of the first RAMDISK_SIZE bytes of the floppy,
+ *        floppy_init() has to be called first. After this the floppy is only written by ramdisk_flush().
+ *
+ * @return true if the memory was allocated and the image was read, false otherwise.
+ */
+bool ramdisk_init();
+
+/**
+ * @brief Reads data from the RAM disk.
+ *
+ * @param buffer The buffer to read the data into.
+ * @param address The byte address to read from.
+ * @param size The size of the data to read.
+ *
+ * @return true if the range lies within the disk, false otherwise.
+ */
+bool ramdisk_read(void* buffer, uint32_t address, uint32_t size);
+
+/**
+ * @brief Writes data to the RAM disk, the modified blocks are remembered for ramdisk_flush().
+ *
+ * @param buffer The buffer to write the data from.
+ * @param address The byte address to write to.
+ * @param size The size of the data to write.
+ *
+ * @return true if the range lies within the disk, false otherwise.
+ */
+bool ramdisk_write(void* buffer, uint32_t address, uint32_t size);
+
+/**
+ * @brief Copies the blocks modified since the last flush back to the floppy.
+ *
+ * @return true if all the blocks were written, false otherwise.
+ */
+bool ramdisk_flush();
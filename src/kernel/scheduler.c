@@ -7,6 +7,7 @@
 #include "rivendell.h"
 #include "tables.h"
 #include "gdt.h"
+#include "interrupt.h"
 
 
 ProcessDescriptor* general_process_table;
@@ -15,6 +16,9 @@ int process_table_size = INITIAL_PROCESS_TABLE_SIZE;
 
 int process_running;
 
+// the context of the kernel itself, process_running is -1 while it runs
+void* kernel_stack;
+
 int processes_existing;
 
 bool scheduler_pid_invalid(int pid)
@@ -199,7 +203,8 @@ int scheduler_create_process(int parent_pid, vRef* processFile)
 
 int scheduler_context_switch(void* old_stack)
 {
-	if(process_count==0)
+	// don't switch away from the kernel while it waits for a device, it is not reentrant
+	if(process_count==0 || int_waiting())
 	{
 		return (int) old_stack;
 	}
@@ -209,16 +214,26 @@ int scheduler_context_switch(void* old_stack)
 //	kprintf(" * from: %d\n", process_running);
 //	kprintf(" * old_stack: %d\n", old_stack);
 
-	general_process_table[process_running].stack = old_stack;
-	process_running++;
+	if(process_running==(-1))
+	{
+		kernel_stack = old_stack;
+	}
+	else
+	{
+		general_process_table[process_running].stack = old_stack;
+	}
 
-	while(general_process_table[process_running].exists==false)
+	do
 	{
 		process_running++;
 	}
+	while(process_running<process_count && general_process_table[process_running].exists==false);
+
+	// the kernel takes its turn after the last process, its idle loop makes the periodic write-back
 	if(process_running>=process_count)
 	{
-		process_running=0;
+		process_running=(-1);
+		return (int) kernel_stack;
 	}
 
 //	kprintf(" * to: %d\n", process_running);
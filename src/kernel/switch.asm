@@ -4,12 +4,16 @@ bits 32
 section .text
 
 extern scheduler_context_switch
+extern timer_tick
 extern isr_into_stack
 extern dump
 
 global context_switch
 
 context_switch:
+	; Advance the system clock before picking the next process
+	call timer_tick
+
 	mov EAX, ESP
 	add EAX, 4
 	push EAX
@@ -5,6 +5,7 @@
 #include "errno.h"
 #include "scheduler.h"
 #include "memory.h"
+#include "kmalloc.h"
 
 /* private */
 
@@ -16,14 +17,15 @@ typedef int (*syscall_fn2) (int, int);
 typedef int (*syscall_fn3) (int, int, int);
 typedef int (*syscall_fn4) (int, int, int, int);
 typedef int (*syscall_fn5) (int, int, int, int, int);
-typedef int (*syscall_adapt) (struct SyscallEntry_tag* entry, int, int, int, int, int);
+typedef int (*syscall_fn6) (int, int, int, int, int, int);
+typedef int (*syscall_adapt) (struct SyscallEntry_tag* entry, int, int, int, int, int, int);
 
 typedef struct SyscallEntry_tag {
 	syscall_adapt adapter;
 	void* handler;
 } SyscallEntry;
 
-static int syscall_adapter_fn0(struct SyscallEntry_tag* entry, int, int, int, int, int) {
+static int syscall_adapter_fn0(struct SyscallEntry_tag* entry, int, int, int, int, int, int) {
 	if (entry->handler) {
 		return ((syscall_fn0) entry->handler) ();
 	}
@@ -32,7 +34,7 @@ static int syscall_adapter_fn0(struct SyscallEntry_tag* entry, int, int, int, in
 	return -1;
 }
 
-static int syscall_adapter_fn1(struct SyscallEntry_tag* entry, int ebx, int, int, int, int) {
+static int syscall_adapter_fn1(struct SyscallEntry_tag* entry, int ebx, int, int, int, int, int) {
 	if (entry->handler) {
 		return ((syscall_fn1) entry->handler) (ebx);
 	}
@@ -41,7 +43,7 @@ static int syscall_adapter_fn1(struct SyscallEntry_tag* entry, int ebx, int, int
 	return -1;
 }
 
-static int syscall_adapter_fn2(struct SyscallEntry_tag* entry, int ebx, int ecx, int, int, int) {
+static int syscall_adapter_fn2(struct SyscallEntry_tag* entry, int ebx, int ecx, int, int, int, int) {
 	if (entry->handler) {
 		return ((syscall_fn2) entry->handler) (ebx, ecx);
 	}
@@ -50,7 +52,7 @@ static int syscall_adapter_fn2(struct SyscallEntry_tag* entry, int ebx, int ecx,
 	return -1;
 }
 
-static int syscall_adapter_fn3(struct SyscallEntry_tag* entry, int ebx, int ecx, int edx, int, int) {
+static int syscall_adapter_fn3(struct SyscallEntry_tag* entry, int ebx, int ecx, int edx, int, int, int) {
 	if (entry->handler) {
 		return ((syscall_fn3) entry->handler) (ebx, ecx, edx);
 	}
@@ -59,7 +61,7 @@ static int syscall_adapter_fn3(struct SyscallEntry_tag* entry, int ebx, int ecx,
 	return -1;
 }
 
-static int syscall_adapter_fn4(struct SyscallEntry_tag* entry, int ebx, int ecx, int edx, int esi, int) {
+static int syscall_adapter_fn4(struct SyscallEntry_tag* entry, int ebx, int ecx, int edx, int esi, int, int) {
 	if (entry->handler) {
 		return ((syscall_fn4) entry->handler) (ebx, ecx, edx, esi);
 	}
@@ -68,7 +70,7 @@ static int syscall_adapter_fn4(struct SyscallEntry_tag* entry, int ebx, int ecx,
 	return -1;
 }
 
-static int syscall_adapter_fn5(struct SyscallEntry_tag* entry, int ebx, int ecx, int edx, int esi, int edi) {
+static int syscall_adapter_fn5(struct SyscallEntry_tag* entry, int ebx, int ecx, int edx, int esi, int edi, int) {
 	if (entry->handler) {
 		return ((syscall_fn5) entry->handler) (ebx, ecx, edx, esi, edi);
 	}
@@ -77,6 +79,15 @@ static int syscall_adapter_fn5(struct SyscallEntry_tag* entry, int ebx, int ecx,
 	return -1;
 }
 
+static int syscall_adapter_fn6(struct SyscallEntry_tag* entry, int ebx, int ecx, int edx, int esi, int edi, int ebp) {
+	if (entry->handler) {
+		return ((syscall_fn6) entry->handler) (ebx, ecx, edx, esi, edi, ebp);
+	}
+
+	panic("Unimplemented Linux syscall invoked!");
+	return -1;
+}
+
 /* syscall ustils */
 
 static vRef* fd_resolve(int fd) {
@@ -428,34 +439,47 @@ static int sys_lseek(unsigned int fd, int offset, unsigned int whence) {
 	return vfs_seek(vref, offset, whence);
 }
 
-static int sys_mkdir(const char* pathname, int mode) {
-
-	vRef cwd = fd_cwd();
-	(void) mode;
-
-	return vfs_mkdir(&cwd, pathname);
+static int sys_sync() {
+	vfs_sync_all(NULL);
+	return 0;
 }
 
-static int sys_mkdirat(int fd, const char* pathname, int mode) {
+static int sys_fsync(unsigned int fd) {
 
-	vRef* parent = fd_resolve(fd);
-	if (!parent) {
+	vRef* vref = fd_resolve(fd);
+
+	if (!vref) {
 		return -LINUX_EBADF;
 	}
 
-	(void) mode;
+	return vfs_sync(vref);
+}
 
-	return vfs_mkdir(parent, pathname);
+static int sys_fdatasync(unsigned int fd) {
+
+	// no driver keeps metadata that is not needed to read the data back
+	return sys_fsync(fd);
 }
 
-static int sys_readlink(const char* path, char* buf, int size) {
+static int truncate(const char* pathname, uint32_t length) {
 
 	vRef cwd = fd_cwd();
+	vRef vref;
+	int res = 0;
 
-	return vfs_readlink(&cwd, path, buf, size);
+	if (res = vfs_open(&vref, &cwd, pathname, OPEN_WRONLY)) {
+		return res;
+	}
+
+	if (res = vfs_resize(&vref, length, false)) {
+		vfs_close(&vref);
+		return res;
+	}
+
+	return vfs_close(&vref);
 }
 
-static int sys_getdents(unsigned int fd, struct linux_dirent* buffer, unsigned int size) {
+static int ftruncate(unsigned int fd, uint32_t length) {
 
 	vRef* vref = fd_resolve(fd);
 
@@ -463,120 +487,162 @@ static int sys_getdents(unsigned int fd, struct linux_dirent* buffer, unsigned i
 		return -LINUX_EBADF;
 	}
 
-	int bytes = 0;
+	return vfs_resize(vref, length, false);
+}
 
-	while (true) {
+static int sys_truncate(const char* pathname, long length) {
 
-		vEntry entry;
-		int count = vfs_list(vref, &entry, 1);
+	if (length < 0) {
+		return -LINUX_EINVAL;
+	}
 
-		// nothing left to list
-		if (count == 0) {
-			return bytes;
-		}
+	return truncate(pathname, length);
+}
 
-		// check for error
-		if (count < 0) {
-			return count;
-		}
+static int sys_ftruncate(unsigned int fd, long length) {
 
-		int esz = sizeof(struct linux_dirent) + entry.name_length + 2;
-		int left = size - bytes;
+	if (length < 0) {
+		return -LINUX_EINVAL;
+	}
 
-		// check if we run out of space in output buffer
-		if (left < esz) {
+	return ftruncate(fd, length);
+}
 
-			// undo last list call
-			vfs_seek(vref, entry.seek_offset, SEEK_SET);
+// the 64 bit length is split into two registers on i386, files can't be larger than 4 GiB anyway
+static int sys_truncate64(const char* pathname, uint32_t length_low, uint32_t length_high) {
 
-			// if we loaded nothing and still run out of space the buffer was too small
-			if (bytes == 0) {
-				return -LINUX_EINVAL;
-			}
+	if (length_high != 0) {
+		return (length_high & 0x80000000) ? -LINUX_EINVAL : -LINUX_EFBIG;
+	}
 
-			// ... otehrwise return the number of bytes written
-			return bytes;
-		}
+	return truncate(pathname, length_low);
+}
 
-		// next entry pointer
-		struct linux_dirent* dirent = ((void*) buffer) + bytes;
+static int sys_ftruncate64(unsigned int fd, uint32_t length_low, uint32_t length_high) {
 
-		dirent->d_ino = 0; // inode
-		dirent->d_off = entry.seek_offset;
-		dirent->d_reclen = sizeof(struct linux_dirent) + entry.name_length + 2;
+	if (length_high != 0) {
+		return (length_high & 0x80000000) ? -LINUX_EINVAL : -LINUX_EFBIG;
+	}
 
-		memcpy(dirent->d_name, entry.name, entry.name_length);
+	return ftruncate(fd, length_low);
+}
+
+static int sys_fallocate(int fd, int mode, uint32_t offset_low, uint32_t offset_high, uint32_t length_low, uint32_t length_high) {
+
+	vRef* vref = fd_resolve(fd);
 
-		// extension
-		dirent->d_name[entry.name_length + 1] = 0;          // one byte after name (pad)
-		dirent->d_name[entry.name_length + 2] = entry.type; // two bytes after name (d_type)
+	if (!vref) {
+		return -LINUX_EBADF;
+	}
 
-		// now move forward in output buffer
-		bytes += dirent->d_reclen;
+	// FALLOC_FL_KEEP_SIZE, hole punching and the rest can't be represented on our filesystems
+	if (mode != 0) {
+		return -LINUX_EOPNOTSUPP;
 	}
 
+	if ((length_low == 0 && length_high == 0) || (offset_high & 0x80000000) || (length_high & 0x80000000)) {
+		return -LINUX_EINVAL;
+	}
+
+	if (offset_high != 0 || length_high != 0 || offset_low + length_low < offset_low) {
+		return -LINUX_EFBIG;
+	}
+
+	return vfs_resize(vref, offset_low + length_low, true);
 }
 
-static int sys_getdents64(unsigned int fd, struct linux_dirent64* buffer, unsigned int size) {
+static int sys_mkdir(const char* pathname, int mode) {
 
-	vRef* vref = fd_resolve(fd);
+	vRef cwd = fd_cwd();
+	(void) mode;
 
-	if (!vref) {
+	return vfs_mkdir(&cwd, pathname);
+}
+
+static int sys_mkdirat(int fd, const char* pathname, int mode) {
+
+	vRef* parent = fd_resolve(fd);
+	if (!parent) {
 		return -LINUX_EBADF;
 	}
 
-	int bytes = 0;
+	(void) mode;
 
-	while (true) {
+	return vfs_mkdir(parent, pathname);
+}
 
-		vEntry entry;
-		int count = vfs_list(vref, &entry, 1);
+static int sys_readlink(const char* path, char* buf, int size) {
 
-		// nothing left to list
-		if (count == 0) {
-			return bytes;
-		}
+	vRef cwd = fd_cwd();
 
-		// check for error
-		if (count < 0) {
-			return count;
-		}
+	return vfs_readlink(&cwd, path, buf, size);
+}
 
-		int esz = sizeof(struct linux_dirent64) + entry.name_length;
-		int left = size - bytes;
+static int vent_to_linux(struct linux_dirent* dirent, vEntry* entry, int left) {
 
-		// check if we run out of space in output buffer
-		if (left < esz) {
+	// name, null-byte and the trailing d_type, padded so that the next record stays aligned
+	int esz = (offsetof(struct linux_dirent, d_name) + entry->name_length + 2 + 3) & ~3;
 
-			// undo last list call
-			vfs_seek(vref, entry.seek_offset, SEEK_SET);
+	if (left < esz) {
+		return 0;
+	}
 
-			// if we loaded nothing and still run out of space the buffer was too small
-			if (bytes == 0) {
-				return -LINUX_EINVAL;
-			}
+	dirent->d_ino = 0; // inode
+	dirent->d_off = entry->seek_offset;
+	dirent->d_reclen = esz;
 
-			// ... otehrwise return the number of bytes written
-			return bytes;
-		}
+	memcpy(dirent->d_name, entry->name, entry->name_length);
+	dirent->d_name[entry->name_length] = 0;
 
-		// next entry pointer
-		struct linux_dirent64* dirent = ((void*) buffer) + bytes;
+	// extension, d_type is always the last byte of the record
+	((char*) dirent)[esz - 1] = entry->type;
 
-		dirent->d_ino = 0; // inode
-		dirent->d_off = entry.seek_offset;
-		dirent->d_reclen = sizeof(struct linux_dirent) + entry.name_length;
-		dirent->d_type = entry.type;
+	return esz;
+}
+
+static int vent_to_linux64(struct linux_dirent64* dirent, vEntry* entry, int left) {
 
-		memcpy(dirent->d_name, entry.name, entry.name_length);
+	int esz = (offsetof(struct linux_dirent64, d_name) + entry->name_length + 1 + 7) & ~7;
 
-		// now move forward in output buffer
-		bytes += dirent->d_reclen;
+	if (left < esz) {
+		return 0;
 	}
 
+	dirent->d_ino = 0; // inode
+	dirent->d_off = entry->seek_offset;
+	dirent->d_reclen = esz;
+	dirent->d_type = entry->type;
+
+	memcpy(dirent->d_name, entry->name, entry->name_length);
+	dirent->d_name[entry->name_length] = 0;
+
+	return esz;
 }
 
-static int sys_old_readdir(unsigned int fd, struct old_linux_dirent* buffer, unsigned int size) {
+static int vent_to_linux_old(struct old_linux_dirent* dirent, vEntry* entry, int left) {
+
+	int esz = sizeof(struct old_linux_dirent) + entry->name_length;
+
+	if (left < esz) {
+		return 0;
+	}
+
+	dirent->d_ino = 0; // inode
+	dirent->d_offset = entry->seek_offset;
+	dirent->d_namlen = entry->name_length;
+
+	memcpy(dirent->d_name, entry->name, entry->name_length);
+
+	return esz;
+}
+
+/**
+ * Converts a vEntry into a syscall-specific directory record, returns the number
+ * of bytes written or 0 if the record does not fit in the remaining space
+ */
+typedef int (*vEntryMapper) (void* dst, vEntry* entry, int left);
+
+static int getdents(unsigned int fd, void* buffer, unsigned int size, vEntryMapper converter) {
 
 	vRef* vref = fd_resolve(fd);
 
@@ -584,55 +650,67 @@ static int sys_old_readdir(unsigned int fd, struct old_linux_dirent* buffer, uns
 		return -LINUX_EBADF;
 	}
 
+	// entries are fetched from the driver in batches, so that it can
+	// resume the scan from where it stopped instead of starting over for each entry
+	vEntry* entries = kmalloc(sizeof(vEntry) * VFS_LIST_BATCH);
 	int bytes = 0;
 
 	while (true) {
 
-		vEntry entry;
-		int count = vfs_list(vref, &entry, 1);
+		int count = vfs_list(vref, entries, VFS_LIST_BATCH);
 
 		// nothing left to list
 		if (count == 0) {
-			return bytes;
+			break;
 		}
 
-		// check for error
+		// check for error, report what was already written if anything
 		if (count < 0) {
-			return count;
+			kfree(entries);
+			return bytes ? bytes : count;
 		}
 
-		int esz = sizeof(struct old_linux_dirent) + entry.name_length;
-		int left = size - bytes;
+		for (int i = 0; i < count; i ++) {
+
+			int esz = converter(((void*) buffer) + bytes, entries + i, size - bytes);
 
-		// check if we run out of space in output buffer
-		if (left < esz) {
+			// check if we run out of space in output buffer
+			if (esz == 0) {
 
-			// undo last list call
-			vfs_seek(vref, entry.seek_offset, SEEK_SET);
+				// rewind to the first entry that was not returned
+				vfs_seek(vref, entries[i].seek_offset, SEEK_SET);
+				kfree(entries);
 
-			// if we loaded nothing and still run out of space the buffer was too small
-			if (bytes == 0) {
-				return -LINUX_EINVAL;
+				// if we loaded nothing and still run out of space the buffer was too small
+				if (bytes == 0) {
+					return -LINUX_EINVAL;
+				}
+
+				// ... otherwise return the number of bytes written
+				return bytes;
 			}
 
-			// ... otehrwise return the number of bytes written
-			return bytes;
+			// now move forward in output buffer
+			bytes += esz;
 		}
 
-		// next entry pointer
-		struct old_linux_dirent* dirent = ((void*) buffer) + bytes;
+	}
+
+	kfree(entries);
+	return bytes;
 
-		dirent->d_ino = 0; // inode
-		dirent->d_offset = entry.seek_offset;
-		dirent->d_namlen = entry.name_length;
+}
 
-		memcpy(dirent->d_name, entry.name, entry.name_length);
+static int sys_getdents(unsigned int fd, struct linux_dirent* buffer, unsigned int size) {
+	return getdents(fd, buffer, size, (vEntryMapper) vent_to_linux);
+}
 
-		// now move forward in output buffer
-		bytes += sizeof(struct old_linux_dirent);
-		bytes += entry.name_length;
-	}
+static int sys_getdents64(unsigned int fd, struct linux_dirent64* buffer, unsigned int size) {
+	return getdents(fd, buffer, size, (vEntryMapper) vent_to_linux64);
+}
 
+static int sys_old_readdir(unsigned int fd, struct old_linux_dirent* buffer, unsigned int size) {
+	return getdents(fd, buffer, size, (vEntryMapper) vent_to_linux_old);
 }
 
 static int sys_stat(const char* filename, struct __old_kernel_stat* statbuf) {
@@ -827,19 +905,19 @@ static int sys_brk(unsigned long brk)
     ProcessDescriptor process;
     int caller = scheduler_get_current_pid();
     scheduler_load_process_info(&process, caller);
-    int memory_address = process.process_memory;
-    int size = kmsz(memory_address);
+    int memory_address = (int) process.process_memory;
+    int size = kmsz((void*) memory_address);
     int end_address = memory_address + size - 1;
     if(end_address>=brk)
     {
         return end_address;
     }
-    int new_process_memory = krealloc(memory_address, size+(brk-end_address));
+    int new_process_memory = (int) krealloc((void*) memory_address, size+(brk-end_address));
     if(new_process_memory == 0)
     {
         panic("System out of memory - brk cannot be executed");
     }
-    int actualNewSize = kmsz(new_process_memory);
+    int actualNewSize = kmsz((void*) new_process_memory);
     gad(process.processSegmentsIndex, new_process_memory, actualNewSize);
     scheduler_move_process(caller, new_process_memory);
     return actualNewSize;
@@ -857,11 +935,11 @@ static int sys_exit(int error_code)
 
 /* public */
 
-int sys_linux(int eax, int ebx, int ecx, int edx, int esi, int edi) {
+int sys_linux(int eax, int ebx, int ecx, int edx, int esi, int edi, int ebp) {
 	if (eax >= SYS_LINUX_SIZE) {
 		panic("Invalid syscall number!");
 	}
     kprintf("Invoked: %d\n", eax);
 	SyscallEntry* entry = sys_linux_table + eax;
-	return entry->adapter(entry, ebx, ecx, edx, esi, edi);
+	return entry->adapter(entry, ebx, ecx, edx, esi, edi, ebp);
 }
@@ -8,4 +8,4 @@
  *
  * @return Returns syscall result that should be placed into EAX when returning from interrupt.
  */
-int sys_linux(int eax, int ebx, int ecx, int edx, int esi, int edi);
+int sys_linux(int eax, int ebx, int ecx, int edx, int esi, int edi, int ebp);
@@ -0,0 +1,110 @@
+#include "timer.h"
+#include "config.h"
+#include "io.h"
+#include "interrupt.h"
+
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+
+// channel 0, lobyte/hibyte access, mode 2 (rate generator), binary
+#define PIT_MODE_RATE  0x34
+#define PIT_MODE_LATCH 0x00
+
+/* private */
+
+typedef struct {
+	timer_callback callback;
+	uint32_t interval;
+	uint32_t next;
+} TimerEntry;
+
+static volatile uint32_t ticks = 0;
+static TimerEntry entries[TIMER_MAX_CALLBACKS];
+static int count = 0;
+
+static uint16_t timer_counter() {
+	outb(PIT_COMMAND, PIT_MODE_LATCH);
+
+	uint8_t low = inb(PIT_CHANNEL0);
+	uint8_t high = inb(PIT_CHANNEL0);
+
+	return (high << 8) | low;
+}
+
+/* public */
+
+void timer_init() {
+
+	// a reload value of 0 stands for 65536, this keeps the default ~18.2 Hz,
+	// but unlike the default square wave mode the counter goes down by one every clock
+	outb(PIT_COMMAND, PIT_MODE_RATE);
+	outb(PIT_CHANNEL0, 0);
+	outb(PIT_CHANNEL0, 0);
+
+}
+
+void timer_tick() {
+	ticks ++;
+
+	// the interrupted kernel code might be in the middle of what the callbacks do,
+	// they will be invoked on the first tick after the wait ends
+	if (int_waiting()) {
+		return;
+	}
+
+	for (int i = 0; i < count; i ++) {
+		TimerEntry* entry = entries + i;
+
+		// compare the difference so that this still works after the counter overflows
+		if ((int32_t) (ticks - entry->next) >= 0) {
+			entry->next = ticks + entry->interval;
+			entry->callback();
+		}
+	}
+}
+
+uint32_t timer_ticks() {
+	return ticks;
+}
+
+int timer_register(timer_callback callback, uint32_t interval) {
+	if (count >= TIMER_MAX_CALLBACKS) {
+		return 0;
+	}
+
+	TimerEntry* entry = entries + count;
+	entry->callback = callback;
+	entry->interval = interval;
+	entry->next = ticks + interval;
+
+	count ++;
+	return 1;
+}
+
+uint32_t timer_clock() {
+	uint32_t before;
+	uint16_t counter;
+
+	// retry if the timer interrupt arrived while the counter was being read
+	do {
+		before = ticks;
+		counter = timer_counter();
+	} while (before != ticks);
+
+	// the counter goes down from 65536, so this is the number of clocks into the current tick
+	uint16_t clocks = -counter;
+
+	return (before << 16) | clocks;
+}
+
+uint32_t timer_elapsed(uint32_t since) {
+	uint32_t clocks = timer_clock() - since;
+
+	// with interrupts disabled the counter can wrap before the tick is accounted for,
+	// in that case the timestamp appears to go back by one tick
+	if ((int32_t) clocks < 0) {
+		clocks += 65536;
+	}
+
+	return (clocks / TIMER_CLOCK_RATE) * 1000000 + ((clocks % TIMER_CLOCK_RATE) * 1000) / (TIMER_CLOCK_RATE / 1000);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "types.h"
+
+/**
+ * @brief Signature of a periodic timer callback, callbacks are
+ *        invoked from the timer interrupt with interrupts disabled.
+ *        While the kernel waits for a device (see int_wait_flag()) they are postponed.
+ */
+typedef void (*timer_callback) ();
+
+/**
+ * @brief Program the PIT channel 0 as a rate generator running at TIMER_FREQUENCY,
+ *        this makes the counter usable for sub-tick measurements (see timer_clock()).
+ *
+ * @return None.
+ */
+void timer_init();
+
+/**
+ * @brief Advance the tick counter and invoke all the callbacks that are due,
+ *        this is called from the timer interrupt handler (see switch.asm).
+ *
+ * @return None.
+ */
+void timer_tick();
+
+/**
+ * @brief Get the number of timer interrupts since the system started,
+ *        one tick is roughly 1/TIMER_FREQUENCY of a second.
+ *
+ * @return Number of elapsed ticks.
+ */
+uint32_t timer_ticks();
+
+/**
+ * @brief Register a function that will be called every `interval` ticks.
+ *
+ * @param[in] callback The function to invoke.
+ * @param[in] interval Number of ticks between invocations, must be greater than 0.
+ *
+ * @return 1 if the callback was registered, 0 if the callback table is full.
+ */
+int timer_register(timer_callback callback, uint32_t interval);
+
+/**
+ * @brief Get a high resolution timestamp, counted in PIT input clock
+ *        periods (TIMER_CLOCK_RATE per second). The value wraps around after about an hour.
+ *
+ * @return The current timestamp.
+ */
+uint32_t timer_clock();
+
+/**
+ * @brief Get the time elapsed since the given timestamp.
+ *
+ * @param[in] since Timestamp obtained earlier with timer_clock().
+ *
+ * @note While interrupts are disabled the tick counter does not advance, so
+ *       periods longer than one tick will be undercounted in that case.
+ *
+ * @return Number of microseconds that passed since the given timestamp.
+ */
+uint32_t timer_elapsed(uint32_t since);
@@ -30,6 +30,7 @@ _Static_assert ((sizeof (int64_t) == 8), "int64_t needs to be 8 bytes long!");
 // Helpers to control the binary interface
 #define ABI_PACKED __attribute__((packed, aligned(1)))
 #define ABI_CDECL __attribute__((__cdecl__))
+#define offsetof(type, member) __builtin_offsetof(type, member)
 
 
 // varargs
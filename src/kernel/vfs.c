@@ -4,6 +4,10 @@
 #include "print.h"
 #include "util.h"
 #include "errno.h"
+#include "timer.h"
+
+//#define VFS_DEBUG_LOG(...) kprintf(__VA_ARGS__);
+#define VFS_DEBUG_LOG(...)
 
 /**
  * Example directory structure:
@@ -67,14 +71,100 @@ static int vfs_update(vRef* vref) {
 
 }
 
-static vNode* vfs_mknode(vNode* parent, const char* name) {
+static uint32_t vfs_hash(const char* string, int length) {
+
+	// 32 bit FNV-1a
+	uint32_t hash = 2166136261;
+
+	for (int i = 0; i < length; i ++) {
+		hash ^= (uint8_t) string[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static void vfs_insert(vNode** table, int capacity, vNode* node) {
+	uint32_t mask = capacity - 1;
+	uint32_t slot = node->hash & mask;
+
+	// linear probing, the table is never full so this terminates
+	while (table[slot] != NULL) {
+		slot = (slot + 1) & mask;
+	}
+
+	table[slot] = node;
+}
+
+static void vfs_addchld(vNode* parent, vNode* node) {
+
+	// grow the table once it gets 3/4 full, this keeps the probe sequences short
+	if ((parent->count + 1) * 4 > parent->capacity * 3) {
+		int capacity = parent->capacity ? parent->capacity * 2 : VFS_CHILD_TABLE_SIZE;
+		vNode** table = kmalloc(sizeof(vNode*) * capacity);
+
+		for (int i = 0; i < capacity; i ++) {
+			table[i] = NULL;
+		}
+
+		for (int i = 0; i < parent->capacity; i ++) {
+			if (parent->children[i] != NULL) {
+				vfs_insert(table, capacity, parent->children[i]);
+			}
+		}
+
+		if (parent->children != NULL) {
+			kfree(parent->children);
+		}
+
+		parent->children = table;
+		parent->capacity = capacity;
+	}
+
+	vfs_insert(parent->children, parent->capacity, node);
+	parent->count ++;
+
+	// append to the sibling list so that the tree is printed in mount order
+	vNode** link = &parent->child;
+
+	while (*link != NULL) {
+		link = &(*link)->sibling;
+	}
+
+	*link = node;
+}
+
+static int vfs_account(vNode* node, vOperation operation, uint32_t start, int result, uint32_t bytes) {
+	vCounter* counter = node->counters + operation;
+
+	counter->calls ++;
+	counter->micros += timer_elapsed(start);
+
+	if (result < 0) {
+		counter->errors ++;
+	} else {
+		counter->bytes += bytes;
+	}
+
+	return result;
+}
+
+static vNode* vfs_mknode(vNode* parent, vName* name) {
 	vNode* node = kmalloc(sizeof(vNode));
+	memset(node->counters, 0, sizeof(node->counters));
 
 	node->sibling = NULL;
 	node->child = NULL;
 	node->parent = parent;
 	node->driver = NULL;
-	memcpy(node->name, name, FILE_MAX_NAME);
+	node->children = NULL;
+	node->capacity = 0;
+	node->count = 0;
+	node->hash = vfs_hash(name->string, name->length);
+	node->length = name->length;
+	node->name = kmalloc(name->length + 1);
+	memcpy(node->name, name->string, name->length);
+	node->name[name->length] = 0;
 
 	return node;
 }
@@ -91,38 +181,37 @@ static void vfs_refcpy(vRef* vref, vRef* src) {
 	}
 }
 
-static int vfs_findchld(vNode** node, const char* name) {
-	vNode* child = (*node)->child;
+static vNode* vfs_findchld(vNode* node, vName* name) {
 
-	while (true) {
+	if (node->count == 0) {
+		return NULL;
+	}
 
-		if (streq(child->name, name)) {
-			*node = child;
-			return 1;
-		}
+	uint32_t hash = vfs_hash(name->string, name->length);
+	uint32_t mask = node->capacity - 1;
+	uint32_t slot = hash & mask;
 
-		if (child->sibling != NULL) {
-			child = child->sibling;
-			continue;
-		}
+	// walk the probe sequence until an empty slot is reached
+	while (node->children[slot] != NULL) {
+		vNode* child = node->children[slot];
 
-		break;
+		if ((child->hash == hash) && (child->length == name->length) && strneq(name->string, name->length, child->name)) {
+			return child;
+		}
 
+		slot = (slot + 1) & mask;
 	}
 
-	*node = child;
-	return 0;
+	return NULL;
 }
 
-static int vfs_enter(vRef* vref, const char* part, int flags) {
-
-	vNode* node = vref->node;
+static int vfs_enter(vRef* vref, vName* part, int flags) {
 
-	if (streq(part, ".")) {
+	if (strneq(part->string, part->length, ".")) {
 		return 0;
 	}
 
-	if (streq(part, "..")) {
+	if (strneq(part->string, part->length, "..")) {
 
 		if (vref->offset > 0) {
 			vref->offset --;
@@ -132,7 +221,9 @@ static int vfs_enter(vRef* vref, const char* part, int flags) {
 				return res;
 			}
 
-			return vref->driver->open(vref, part, flags);
+			uint32_t start = timer_clock();
+			res = vref->driver->open(vref, part->string, part->length, flags);
+			return vfs_account(vref->node, VFS_OP_OPEN, start, res, 0);
 		}
 
 		// change mount point
@@ -141,9 +232,13 @@ static int vfs_enter(vRef* vref, const char* part, int flags) {
 		return vfs_update(vref);
 	}
 
-	if ((vref->offset == 0) && vfs_findchld(&node, part)) {
-		vref->node = node;
-		return vfs_update(vref);
+	if (vref->offset == 0) {
+		vNode* node = vfs_findchld(vref->node, part);
+
+		if (node != NULL) {
+			vref->node = node;
+			return vfs_update(vref);
+		}
 	}
 
 	// step into the unknown
@@ -155,7 +250,9 @@ static int vfs_enter(vRef* vref, const char* part, int flags) {
 		return res;
 	}
 
-	return vref->driver->open(vref, part, flags);
+	uint32_t start = timer_clock();
+	res = vref->driver->open(vref, part->string, part->length, flags);
+	return vfs_account(vref->node, VFS_OP_OPEN, start, res, 0);
 }
 
 /* public */
@@ -174,11 +271,11 @@ bool vfs_isreadable(int open_flags) {
 
 int vfs_open(vRef* vref, vRef* relation, const char* path, uint32_t flags) {
 
-	kprintf("vfs_open: '%s'\n", path);
+	VFS_DEBUG_LOG("vfs_open: '%s'\n", path);
 
 	bool enter = false;
-	char front[FILE_MAX_NAME];
-	char back[FILE_MAX_NAME];
+	vName front;
+	vName back;
 
 	vPath vpth;
 	vpth.string = path;
@@ -195,7 +292,7 @@ int vfs_open(vRef* vref, vRef* relation, const char* path, uint32_t flags) {
 		vfs_update(vref);
 	}
 
-	while (vfs_resolve(&vpth, front)) {
+	while (vfs_resolve(&vpth, &front)) {
 
 		// check if error occured in resolve
 		if (vpth.errno) {
@@ -203,7 +300,7 @@ int vfs_open(vRef* vref, vRef* relation, const char* path, uint32_t flags) {
 		}
 
 		if (enter) {
-			int res = vfs_enter(vref, back, OPEN_DIRECTORY | (flags & OPEN_NOFOLLOW));
+			int res = vfs_enter(vref, &back, OPEN_DIRECTORY | (flags & OPEN_NOFOLLOW));
 
 			if (res) {
 				return res;
@@ -216,11 +313,11 @@ int vfs_open(vRef* vref, vRef* relation, const char* path, uint32_t flags) {
 		}
 
 		enter = true;
-		memcpy(back, front, FILE_MAX_NAME);
+		back = front;
 	}
 
 	if (enter) {
-		return vfs_enter(vref, back, flags);
+		return vfs_enter(vref, &back, flags);
 	}
 
 	return 0;
@@ -238,7 +335,9 @@ int vfs_close(vRef* vref) {
 
 int vfs_read(vRef* vref, void* buffer, uint32_t size) {
 	if (vref->driver) {
-		return vref->driver->read(vref, buffer, size);
+		uint32_t start = timer_clock();
+		int res = vref->driver->read(vref, buffer, size);
+		return vfs_account(vref->node, VFS_OP_READ, start, res, res);
 	}
 
 	// TODO No driver at leaf node, return error?
@@ -247,7 +346,9 @@ int vfs_read(vRef* vref, void* buffer, uint32_t size) {
 
 int vfs_write(vRef* vref, void* buffer, uint32_t size) {
 	if (vref->driver) {
-		return vref->driver->write(vref, buffer, size);
+		uint32_t start = timer_clock();
+		int res = vref->driver->write(vref, buffer, size);
+		return vfs_account(vref->node, VFS_OP_WRITE, start, res, res);
 	}
 
 	// TODO No driver at leaf node, return error?
@@ -260,7 +361,9 @@ int vfs_seek(vRef* vref, int offset, int whence) {
 	}
 
 	if (vref->driver) {
-		return vref->driver->seek(vref, offset, whence);
+		uint32_t start = timer_clock();
+		int res = vref->driver->seek(vref, offset, whence);
+		return vfs_account(vref->node, VFS_OP_SEEK, start, res, 0);
 	}
 
 	// TODO No driver at leaf node, return error?
@@ -269,7 +372,9 @@ int vfs_seek(vRef* vref, int offset, int whence) {
 
 int vfs_list(vRef* vref, vEntry* entries, int max) {
 	if (vref->driver) {
-		return vref->driver->list(vref, entries, max);
+		uint32_t start = timer_clock();
+		int res = vref->driver->list(vref, entries, max);
+		return vfs_account(vref->node, VFS_OP_LIST, start, res, res * sizeof(vEntry));
 	}
 
 	// TODO No driver at leaf node, return error?
@@ -296,7 +401,9 @@ int vfs_remove(vRef* vref, bool rmdir) {
 
 int vfs_stat(vRef* vref, vStat* stat) {
 	if (vref->driver) {
-		return vref->driver->stat(vref, stat);
+		uint32_t start = timer_clock();
+		int res = vref->driver->stat(vref, stat);
+		return vfs_account(vref->node, VFS_OP_STAT, start, res, 0);
 	}
 
 	// TODO No driver at leaf node, return error?
@@ -312,6 +419,44 @@ int vfs_readlink(vRef* vref, const char* name, char* buffer, int size) {
 	return 0;
 }
 
+int vfs_sync(vRef* vref) {
+	if (vref->driver) {
+		return vref->driver->sync(vref);
+	}
+
+	// TODO No driver at leaf node, return error?
+	return 0;
+}
+
+int vfs_resize(vRef* vref, uint32_t size, bool allocate) {
+	if (vref->driver) {
+		return vref->driver->resize(vref, size, allocate);
+	}
+
+	// TODO No driver at leaf node, return error?
+	return 0;
+}
+
+void vfs_sync_all(vNode* node) {
+
+	if (node == NULL) {
+		node = &vfs_root_node;
+	}
+
+	// drivers without a sync operation have nothing to write back
+	if (node->driver != NULL && node->driver->sync != NULL) {
+		node->driver->sync(NULL);
+	}
+
+	node = node->child;
+
+	while (node != NULL) {
+		vfs_sync_all(node);
+		node = node->sibling;
+	}
+
+}
+
 void vfs_trace(vRef* vref, char* output, int size) {
 
 	char* path[PATH_MAX_RESOLVES];
@@ -335,12 +480,22 @@ void vfs_trace(vRef* vref, char* output, int size) {
 		}
 
 		char* buffer = kmalloc(FILE_MAX_NAME);
+		int length = -1;
 
-		if (!copy.driver || copy.driver->lookup(&copy, buffer)) {
-			memcpy(buffer, copy.node->name, strlen(copy.node->name) + 1);
+		if (copy.driver) {
+			uint32_t start = timer_clock();
+			length = copy.driver->lookup(&copy, buffer, FILE_MAX_NAME);
+
+			// root nodes have no name within their filesystem, that is not an error
+			vfs_account(copy.node, VFS_OP_LOOKUP, start, 0, 0);
+		}
+
+		if (length < 0) {
+			memcpy(buffer, copy.node->name, copy.node->length + 1);
 		}
 
-		vfs_enter(&copy, "..", 0);
+		vName parent = {"..", 2};
+		vfs_enter(&copy, &parent, 0);
 		path[j --] = buffer;
 
 	}
@@ -371,11 +526,7 @@ void vfs_trace(vRef* vref, char* output, int size) {
 
 }
 
-int vfs_resolve(vPath* path, char* buffer) {
-
-	// index into the filename buffer
-	int i = 0;
-	int last = FILE_MAX_NAME - 1;
+int vfs_resolve(vPath* path, vName* name) {
 
 	// the path is parsed in sections that start with / and end
 	// before the start of next section:
@@ -396,32 +547,30 @@ int vfs_resolve(vPath* path, char* buffer) {
 		return 0;
 	}
 
+	// the name points directly into the path string, nothing is copied
+	name->string = path->string + path->offset;
+	name->length = 0;
+
 	// match the name until we reach the end of section (start of next section or \0)
 	while (true) {
 
-		// filename limit exceded, we will handle it as if the section ended here
-		if (i >= last) {
-			path->errno = LINUX_ENAMETOOLONG;
-			break;
-		}
-
-		const char chr = path->string[path->offset ++];
+		const char chr = path->string[path->offset];
 
 		// handle interpath separator and string end
 		if ((chr == '/') || (chr == '\0')) {
-
-			// 'unget' last char
-			path->offset --;
 			break;
 		}
 
-		// copy into filename buffer
-		buffer[i ++] = chr;
+		name->length ++;
+		path->offset ++;
+
+	}
 
+	// filename limit exceded, the name would not fit in a null-terminated FILE_MAX_NAME buffer
+	if (name->length >= FILE_MAX_NAME) {
+		path->errno = LINUX_ENAMETOOLONG;
 	}
 
-	// insert null-byte
-	buffer[i] = '\0';
 	path->resolves ++;
 
 	return 1;
@@ -431,7 +580,13 @@ void vfs_init() {
 	vfs_root_node.child = NULL;
 	vfs_root_node.sibling = NULL;
 	vfs_root_node.parent = &vfs_root_node;
-	memcpy(vfs_root_node.name, "root", 5);
+	memset(vfs_root_node.counters, 0, sizeof(vfs_root_node.counters));
+	vfs_root_node.children = NULL;
+	vfs_root_node.capacity = 0;
+	vfs_root_node.count = 0;
+	vfs_root_node.hash = vfs_hash("root", 4);
+	vfs_root_node.length = 4;
+	vfs_root_node.name = "root";
 
 	vfs_root_ref.node = &vfs_root_node;
 	vfs_root_ref.offset = 0;
@@ -450,25 +605,18 @@ int vfs_mount(const char* path, FilesystemDriver* driver) {
 		panic("Can't mount to relative directory!");
 	}
 
-	char buffer[FILE_MAX_NAME];
+	vName name;
 	vNode* node = &vfs_root_node;
 
-	while (vfs_resolve(&vpth, buffer)) {
-		if (node->child == NULL) {
-			vNode* vn = vfs_mknode(node, buffer);
+	while (vfs_resolve(&vpth, &name)) {
+		vNode* child = vfs_findchld(node, &name);
 
-			node->child = vn;
-			node = vn;
-			continue;
+		if (child == NULL) {
+			child = vfs_mknode(node, &name);
+			vfs_addchld(node, child);
 		}
 
-		if (vfs_findchld(&node, buffer) == 0) {
-			vNode* vn = vfs_mknode(node->parent, buffer);
-
-			node->sibling = vn;
-			node = vn;
-			continue;
-		}
+		node = child;
 	}
 
 	kprintf("Mounted %s at %s\n", driver->identifier, path);
@@ -491,7 +639,10 @@ void vfs_print(vNode* node, int depth) {
 		kprintf("\x8\x8%c ", 0xC3);
 	}
 
-	kprintf("%s at '%s' (child of: %s)\n", node->name, node->driver->identifier, node->parent->name);
+	// intermediate nodes created for nested mounts have no driver of their own
+	const char* identifier = (node->driver != NULL) ? node->driver->identifier : "-";
+
+	kprintf("%s at '%s' (child of: %s)\n", node->name, identifier, node->parent->name);
 	node = node->child;
 
 	while (node != NULL) {
@@ -500,3 +651,166 @@ void vfs_print(vNode* node, int depth) {
 	}
 
 }
+
+static int vfs_collect(vNode* node, vNode** nodes, int max, int count) {
+
+	if (node->driver != NULL) {
+		if (count < max) {
+			nodes[count] = node;
+		}
+
+		count ++;
+	}
+
+	for (vNode* child = node->child; child != NULL; child = child->sibling) {
+		count = vfs_collect(child, nodes, max, count);
+	}
+
+	return count;
+}
+
+int vfs_mounts(vNode** nodes, int max) {
+	return vfs_collect(&vfs_root_node, nodes, max, 0);
+}
+
+void vfs_mountpath(vNode* node, char* buffer, int size) {
+
+	// measure the path first, so that it can be written from the back
+	int length = 0;
+
+	for (vNode* part = node; part != &vfs_root_node; part = part->parent) {
+		length += part->length + 1;
+	}
+
+	if (length == 0) {
+		length = 1;
+	}
+
+	if (length >= size) {
+		buffer[0] = 0;
+		return;
+	}
+
+	buffer[0] = '/';
+	buffer[length] = 0;
+
+	for (vNode* part = node; part != &vfs_root_node; part = part->parent) {
+		length -= part->length;
+		memcpy(buffer + length, part->name, part->length);
+		buffer[-- length] = '/';
+	}
+
+}
+
+static void vfs_reset_node(vNode* node) {
+	memset(node->counters, 0, sizeof(node->counters));
+
+	for (vNode* child = node->child; child != NULL; child = child->sibling) {
+		vfs_reset_node(child);
+	}
+}
+
+void vfs_reset_counters() {
+	vfs_reset_node(&vfs_root_node);
+}
+
+#if VFS_BENCHMARK
+
+#define VFS_BENCHMARK_DEPTH 8
+#define VFS_BENCHMARK_WIDTH 32
+#define VFS_BENCHMARK_ROUNDS 2000
+
+static int vfs_bench_root(vRef* dst) {
+	dst->state = NULL;
+	return 0;
+}
+
+static int vfs_bench_clone(vRef* dst, vRef* src) {
+	dst->state = src->state;
+	return 0;
+}
+
+static int vfs_bench_close(vRef* vref) {
+	(void) vref;
+	return 0;
+}
+
+static int vfs_bench_lookup(vRef* vref, char* buffer, int size) {
+	(void) vref;
+	(void) buffer;
+	(void) size;
+	return -1;
+}
+
+static int vfs_bench_sync(vRef* vref) {
+	(void) vref;
+	return 0;
+}
+
+static int vfs_bench_resize(vRef* vref, uint32_t size, bool allocate) {
+	(void) vref;
+	(void) size;
+	(void) allocate;
+	return -LINUX_EINVAL;
+}
+
+static int vfs_bench_name(char* buffer, char prefix, int index) {
+	buffer[0] = prefix;
+	buffer[1] = '0' + (index / 10);
+	buffer[2] = '0' + (index % 10);
+	buffer[3] = 0;
+	return 3;
+}
+
+void vfs_benchmark() {
+
+	static FilesystemDriver driver;
+	memcpy(driver.identifier, "Bench", 6);
+	driver.root = vfs_bench_root;
+	driver.clone = vfs_bench_clone;
+	driver.close = vfs_bench_close;
+	driver.lookup = vfs_bench_lookup;
+
+	// the mounts stay in place after the benchmark, so sync() will reach them
+	driver.sync = vfs_bench_sync;
+	driver.resize = vfs_bench_resize;
+
+	// every level of the deep path has VFS_BENCHMARK_WIDTH mounted siblings
+	// so that each path component has to be picked out of a crowded mount node
+	char path[8 + VFS_BENCHMARK_DEPTH * 4];
+	char sibling[8 + VFS_BENCHMARK_DEPTH * 4 + 4];
+	int length = 6;
+
+	memcpy(path, "/bench", 7);
+	vfs_mount(path, &driver);
+
+	for (int i = 0; i < VFS_BENCHMARK_DEPTH; i ++) {
+		memcpy(sibling, path, length);
+		sibling[length] = '/';
+
+		for (int j = 0; j < VFS_BENCHMARK_WIDTH; j ++) {
+			vfs_bench_name(sibling + length + 1, 'w', j);
+			vfs_mount(sibling, &driver);
+		}
+
+		path[length ++] = '/';
+		length += vfs_bench_name(path + length, 'd', i);
+		vfs_mount(path, &driver);
+	}
+
+	vRef root = vfs_root();
+	vRef vref;
+
+	uint32_t start = timer_clock();
+
+	for (int i = 0; i < VFS_BENCHMARK_ROUNDS; i ++) {
+		vfs_open(&vref, &root, path, 0);
+		vfs_close(&vref);
+	}
+
+	uint32_t micros = timer_elapsed(start);
+
+	kprintf("vfs: resolved '%s' %d times in %d us (%d mounts per level)\n", path, VFS_BENCHMARK_ROUNDS, micros, VFS_BENCHMARK_WIDTH + 1);
+}
+
+#endif
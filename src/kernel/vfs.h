@@ -45,7 +45,7 @@ typedef enum {
  */
 typedef struct {
 
-	// offset in the directory to this entry
+	// offset in the directory to this entry, can be given to vfs_seek() to list again from this entry
 	uint32_t seek_offset;
 
 	// the length of the string in name
@@ -59,6 +59,20 @@ typedef struct {
 
 } vEntry;
 
+/**
+ * @brief A length-delimited slice of a path string, used to refer to a single
+ *        path element without copying it out of the original string
+ */
+typedef struct {
+
+	// first character of the name, the name is NOT null-terminated
+	const char* string;
+
+	// number of characters in the name
+	int length;
+
+} vName;
+
 /**
  * @brief Used mostly internally to iterate paths using `vfs_resolve()`
  */
@@ -104,12 +118,56 @@ typedef struct {
 
 } vStat;
 
+/**
+ * @brief Driver operations that are instrumented by the VFS, see vCounter
+ */
+typedef enum {
+	VFS_OP_OPEN   = 0,
+	VFS_OP_READ   = 1,
+	VFS_OP_WRITE  = 2,
+	VFS_OP_SEEK   = 3,
+	VFS_OP_LIST   = 4,
+	VFS_OP_STAT   = 5,
+	VFS_OP_LOOKUP = 6,
+	VFS_OP_COUNT  = 7,
+} vOperation;
+
+/**
+ * @brief Usage statistics of one driver operation on a single mount
+ */
+typedef struct {
+
+	// number of times the operation was invoked
+	uint32_t calls;
+
+	// number of invocations that returned an error
+	uint32_t errors;
+
+	// number of bytes transferred by successful invocations (read, write and list only)
+	uint32_t bytes;
+
+	// total time spent in the driver, in microseconds
+	uint32_t micros;
+
+} vCounter;
+
 typedef struct vNode_tag {
 	struct vNode_tag* sibling;
 	struct vNode_tag* child;
 	struct vNode_tag* parent;
 	struct FilesystemDriver_tag* driver;
-	char name[FILE_MAX_NAME];
+	uint32_t hash;
+	int length;
+	char* name;
+
+	// open addressing hash table of children, indexed with the child name hash,
+	// the sibling list is still kept for ordered traversal of the tree
+	struct vNode_tag** children;
+	int capacity;
+	int count;
+
+	// statistics of the driver mounted at this node, indexed with vOperation
+	vCounter counters[VFS_OP_COUNT];
 } vNode;
 
 typedef struct {
@@ -142,9 +200,10 @@ typedef int (*driver_clone) (vRef* dst, vRef* src);
 /**
  * @brief Open (and possibly create) a file
  *
- * @param[in] vref  The directory to open the file/directory from
- * @param[in] part  The name of the file/directory to open
- * @param[in] flags combination of the following flags:
+ * @param[in] vref   The directory to open the file/directory from
+ * @param[in] name   The name of the file/directory to open, this is NOT null-terminated
+ * @param[in] length The number of characters in name
+ * @param[in] flags  combination of the following flags:
  *                  OPEN_WRONLY    Open in write-only mode (See vfs_iswriteable())
  *                  OPEN_RDWR      Open in read-only mode (See vfs_isreadable())
  *                  OPEN_APPEND    Set the file cursor initially at the end of the file
@@ -162,7 +221,7 @@ typedef int (*driver_clone) (vRef* dst, vRef* src);
  *         LINUX_EEXIST  - File exists while creation was mandated (OPEN_EXCL)
  *         LINUX_ENOTDIR - Target is not a directory while OPEN_DIRECTORY was set
  */
-typedef int (*driver_open) (vRef* vref, const char* basename, uint32_t flags);
+typedef int (*driver_open) (vRef* vref, const char* name, int length, uint32_t flags);
 
 /**
  * @brief Close and dealocate vRef
@@ -215,13 +274,16 @@ typedef int (*driver_write) (vRef* vref, void* buffer, uint32_t size);
 typedef int (*driver_seek) (vRef* vref, int offset, int whence);
 
 /**
- * @brief Fills at most max entries in the given vEntry buffer
+ * @brief Fills at most max entries in the given vEntry buffer, starting from the current
+ *        position in the directory and advancing past the returned entries. Consecutive calls
+ *        continue where the previous one stopped, the seek_offset of each entry can be
+ *        passed to driver_seek() with SEEK_SET to resume listing from that entry.
  *
  * @param[in] vref the vRef of node to list
  * @param[out] entries the buffer to write to
  * @param[in] max buffer size (in vEntry multiples)
  *
- * @return Returns number of entries written on success and a negated ERRNO code on error
+ * @return Returns number of entries written on success (0 once the end is reached) and a negated ERRNO code on error
  *         LINUX_EIO     - Internal IO error occured in the filesystem itself
  *         LINUX_ENOTDIR - Vref isn't a directory
  */
@@ -287,16 +349,50 @@ typedef int (*driver_readlink) (vRef* vref, const char* name, char* buffer, int
  * @brief Get the name of node in a filesystem
  *
  * @param[in] vref    The vRef of the node that is to be queried
- * @param[out] name   Buffer to write the name to, must be of at least FILE_MAX_NAME bytes
+ * @param[out] buffer Buffer to write the name to, the name is null-terminated
+ * @param[in] size    The length (in bytes) of the given buffer
  *
- * @return Returns 0 if the name was writen or -1 if it wasn't.
+ * @return Returns the length of the name that was written (without the null-byte) or -1 if it wasn't.
  *         This function should fail for root nodes, as they do not have a name within a mounted filesystem.
  */
-typedef int (*driver_lookup) (vRef* vref, char* buffer);
+typedef int (*driver_lookup) (vRef* vref, char* buffer, int size);
+
+/**
+ * @brief Write all cached modifications to the underlying device
+ *
+ * @param[in] vref The vRef of the file that should be made durable,
+ *                 or NULL if the whole filesystem should be flushed.
+ *
+ * @return Returns 0 on success and a negated ERRNO code on error
+ *         LINUX_EIO     - Internal IO error occured in the filesystem itself
+ */
+typedef int (*driver_sync) (vRef* vref);
+
+/**
+ * @brief Change the size of a file
+ *
+ * @param[in] vref     The vRef of the file to resize
+ * @param[in] size     The new size of the file in bytes
+ * @param[in] allocate If set the file is only ever grown and the storage for the first size bytes
+ *                     is reserved up front (fallocate), otherwise the file is set to exactly size
+ *                     bytes, freeing the storage past it or appending zeros (truncate)
+ *
+ * @note The file cursor is not moved.
+ *
+ * @return Returns 0 on success and a negated ERRNO code on error
+ *         LINUX_EIO     - Internal IO error occured in the filesystem itself
+ *         LINUX_EISDIR  - Vref is a directory
+ *         LINUX_EINVAL  - The file can't be resized
+ *         LINUX_ENOSPC  - There is not enough free space on the device
+ */
+typedef int (*driver_resize) (vRef* vref, uint32_t size, bool allocate);
 
 typedef struct FilesystemDriver_tag {
 	char identifier[16];
 
+	// driver specific state of the mounted volume, shared by all vRefs on the mount
+	void* context;
+
 	driver_root     root;
 	driver_clone    clone;
 	driver_open     open;
@@ -310,17 +406,19 @@ typedef struct FilesystemDriver_tag {
 	driver_stat     stat;
 	driver_readlink readlink;
 	driver_lookup   lookup;
+	driver_sync     sync;
+	driver_resize   resize;
 } FilesystemDriver;
 
 /**
  * @brief Get next path element
  *
- * @param[in] path    Path object to get the next element of.
- * @param[out] buffer Buffer to write the next name into.
+ * @param[in] path  Path object to get the next element of.
+ * @param[out] name Slice of the path string that holds the next element.
  *
- * @return 1 on success, 0 if nothing was written to buffer.
+ * @return 1 on success, 0 if there are no more elements.
  */
-int vfs_resolve(vPath* path, char* buffer);
+int vfs_resolve(vPath* path, vName* name);
 
 /**
  * @brief Starts the File Devices Subsystem, this must be the first call into fdev.
@@ -378,6 +476,25 @@ int vfs_stat(vRef* vref, vStat* stat);
  */
 int vfs_readlink(vRef* vref, const char* name, char* buffer, int size);
 
+/**
+ * @brief Perform a filesystem-independent file fsync()/fdatasync() operation
+ */
+int vfs_sync(vRef* vref);
+
+/**
+ * @brief Perform a filesystem-independent file truncate()/fallocate() operation
+ */
+int vfs_resize(vRef* vref, uint32_t size, bool allocate);
+
+/**
+ * @brief Perform a filesystem-independent sync() operation, flushes all mounted filesystems
+ *
+ * @param[in] node Node to start from, set to NULL to flush the whole tree.
+ *
+ * @return None.
+ */
+void vfs_sync_all(vNode* node);
+
 /*
  * @brief convert vRef into an absolute string path
  *
@@ -430,3 +547,43 @@ int vfs_mount(const char* path, FilesystemDriver* value);
  * @return None.
  */
 void vfs_print(vNode* node, int depth);
+
+/**
+ * @brief Collect all the nodes that have a driver mounted, in tree order.
+ *
+ * @param[out] nodes The buffer to write the nodes to.
+ * @param[in]  max   Buffer size (in vNode pointers), can be 0 to only count the mounts.
+ *
+ * @return The total number of mounts, this can be greater than max.
+ */
+int vfs_mounts(vNode** nodes, int max);
+
+/**
+ * @brief Get the absolute path of a mount point.
+ *
+ * @param[in]  node   The mount node, as returned by vfs_mounts().
+ * @param[out] buffer The buffer to write the null-terminated path to.
+ * @param[in]  size   The length (in bytes) of the given buffer.
+ *
+ * @return None.
+ */
+void vfs_mountpath(vNode* node, char* buffer, int size);
+
+/**
+ * @brief Zero the operation counters of all the mounts.
+ *
+ * @return None.
+ */
+void vfs_reset_counters();
+
+#if VFS_BENCHMARK
+
+/**
+ * @brief Mount a deep and wide tree of dummy filesystems under /bench and print
+ *        how long it takes to repeatedly resolve the deepest path.
+ *
+ * @return None.
+ */
+void vfs_benchmark();
+
+#endif
@@ -0,0 +1,518 @@
+#include "virtio.h"
+#include "config.h"
+#include "interrupt.h"
+#include "io.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "pci.h"
+#include "print.h"
+#include "routine.h"
+
+//#define VIRTIO_DEBUG_ON
+
+#ifdef VIRTIO_DEBUG_ON
+	#define virtio_debug_msg(...) kprintf(__VA_ARGS__)
+#else
+	#define virtio_debug_msg(...)
+#endif
+
+#define VIRTIO_SECTOR_SIZE 512
+
+// the largest transfer a single request carries, every slot has a buffer this big
+#define VIRTIO_BLK_SLOT_SIZE (16 * 1024)
+
+// transitional virtio-blk devices, legacy drivers only ever see the registers in BAR0
+#define VIRTIO_PCI_VENDOR 0x1AF4
+#define VIRTIO_PCI_BLK 0x1001
+
+// the legacy interface places the used ring on the first page after the available ring
+#define VIRTIO_PAGE_SIZE 4096
+
+// the spin count used while polling for completions of a device without an IRQ line
+#define VIRTIO_SPIN 0xffffff
+
+// the compiler must not move the ring updates around the index updates, x86 doesn't reorder stores on its own
+#define virtio_barrier() __asm volatile ("" : : : "memory")
+
+enum VirtioRegisters
+{
+	DEVICE_FEATURES = 0x00, // 32 bit
+	GUEST_FEATURES  = 0x04, // 32 bit
+	QUEUE_ADDRESS   = 0x08, // 32 bit, page number of the queue
+	QUEUE_SIZE      = 0x0C, // 16 bit, read-only
+	QUEUE_SELECT    = 0x0E, // 16 bit
+	QUEUE_NOTIFY    = 0x10, // 16 bit
+	DEVICE_STATUS   = 0x12, // 8 bit
+	ISR_STATUS      = 0x13, // 8 bit, reading it acknowledges the interrupt
+	BLK_CAPACITY    = 0x14  // 64 bit, in sectors, start of the virtio-blk configuration
+};
+
+enum VirtioStatus
+{
+	ACKNOWLEDGE = 0x01, // the driver noticed the device
+	DRIVER      = 0x02, // the driver knows how to drive it
+	DRIVER_OK   = 0x04, // the driver is set up and the device can be used
+	FAILED      = 0x80
+};
+
+enum VirtioBlkFeatures
+{
+	FLUSH = 1 << 9 // the device has a write cache and accepts flush requests
+};
+
+enum VirtioBlkRequest
+{
+	REQUEST_IN    = 0, // read
+	REQUEST_OUT   = 1, // write
+	REQUEST_FLUSH = 4
+};
+
+enum VirtqDescriptorFlags
+{
+	NEXT  = 1, // the chain continues in the `next` descriptor
+	WRITE = 2  // the device writes into the buffer
+};
+
+typedef struct {
+	uint64_t address;
+	uint32_t length;
+	uint16_t flags;
+	uint16_t next;
+} ABI_PACKED VirtqDescriptor;
+
+typedef struct {
+	uint16_t flags;
+	uint16_t index;
+	uint16_t ring[];
+} ABI_PACKED VirtqAvailable;
+
+typedef struct {
+	uint32_t id;
+	uint32_t length;
+} ABI_PACKED VirtqUsedElement;
+
+typedef struct {
+	uint16_t flags;
+	uint16_t index;
+	VirtqUsedElement ring[];
+} ABI_PACKED VirtqUsed;
+
+typedef struct {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+} ABI_PACKED VirtioBlkHeader;
+
+// A request buffer, slot `i` owns the chain of descriptors 3i (header), 3i+1 (data) and 3i+2 (status)
+typedef struct {
+	VirtioBlkHeader header;
+	volatile uint8_t status;
+	volatile bool busy;  // submitted to the device and not yet completed
+	bool claimed;        // held by a reader that hasn't copied the data out yet
+	uint32_t count;      // number of sectors, for overlap checks
+	uint8_t* data;
+
+	// where the data of a read goes
+	uint8_t* target;
+	uint32_t offset;
+	uint32_t length;
+} VirtioBlkSlot;
+
+/* private */
+
+static uint16_t base = 0;
+static uint32_t features = 0;
+static uint64_t capacity = 0;
+static bool interrupts = false;
+
+static uint16_t queue_size = 0;
+static volatile VirtqDescriptor* descriptors = NULL;
+static volatile VirtqAvailable* available = NULL;
+static volatile VirtqUsed* used = NULL;
+static uint16_t used_index = 0;
+
+static VirtioBlkSlot* slots = NULL;
+static int slot_count = 0;
+
+// set when a queued write fails, reported and cleared by virtio_blk_flush()
+static bool write_failed = false;
+
+static volatile bool irq_done = false;
+
+// Takes all the completed requests off the used ring, interrupts are disabled meanwhile
+// so that the IRQ handler can't take the same entry when it interrupts a reap outside of it
+static void virtio_blk_reap(){
+	uint32_t flags;
+	__asm volatile ("pushf; pop %0; cli" : "=r" (flags));
+
+	while (used_index != used->index){
+		virtio_barrier();
+
+		VirtioBlkSlot* slot = &slots[used->ring[used_index % queue_size].id / 3];
+
+		if (slot->status != 0 && slot->header.type == REQUEST_OUT){
+			virtio_debug_msg("Error: virtio-blk write of sector %d failed\n", (uint32_t) slot->header.sector);
+			write_failed = true;
+		}
+
+		slot->busy = false;
+		used_index ++;
+	}
+
+	// restore the interrupt flag of the caller
+	if (flags & 0x200){
+		__asm volatile ("sti");
+	}
+}
+
+static void virtio_blk_irq(int number, int error, int* eax, int ecx, int edx, int ebx, int esi, int edi){
+	if (inb(base + ISR_STATUS) & 1){
+		virtio_blk_reap();
+		irq_done = true;
+	}
+}
+
+// Waits until the request in the slot completes, returns false if it failed or timed out
+static bool virtio_blk_wait(VirtioBlkSlot* slot){
+
+	for (uint32_t i = 0; slot->busy; i ++){
+
+		// without an IRQ line the used ring is polled instead
+		if (!interrupts){
+			if (i >= VIRTIO_SPIN){
+				virtio_debug_msg("Error: virtio-blk request timeout\n");
+				return false;
+			}
+
+			virtio_blk_reap();
+			continue;
+		}
+
+		// a completion that arrives after the reap sets the flag, so it can't be missed
+		irq_done = false;
+		virtio_blk_reap();
+
+		if (slot->busy && !int_wait_flag(&irq_done, VIRTIO_TIMEOUT_TICKS)){
+			virtio_debug_msg("Error: virtio-blk IRQ timeout\n");
+			return false;
+		}
+	}
+
+	return slot->status == 0;
+}
+
+// Returns a slot that is neither in flight nor held by a reader, if `wait` is set and there is none
+// the driver waits for a queued write to complete. NULL is returned if no slot could be freed
+static VirtioBlkSlot* virtio_blk_claim(bool wait){
+	while (true){
+		VirtioBlkSlot* pending = NULL;
+
+		for (int i = 0; i < slot_count; i ++){
+			if (!slots[i].busy && !slots[i].claimed){
+				slots[i].claimed = true;
+				return &slots[i];
+			}
+
+			if (slots[i].busy && !slots[i].claimed && pending == NULL){
+				pending = &slots[i];
+			}
+		}
+
+		if (!wait || pending == NULL){
+			return NULL;
+		}
+
+		// a request that timed out keeps its slot forever
+		if (!virtio_blk_wait(pending) && pending->busy){
+			return NULL;
+		}
+	}
+}
+
+// Waits for the queued writes that touch any of the given sectors, the device may
+// complete requests in any order so later requests must not overtake them
+static void virtio_blk_order(uint32_t sector, uint32_t count){
+	for (int i = 0; i < slot_count; i ++){
+		VirtioBlkSlot* slot = &slots[i];
+
+		if (slot->busy && !slot->claimed && slot->header.sector < sector + count && slot->header.sector + slot->count > sector){
+			virtio_blk_wait(slot);
+		}
+	}
+}
+
+// Puts the slot's request on the available ring and notifies the device
+static void virtio_blk_submit(VirtioBlkSlot* slot, uint32_t type, uint32_t sector, uint32_t count, uint8_t* data){
+	uint16_t head = (slot - slots) * 3;
+
+	slot->header.type = type;
+	slot->header.reserved = 0;
+	slot->header.sector = sector;
+	slot->status = 0xFF;
+	slot->count = count;
+	slot->busy = true;
+
+	descriptors[head].address = (uint32_t) &slot->header;
+	descriptors[head].length = sizeof(VirtioBlkHeader);
+	descriptors[head].flags = NEXT;
+	descriptors[head].next = head + 1;
+
+	descriptors[head + 1].address = (uint32_t) data;
+	descriptors[head + 1].length = count * VIRTIO_SECTOR_SIZE;
+	descriptors[head + 1].flags = NEXT | (type == REQUEST_IN ? WRITE : 0);
+	descriptors[head + 1].next = head + 2;
+
+	descriptors[head + 2].address = (uint32_t) &slot->status;
+	descriptors[head + 2].length = 1;
+	descriptors[head + 2].flags = WRITE;
+
+	// a flush carries no data, the header links straight to the status
+	if (count == 0){
+		descriptors[head].next = head + 2;
+	}
+
+	available->ring[available->index % queue_size] = head;
+	virtio_barrier();
+	available->index ++;
+	virtio_barrier();
+
+	outw(base + QUEUE_NOTIFY, 0);
+}
+
+/* public */
+
+bool virtio_blk_init(){
+	PciDevice device;
+
+	if (!pci_find_id(&device, VIRTIO_PCI_VENDOR, VIRTIO_PCI_BLK)){
+		virtio_debug_msg("Error: No virtio-blk device\n");
+		return false;
+	}
+
+	base = pci_bar(&device, 0);
+	pci_enable(&device, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+	/*======== handshake ========*/
+	outb(base + DEVICE_STATUS, 0);
+	outb(base + DEVICE_STATUS, ACKNOWLEDGE);
+	outb(base + DEVICE_STATUS, ACKNOWLEDGE | DRIVER);
+
+	features = inl(base + DEVICE_FEATURES) & FLUSH;
+	outl(base + GUEST_FEATURES, features);
+
+	capacity = inl(base + BLK_CAPACITY) | ((uint64_t) inl(base + BLK_CAPACITY + 4) << 32);
+
+	/*======== virtqueue ========*/
+	outw(base + QUEUE_SELECT, 0);
+	queue_size = inw(base + QUEUE_SIZE);
+
+	if (queue_size < 3){
+		virtio_debug_msg("Error: virtio-blk queue too small\n");
+		outb(base + DEVICE_STATUS, FAILED);
+		return false;
+	}
+
+	// the descriptor table and the available ring share the first pages, the used ring starts on a page boundary
+	uint32_t ring_size = sizeof(VirtqDescriptor) * queue_size + sizeof(VirtqAvailable) + sizeof(uint16_t) * (queue_size + 1);
+	uint32_t used_offset = (ring_size + VIRTIO_PAGE_SIZE - 1) & ~(VIRTIO_PAGE_SIZE - 1);
+	uint32_t total_size = used_offset + sizeof(VirtqUsed) + sizeof(VirtqUsedElement) * queue_size + sizeof(uint16_t);
+
+	uint32_t memory = (uint32_t) kmalloc(total_size + VIRTIO_PAGE_SIZE - 1);
+
+	slot_count = (queue_size / 3 < VIRTIO_BLK_SLOTS) ? queue_size / 3 : VIRTIO_BLK_SLOTS;
+	slots = kmalloc(sizeof(VirtioBlkSlot) * slot_count);
+	uint8_t* buffers = kmalloc(VIRTIO_BLK_SLOT_SIZE * slot_count);
+
+	if (memory == 0 || slots == NULL || buffers == NULL){
+		virtio_debug_msg("Error: virtio-blk queue allocation failed\n");
+		outb(base + DEVICE_STATUS, FAILED);
+		return false;
+	}
+
+	uint32_t queue = (memory + VIRTIO_PAGE_SIZE - 1) & ~(VIRTIO_PAGE_SIZE - 1);
+	memset((void*) queue, 0, total_size);
+
+	descriptors = (VirtqDescriptor*) queue;
+	available = (VirtqAvailable*) (queue + sizeof(VirtqDescriptor) * queue_size);
+	used = (VirtqUsed*) (queue + used_offset);
+	used_index = 0;
+
+	for (int i = 0; i < slot_count; i ++){
+		slots[i].busy = false;
+		slots[i].claimed = false;
+		slots[i].data = buffers + i * VIRTIO_BLK_SLOT_SIZE;
+	}
+
+	outl(base + QUEUE_ADDRESS, queue / VIRTIO_PAGE_SIZE);
+
+	/*======== interrupts ========*/
+	// the firmware routes the PCI interrupt pin to one of the PIC lines
+	interrupts = device.irq < 16;
+
+	if (interrupts){
+		isr_register(0x20 + device.irq, virtio_blk_irq);
+	}
+
+	outb(base + DEVICE_STATUS, ACKNOWLEDGE | DRIVER | DRIVER_OK);
+
+	virtio_debug_msg("virtio-blk: %d sectors, queue size %d, IRQ %d, flush: %d\n", (uint32_t) capacity, queue_size, device.irq, (features & FLUSH) != 0);
+	return true;
+}
+
+bool virtio_blk_read(void* buffer, uint32_t address, uint32_t size){
+	virtio_debug_msg("Reading %d bytes from address 0x%x\n", size, address);
+
+	uint8_t* output = buffer;
+	uint32_t end = address + size;
+	bool success = true;
+
+	// slots submitted by this read, completed in order
+	VirtioBlkSlot* pending[VIRTIO_BLK_SLOTS];
+	int first = 0;
+	int count = 0;
+
+	while (address < end || count > 0){
+		VirtioBlkSlot* slot = (address < end) ? virtio_blk_claim(count == 0) : NULL;
+
+		if (slot != NULL){
+			uint32_t sector = address / VIRTIO_SECTOR_SIZE;
+			uint32_t offset = address % VIRTIO_SECTOR_SIZE;
+			uint32_t length = VIRTIO_BLK_SLOT_SIZE - offset;
+
+			if (length > end - address){
+				length = end - address;
+			}
+
+			uint32_t sectors = (offset + length + VIRTIO_SECTOR_SIZE - 1) / VIRTIO_SECTOR_SIZE;
+
+			if (sector + sectors > capacity){
+				slot->claimed = false;
+				success = false;
+				address = end;
+				continue;
+			}
+
+			virtio_blk_order(sector, sectors);
+
+			slot->target = output;
+			slot->offset = offset;
+			slot->length = length;
+			virtio_blk_submit(slot, REQUEST_IN, sector, sectors, slot->data);
+
+			pending[(first + count) % VIRTIO_BLK_SLOTS] = slot;
+			count ++;
+
+			output += length;
+			address += length;
+			continue;
+		}
+
+		if (count == 0){
+			return false;
+		}
+
+		// no free slot, or nothing more to submit, take the oldest request
+		slot = pending[first];
+		first = (first + 1) % VIRTIO_BLK_SLOTS;
+		count --;
+
+		if (virtio_blk_wait(slot)){
+			memcpy(slot->target, slot->data + slot->offset, slot->length);
+		} else {
+			success = false;
+		}
+
+		slot->claimed = false;
+	}
+
+	return success;
+}
+
+bool virtio_blk_write(void* buffer, uint32_t address, uint32_t size){
+	virtio_debug_msg("Writing %d bytes to address 0x%x\n", size, address);
+
+	const uint8_t* input = buffer;
+	uint32_t end = address + size;
+
+	while (address < end){
+		uint32_t sector = address / VIRTIO_SECTOR_SIZE;
+		uint32_t offset = address % VIRTIO_SECTOR_SIZE;
+		uint32_t length = VIRTIO_BLK_SLOT_SIZE - offset;
+
+		if (length > end - address){
+			length = end - address;
+		}
+
+		uint32_t sectors = (offset + length + VIRTIO_SECTOR_SIZE - 1) / VIRTIO_SECTOR_SIZE;
+		uint32_t tail = (offset + length) % VIRTIO_SECTOR_SIZE;
+
+		if (sector + sectors > capacity){
+			return false;
+		}
+
+		// earlier writes to the same sectors have to land first
+		virtio_blk_order(sector, sectors);
+		VirtioBlkSlot* slot = virtio_blk_claim(true);
+
+		if (slot == NULL){
+			return false;
+		}
+
+		// only the partially covered sectors at the ends need their old contents
+		if (offset != 0){
+			virtio_blk_submit(slot, REQUEST_IN, sector, 1, slot->data);
+
+			if (!virtio_blk_wait(slot)){
+				slot->claimed = false;
+				return false;
+			}
+		}
+
+		if (tail != 0 && (sectors > 1 || offset == 0)){
+			virtio_blk_submit(slot, REQUEST_IN, sector + sectors - 1, 1, slot->data + (sectors - 1) * VIRTIO_SECTOR_SIZE);
+
+			if (!virtio_blk_wait(slot)){
+				slot->claimed = false;
+				return false;
+			}
+		}
+
+		memcpy(slot->data + offset, input, length);
+
+		// the slot is released to the device, it becomes free again once the write completes
+		virtio_blk_submit(slot, REQUEST_OUT, sector, sectors, slot->data);
+		slot->claimed = false;
+
+		input += length;
+		address += length;
+	}
+
+	return true;
+}
+
+bool virtio_blk_flush(){
+	for (int i = 0; i < slot_count; i ++){
+		virtio_blk_wait(&slots[i]);
+	}
+
+	bool success = !write_failed;
+	write_failed = false;
+
+	if (features & FLUSH){
+		VirtioBlkSlot* slot = virtio_blk_claim(true);
+
+		if (slot == NULL){
+			return false;
+		}
+
+		virtio_blk_submit(slot, REQUEST_FLUSH, 0, 0, NULL);
+
+		if (!virtio_blk_wait(slot)){
+			success = false;
+		}
+
+		slot->claimed = false;
+	}
+
+	return success;
+}
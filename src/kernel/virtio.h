@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.h"
+
+/**
+ * @brief Initializes the driver for the first legacy (or transitional) virtio-blk PCI device, the
+ *        device gets a single virtqueue with room for VIRTIO_BLK_SLOTS requests in flight.
+ *
+ * @return true if a block device was found and the driver is ready, false otherwise.
+ */
+bool virtio_blk_init();
+
+/**
+ * @brief Reads data from the block device, the range is split into requests that
+ *        are all submitted before the driver waits for the first one to complete.
+ *
+ * @param buffer The buffer to read the data into.
+ * @param address The byte address to read from.
+ * @param size The size of the data to read.
+ *
+ * @return true if the data was read successfully, false otherwise.
+ */
+bool virtio_blk_read(void* buffer, uint32_t address, uint32_t size);
+
+/**
+ * @brief Writes data to the block device, the existing contents of partially covered sectors
+ *        at both ends of the range are preserved. The data is copied into the request buffers and
+ *        the function returns without waiting for the device, errors are reported by virtio_blk_flush().
+ *
+ * @param buffer The buffer to write the data from.
+ * @param address The byte address to write to.
+ * @param size The size of the data to write.
+ *
+ * @return true if the data was queued successfully, false otherwise.
+ */
+bool virtio_blk_write(void* buffer, uint32_t address, uint32_t size);
+
+/**
+ * @brief Waits for all the queued writes and asks the device to flush its write
+ *        cache, if it has one, so that the data reaches stable storage.
+ *
+ * @return true if all the writes since the last flush succeeded, false otherwise.
+ */
+bool virtio_blk_flush();
@@ -0,0 +1,114 @@
+import sys
+
+# Compresses the kernel image for src/boot/unpack.asm, invoked by make when COMPRESS=1
+#
+# The output is a sequence of groups, each group starts with a flag byte and is followed
+# by up to 8 items, one per flag bit starting from the lowest. A set bit marks a literal byte,
+# a clear bit marks a 16 bit little-endian match: the high 12 bits hold the distance minus 1
+# and the low 4 bits the length minus 3, the bytes are copied from that far back in the output.
+
+WINDOW = 4096
+MIN_MATCH = 3
+MAX_MATCH = 18
+
+# how many earlier positions with the same 3 byte prefix are tried
+CANDIDATES = 256
+
+
+def compress(data):
+	output = bytearray()
+	chains = {}
+	position = 0
+
+	while position < len(data):
+		flags_index = len(output)
+		output.append(0)
+
+		for bit in range(8):
+			if position >= len(data):
+				break
+
+			best_length = 0
+			best_distance = 0
+			key = data[position:position + MIN_MATCH]
+
+			if len(key) == MIN_MATCH:
+				for candidate in reversed(chains.get(key, [])[-CANDIDATES:]):
+					distance = position - candidate
+
+					if distance > WINDOW:
+						break
+
+					length = 0
+					while length < MAX_MATCH and position + length < len(data) and data[candidate + length] == data[position + length]:
+						length += 1
+
+					if length > best_length:
+						best_length = length
+						best_distance = distance
+
+						if length == MAX_MATCH:
+							break
+
+			if best_length >= MIN_MATCH:
+				word = ((best_distance - 1) << 4) | (best_length - MIN_MATCH)
+				output += word.to_bytes(2, 'little')
+				step = best_length
+			else:
+				output[flags_index] |= 1 << bit
+				output.append(data[position])
+				step = 1
+
+			for i in range(position, position + step):
+				chains.setdefault(data[i:i + MIN_MATCH], []).append(i)
+
+			position += step
+
+	return bytes(output)
+
+
+# Mirrors the decoder in unpack.asm, used to check the output before it goes into the image
+def decompress(data):
+	output = bytearray()
+	position = 0
+
+	while position < len(data):
+		flags = data[position]
+		position += 1
+
+		for bit in range(8):
+			if position >= len(data):
+				break
+
+			if flags & (1 << bit):
+				output.append(data[position])
+				position += 1
+				continue
+
+			word = int.from_bytes(data[position:position + 2], 'little')
+			position += 2
+
+			start = len(output) - (word >> 4) - 1
+			for i in range((word & 0xF) + MIN_MATCH):
+				output.append(output[start + i])
+
+	return bytes(output)
+
+
+def sectors(size):
+	return (size + 511) // 512
+
+
+if __name__ == '__main__':
+	with open(sys.argv[1], 'rb') as file:
+		data = file.read()
+
+	packed = compress(data)
+
+	if decompress(packed) != data:
+		sys.exit('lzss: round trip check failed')
+
+	with open(sys.argv[2], 'wb') as file:
+		file.write(packed)
+
+	print(f'lzss: {len(data)} -> {len(packed)} bytes, {sectors(len(data))} -> {sectors(len(packed))} sectors to load')
@@ -13,6 +13,9 @@ spec_impl = [
 	"sys_read",
 	"sys_creat",
 	"sys_lseek",
+	"sys_sync",
+	"sys_fsync",
+	"sys_fdatasync",
 	"sys_openat",
 	"sys_mkdir",
 	"sys_readlink",
@@ -41,8 +44,21 @@ spec_impl = [
 	"sys_newuname",
     "sys_brk",
     "sys_exit",
+	"sys_truncate",
+	"sys_ftruncate",
+	"sys_truncate64",
+	"sys_ftruncate64",
+	"sys_fallocate",
 ]
 
+# Override the number of registers passed to syscalls that take 64 bit
+# arguments, on i386 each of them is split into two registers
+spec_args = {
+	"sys_truncate64": 3,
+	"sys_ftruncate64": 3,
+	"sys_fallocate": 6,
+}
+
 # Add all syscalls implemented in ASM at the interrupt level here
 spec_nude = [
 ]
@@ -101,6 +117,9 @@ for syscall in syscalls:
 #	print(" edi: " + edi)
 #	print()
 
+	if name in spec_args:
+		args = spec_args[name]
+
 	value = "NULL"
 
 	if name in spec_impl: